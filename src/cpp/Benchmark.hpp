@@ -0,0 +1,40 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+
+
+//
+// A minimal harness for timing ataqv's inner loops. Each benchmark is
+// a function registered by constructing a static Benchmark, which
+// run_ataqv_benchmarks calls in turn, from a directory containing the
+// test data.
+//
+class Benchmark {
+public:
+    typedef std::function<void()> Function;
+
+    std::string name;
+    Function function;
+
+    Benchmark(const std::string& name, const Function& function);
+
+    static std::vector<Benchmark*>& registry();
+};
+
+
+//
+// Time a loop performing the given number of operations, and report
+// its cost per operation.
+//
+void measure(const std::string& label, const unsigned long long int operations, const std::function<void()>& loop);
+
+#endif // BENCHMARK_HPP
@@ -7,14 +7,82 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 
 #include "Features.hpp"
 
 
-Feature::Feature() {}
+ReferenceNames& ReferenceNames::registry() {
+    static ReferenceNames registry;
+    return registry;
+}
+
+
+int ReferenceNames::id(const std::string& name) {
+    ReferenceNames& registry = ReferenceNames::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    auto it = registry.ids.find(name);
+    if (it != registry.ids.end()) {
+        return it->second;
+    }
+
+    int id = registry.names.size();
+    registry.ids[name] = id;
+    registry.names.push_back(name);
+    registry.ranked = false;
+    return id;
+}
+
+
+const std::string& ReferenceNames::name(const int id) {
+    ReferenceNames& registry = ReferenceNames::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    return registry.names.at(id);
+}
+
+
+unsigned int ReferenceNames::rank(const int id) {
+    ReferenceNames& registry = ReferenceNames::registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    if (!registry.ranked) {
+        // names that sort_strings_numerically considers equal, like
+        // chr1 and chr01, keep the order they were added in
+        std::vector<int> order(registry.names.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&registry](const int a, const int b) {
+            return sort_strings_numerically(registry.names[a], registry.names[b]);
+        });
+
+        registry.ranks.resize(order.size());
+        for (size_t rank = 0; rank < order.size(); rank++) {
+            registry.ranks[order[rank]] = rank;
+        }
+        registry.ranked = true;
+    }
+
+    return registry.ranks.at(id);
+}
+
+
+//
+// Whether the first reference comes before the second in natural
+// order. References are only ranked when they differ, so comparisons
+// within a reference, the common case, never need the registry.
+//
+bool ReferenceNames::precedes(const int id1, const int id2) {
+    return id1 != id2 && rank(id1) < rank(id2);
+}
+
+
+Feature::Feature() : reference_id(ReferenceNames::id(reference)) {}
 
 Feature::Feature(const std::string& reference, unsigned long long int start, unsigned long long int end, const std::string& name, const double score, const std::string& strand) :
     reference(reference),
+    reference_id(ReferenceNames::id(reference)),
     start(start),
     end(end),
     name(name),
@@ -24,6 +92,7 @@ Feature::Feature(const std::string& reference, unsigned long long int start, uns
 
 Feature::Feature(const bam_hdr_t *header, const bam1_t *record) :
     reference(std::string(header->target_name[record->core.tid])),
+    reference_id(ReferenceNames::id(reference)),
     start(record->core.pos),
     end(bam_endpos(record)),
     name(get_qname(record)),
@@ -32,7 +101,7 @@ Feature::Feature(const bam_hdr_t *header, const bam1_t *record) :
 
 bool operator== (const Feature& f1, const Feature& f2) {
     return (
-        f1.reference == f2.reference &&
+        f1.reference_id == f2.reference_id &&
         f1.start == f2.start &&
         f1.end == f2.end &&
         f1.name == f2.name
@@ -41,8 +110,8 @@ bool operator== (const Feature& f1, const Feature& f2) {
 
 
 bool operator< (const Feature& f1, const Feature& f2) {
-    return (sort_strings_numerically(f1.reference, f2.reference) ||
-            (f1.reference == f2.reference &&
+    return (ReferenceNames::precedes(f1.reference_id, f2.reference_id) ||
+            (f1.reference_id == f2.reference_id &&
              (f1.start < f2.start ||
               (f1.start == f2.start &&
                (f1.end < f2.end ||
@@ -52,7 +121,7 @@ bool operator< (const Feature& f1, const Feature& f2) {
 
 
 bool feature_overlap_comparator(const Feature& f1, const Feature& f2) {
-    return sort_strings_numerically(f1.reference, f2.reference) || f1.end < f2.start;
+    return ReferenceNames::precedes(f1.reference_id, f2.reference_id) || f1.end < f2.start;
 }
 
 
@@ -78,13 +147,14 @@ std::istream& operator>>(std::istream& is, Feature& feature) {
     std::getline(is, feature_string);
     feature_stream.str(feature_string);
     feature_stream >> feature.reference >> feature.start >> feature.end >> feature.name >> feature.score >> feature.strand;
+    feature.reference_id = ReferenceNames::id(feature.reference);
     return is;
 }
 
 
 bool Feature::overlaps(const Feature& other) const {
     return
-        reference == other.reference && (
+        reference_id == other.reference_id && (
             (
                 (start <= other.start && other.start < end) ||
                 (start < other.end && other.end < end)
@@ -97,8 +167,114 @@ bool Feature::overlaps(const Feature& other) const {
 }
 
 
+uint32_t NamePool::add(const std::string& name) {
+    if (name.empty()) {
+        return 0;
+    }
+
+    size_t offset = names.size();
+    if (offset + name.size() >= (1 << 30)) {
+        throw std::length_error("Too many feature names to pool.");
+    }
+    names.append(name);
+    names.push_back('\0');
+    return offset;
+}
+
+
+const char* NamePool::get(const uint32_t offset) const {
+    return names.c_str() + offset;
+}
+
+
+//
+// The bytes taken by the names.
+//
+size_t NamePool::size() const {
+    return names.size();
+}
+
+
+void NamePool::shrink_to_fit() {
+    names.shrink_to_fit();
+}
+
+
+static uint32_t checked_coordinate(const unsigned long long int coordinate) {
+    if (coordinate > UINT32_MAX) {
+        throw std::out_of_range("Feature coordinate " + std::to_string(coordinate) + " is too large to index.");
+    }
+    return coordinate;
+}
+
+
+static uint32_t strand_code(const std::string& strand) {
+    return strand == "+" ? Interval::FORWARD : (strand == "-" ? Interval::REVERSE : Interval::UNSTRANDED);
+}
+
+
+Interval::Interval() : reference_id(-1), start(0), end(0), name(0), strand(UNSTRANDED) {}
+
+
+Interval::Interval(const Feature& feature) :
+    reference_id(feature.reference_id),
+    start(checked_coordinate(feature.start)),
+    end(checked_coordinate(feature.end)),
+    name(0),
+    strand(strand_code(feature.strand)) {}
+
+
+Interval::Interval(const Feature& feature, NamePool& names) : Interval(feature) {
+    name = names.add(feature.name);
+}
+
+
+Interval::Interval(const bam1_t* record, const int reference_id) :
+    reference_id(reference_id),
+    start(record->core.pos),
+    end(bam_endpos(record)),
+    name(0),
+    strand(IS_UNMAPPED(record) ? UNSTRANDED : (IS_REVERSE(record) ? REVERSE : FORWARD)) {}
+
+
+bool Interval::is_reverse() const {
+    return strand == REVERSE;
+}
+
+
+bool Interval::overlaps(const Interval& other) const {
+    return
+        reference_id == other.reference_id && (
+            (
+                (start <= other.start && other.start < end) ||
+                (start < other.end && other.end < end)
+            ) ||
+            (
+                (other.start <= start && start < other.end) ||
+                (other.start < end && end < other.end)
+            )
+        );
+}
+
+
+unsigned long long int Interval::size() const {
+    return end - start;
+}
+
+
+bool interval_overlap_comparator(const Interval& i1, const Interval& i2) {
+    return ReferenceNames::precedes(i1.reference_id, i2.reference_id) || i1.end < i2.start;
+}
+
+
+Feature Interval::to_feature(const NamePool& names) const {
+    static const char* strands[] = {".", "+", "-"};
+    return Feature(ReferenceNames::name(reference_id), start, end, names.get(name), 0.0, strands[strand]);
+}
+
+
 void ReferenceFeatureCollection::add(const Feature& feature) {
-    features.push_back(feature);
+    features.push_back(Interval(feature, names));
 
     if (reference != feature.reference) {
         if (reference.empty()) {
@@ -118,43 +294,188 @@ void ReferenceFeatureCollection::add(const Feature& feature) {
 }
 
 
+//
+// Sort the features by position. Features at the same position stay
+// in the order they were added.
+//
+void ReferenceFeatureCollection::sort() {
+    std::stable_sort(features.begin(), features.end(), [](const Interval& i1, const Interval& i2) {
+        return i1.start < i2.start || (i1.start == i2.start && i1.end < i2.end);
+    });
+}
+
+
 void FeatureTree::add(Feature& feature) {
-    tree[feature.reference].add(feature);
+    if (built) {
+        throw std::logic_error("Cannot add features to a tree that has been built.");
+    }
+    get_reference_feature_collection(feature.reference)->add(feature);
 }
 
 
-ReferenceFeatureCollection* FeatureTree::get_reference_feature_collection(const std::string& reference_name) {
-    return &tree[reference_name];
+//
+// Once every feature has been added, sort each reference's, once, and
+// freeze the tree, so that it's only read from here on.
+//
+void FeatureTree::build() {
+    for (auto& rfc : tree) {
+        rfc.sort();
+        rfc.features.shrink_to_fit();
+        rfc.names.shrink_to_fit();
+    }
+    built = true;
 }
 
 
-void FeatureTree::print_reference_feature_counts(std::ostream* os) {
-    std::ostream out(os ? os->rdbuf() : std::cout.rdbuf());
-    for (auto reffeatures : tree) {
-        out << reffeatures.first << " feature count: " << reffeatures.second.features.size() << std::endl;
+ReferenceFeatureCollection* FeatureTree::get_reference_feature_collection(const std::string& reference_name) {
+    size_t reference_id = ReferenceNames::id(reference_name);
+    if (reference_id >= tree.size()) {
+        tree.resize(reference_id + 1);
     }
+    return &tree[reference_id];
 }
 
 
-std::vector<std::string> FeatureTree::get_references_by_feature_count() {
-    std::vector<std::pair<unsigned long long int, std::string>> references_by_feature_count = {};
-    for (auto it : tree) {
-        references_by_feature_count.push_back(std::pair<unsigned long long int, std::string>(it.second.features.size(), it.first));
+//
+// The IDs of the references with features, in natural order.
+//
+std::vector<int> FeatureTree::reference_ids() const {
+    std::vector<int> reference_ids;
+    for (size_t reference_id = 0; reference_id < tree.size(); reference_id++) {
+        if (!tree[reference_id].features.empty()) {
+            reference_ids.push_back(reference_id);
+        }
     }
+    std::sort(reference_ids.begin(), reference_ids.end(), reference_order());
+    return reference_ids;
+}
 
-    std::vector<std::string> references;
 
-    for (auto reference = references_by_feature_count.crbegin(); reference != references_by_feature_count.crend(); reference++ ) {
-        references.push_back(reference->second);
+void FeatureTree::print_reference_feature_counts(std::ostream* os) {
+    std::ostream out(os ? os->rdbuf() : std::cout.rdbuf());
+    for (int reference_id : reference_ids()) {
+        out << tree[reference_id].reference << " feature count: " << tree[reference_id].features.size() << std::endl;
     }
-    return references;
 }
 
 
 size_t FeatureTree::size() const {
     size_t size = 0;
-    for (auto reffeatures : tree) {
-        size += reffeatures.second.features.size();
+    for (const auto& reffeatures : tree) {
+        size += reffeatures.features.size();
     }
     return size;
 }
+
+
+void ExcludedRegionIndex::add(const Feature& region) {
+    if (built) {
+        throw std::logic_error("Cannot add regions to an index that has been built.");
+    }
+    if ((size_t) region.reference_id >= regions.size()) {
+        regions.resize(region.reference_id + 1);
+    }
+    regions[region.reference_id].push_back(Interval(region, names));
+    count++;
+}
+
+
+//
+// Once every region has been added, sort each reference's, and merge
+// them into the spans that intervals are looked up in.
+//
+void ExcludedRegionIndex::build() {
+    spans.assign(regions.size(), {});
+    for (size_t reference_id = 0; reference_id < regions.size(); reference_id++) {
+        std::vector<Interval>& reference_regions = regions[reference_id];
+        std::stable_sort(reference_regions.begin(), reference_regions.end(), [](const Interval& i1, const Interval& i2) {
+            return i1.start < i2.start || (i1.start == i2.start && i1.end < i2.end);
+        });
+        reference_regions.shrink_to_fit();
+
+        std::vector<Span>& reference_spans = spans[reference_id];
+        for (size_t i = 0; i < reference_regions.size(); i++) {
+            const Interval& region = reference_regions[i];
+            const uint32_t end = std::max(region.end, region.start + 1);
+            if (!reference_spans.empty() && region.start <= reference_spans.back().end) {
+                reference_spans.back().end = std::max(reference_spans.back().end, end);
+                reference_spans.back().last = i + 1;
+            } else {
+                reference_spans.push_back(Span{region.start, end, i, i + 1});
+            }
+        }
+        reference_spans.shrink_to_fit();
+    }
+    names.shrink_to_fit();
+    built = true;
+}
+
+
+//
+// The span that could contain regions overlapping the interval: the
+// last on its reference starting before the interval ends, if it
+// reaches past the interval's start.
+//
+const ExcludedRegionIndex::Span* ExcludedRegionIndex::find_span(const Interval& interval) const {
+    if (interval.reference_id < 0 || (size_t) interval.reference_id >= spans.size()) {
+        return nullptr;
+    }
+
+    const std::vector<Span>& reference_spans = spans[interval.reference_id];
+    const uint32_t last_start = interval.end > interval.start ? interval.end - 1 : interval.start;
+    auto span = std::upper_bound(reference_spans.begin(), reference_spans.end(), last_start, [](const uint32_t start, const Span& s) {
+        return start < s.start;
+    });
+    if (span == reference_spans.begin()) {
+        return nullptr;
+    }
+    span--;
+    return span->end > interval.start ? &*span : nullptr;
+}
+
+
+//
+// Whether the interval overlaps any region, as Interval::overlaps
+// would find comparing it to each in turn. Only an empty interval can
+// fall in a span without overlapping one of its regions, when they're
+// empty too, so only then are the regions themselves checked.
+//
+bool ExcludedRegionIndex::overlaps(const Interval& interval) const {
+    const Span* span = find_span(interval);
+    return span != nullptr && (interval.end > interval.start || find_overlap(interval) != nullptr);
+}
+
+
+//
+// A region the interval overlaps, the one starting last if several
+// do, or nullptr if none does.
+//
+const Interval* ExcludedRegionIndex::find_overlap(const Interval& interval) const {
+    const Span* span = find_span(interval);
+    if (span == nullptr) {
+        return nullptr;
+    }
+
+    const std::vector<Interval>& reference_regions = regions[interval.reference_id];
+    for (size_t i = span->last; i-- > span->first;) {
+        if (reference_regions[i].overlaps(interval)) {
+            return &reference_regions[i];
+        }
+    }
+    return nullptr;
+}
+
+
+Feature ExcludedRegionIndex::to_feature(const Interval& region) const {
+    return region.to_feature(names);
+}
+
+
+size_t ExcludedRegionIndex::size() const {
+    return count;
+}
+
+
+bool ExcludedRegionIndex::empty() const {
+    return count == 0;
+}
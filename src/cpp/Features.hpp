@@ -7,14 +7,53 @@
 #ifndef FEATURES_HPP
 #define FEATURES_HPP
 
+#include <cstdint>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "HTS.hpp"
 
 
+//
+// Reference names interned as dense IDs, shared by every feature and
+// tree in the process. Each name's rank in natural order (that of
+// sort_strings_numerically) is computed once, whenever names have
+// been added since the last ranking, so references can be ordered by
+// comparing integers instead of parsing their names.
+//
+class ReferenceNames {
+public:
+    static int id(const std::string& name);
+    static const std::string& name(const int id);
+    static unsigned int rank(const int id);
+    static bool precedes(const int id1, const int id2);
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, int> ids = {};
+    std::deque<std::string> names = {};
+    std::vector<unsigned int> ranks = {};
+    bool ranked = true;
+
+    static ReferenceNames& registry();
+};
+
+
+// orders reference IDs by their names' natural order
+struct reference_order {
+    bool operator() (const int id1, const int id2) const {
+        return ReferenceNames::precedes(id1, id2);
+    }
+};
+
+
 class Feature {
 public:
     std::string reference = "";
+    int reference_id = -1;
     unsigned long long int start = 0;
     unsigned long long int end = 0;
     std::string name = "";
@@ -38,29 +77,126 @@ std::istream& operator>>(std::istream& is, Feature& feature);
 
 bool feature_overlap_comparator(const Feature& f1, const Feature& f2);
 
+
+//
+// The names of an index's features, each stored NUL terminated in a
+// single buffer and referred to by its offset. The empty name is at
+// offset zero.
+//
+class NamePool {
+public:
+    uint32_t add(const std::string& name);
+    const char* get(const uint32_t offset) const;
+    size_t size() const;
+    void shrink_to_fit();
+
+private:
+    std::string names = std::string(1, '\0');
+};
+
+
+//
+// A feature packed into sixteen bytes, for the indexes of TSS, peaks
+// and excluded regions, which can hold hundreds of thousands. Its
+// name is an offset in the index's NamePool, and its score isn't
+// kept. Made from an alignment, or from a Feature without a pool, it
+// has no name, and serves as a view for overlap tests that doesn't
+// allocate anything.
+//
+struct Interval {
+    enum Strand {UNSTRANDED = 0, FORWARD = 1, REVERSE = 2};
+
+    int32_t reference_id;
+    uint32_t start;
+    uint32_t end;
+    uint32_t name : 30;
+    uint32_t strand : 2;
+
+    Interval();
+    Interval(const Feature& feature);
+    Interval(const Feature& feature, NamePool& names);
+    Interval(const bam1_t* record, const int reference_id);
+
+    bool is_reverse() const;
+    bool overlaps(const Interval& other) const;
+    unsigned long long int size() const;
+    Feature to_feature(const NamePool& names) const;
+};
+
+bool interval_overlap_comparator(const Interval& i1, const Interval& i2);
+
+
 class ReferenceFeatureCollection {
 public:
     std::string reference = "";
-    std::vector<Feature> features = {};
+    NamePool names = {};
+    std::vector<Interval> features = {};
 
     unsigned long long int start = 0;
     unsigned long long int end = 0;
 
     void add(const Feature& feature);
+    void sort();
 };
 
 
 class FeatureTree {
 private:
-    std::map<std::string, ReferenceFeatureCollection, numeric_string_comparator> tree = {};
+    // collections by reference ID
+    std::vector<ReferenceFeatureCollection> tree = {};
+
+    // whether build has frozen the collections
+    bool built = false;
 
 public:
+    std::vector<int> reference_ids() const;
     void add(Feature& feature);
+    void build();
     ReferenceFeatureCollection* get_reference_feature_collection(const std::string& reference_name);
-    std::vector<std::string> get_references_by_feature_count();
     void print_reference_feature_counts(std::ostream* os = nullptr);
     size_t size() const;
 };
 
 
+//
+// Excluded regions, like the ENCODE blacklist, indexed by reference.
+// Once built, each reference's regions are sorted, and merged where
+// they overlap into disjoint spans, so whether an interval overlaps
+// any region is a binary search of its reference's spans. The regions
+// are kept to say which one an interval overlaps.
+//
+class ExcludedRegionIndex {
+public:
+    void add(const Feature& region);
+    void build();
+    bool overlaps(const Interval& interval) const;
+    const Interval* find_overlap(const Interval& interval) const;
+    Feature to_feature(const Interval& region) const;
+    size_t size() const;
+    bool empty() const;
+
+private:
+    // a run of overlapping regions, covering regions [first, last) of
+    // its reference; empty regions are given a length of one, as
+    // they overlap whatever contains their start
+    struct Span {
+        uint32_t start;
+        uint32_t end;
+        size_t first;
+        size_t last;
+    };
+
+    NamePool names = {};
+
+    // regions and spans by reference ID
+    std::vector<std::vector<Interval>> regions = {};
+    std::vector<std::vector<Span>> spans = {};
+
+    size_t count = 0;
+    bool built = false;
+
+    const Span* find_span(const Interval& interval) const;
+};
+
+
 #endif // FEATURES_HPP
@@ -1,6 +1,9 @@
 #include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <new>
 #include <string>
+#include <utility>
 
 #include "HTS.hpp"
 
@@ -45,3 +48,125 @@ sam_header parse_sam_header(const std::string &header_text) {
 
     return header;
 }
+
+
+const int ReadGroupIndex::NOT_FOUND;
+
+
+//
+// FNV-1a, measuring the ID as it goes.
+//
+static uint64_t hash_read_group_id(const char* id, size_t& length) {
+    uint64_t hash = 14695981039346656037ULL;
+    const char* c = id;
+    for (; *c; c++) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    }
+    length = c - id;
+    return hash;
+}
+
+
+//
+// Return the slot holding the given ID, or the empty slot where it
+// would go.
+//
+size_t ReadGroupIndex::probe(const uint64_t hash, const char* id, const size_t length) const {
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const Slot& slot = slots[i];
+        if (slot.ordinal == NOT_FOUND) {
+            return i;
+        }
+        if (slot.hash == hash) {
+            const std::string& candidate = ids[slot.ordinal];
+            if (candidate.size() == length && std::memcmp(candidate.data(), id, length) == 0) {
+                return i;
+            }
+        }
+    }
+}
+
+
+int ReadGroupIndex::find(const char* id) const {
+    size_t length;
+    uint64_t hash = hash_read_group_id(id, length);
+    return slots[probe(hash, id, length)].ordinal;
+}
+
+
+//
+// Return the ordinal of the given ID, adding it if it's new.
+//
+int ReadGroupIndex::intern(const std::string& id) {
+    size_t length;
+    uint64_t hash = hash_read_group_id(id.c_str(), length);
+    size_t i = probe(hash, id.c_str(), length);
+    if (slots[i].ordinal != NOT_FOUND) {
+        return slots[i].ordinal;
+    }
+
+    if (2 * (ids.size() + 1) > slots.size()) {
+        std::vector<Slot> old_slots(2 * slots.size());
+        old_slots.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot& slot : old_slots) {
+            if (slot.ordinal != NOT_FOUND) {
+                size_t j = slot.hash & mask;
+                while (slots[j].ordinal != NOT_FOUND) {
+                    j = (j + 1) & mask;
+                }
+                slots[j] = slot;
+            }
+        }
+        i = probe(hash, id.c_str(), length);
+    }
+
+    slots[i].hash = hash;
+    slots[i].ordinal = (int) ids.size();
+    ids.push_back(id);
+    return slots[i].ordinal;
+}
+
+
+const std::string& ReadGroupIndex::id(const int ordinal) const {
+    return ids.at(ordinal);
+}
+
+
+size_t ReadGroupIndex::size() const {
+    return ids.size();
+}
+
+
+AlignmentBatch::AlignmentBatch(const size_t capacity) {
+    records.reserve(capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        bam1_t* record = bam_init1();
+        if (record == nullptr) {
+            for (bam1_t* allocated : records) {
+                bam_destroy1(allocated);
+            }
+            throw std::bad_alloc();
+        }
+        records.push_back(record);
+    }
+}
+
+
+AlignmentBatch::AlignmentBatch(AlignmentBatch&& other) : records(std::move(other.records)), size(other.size) {
+    other.records.clear();
+    other.size = 0;
+}
+
+
+AlignmentBatch::~AlignmentBatch() {
+    for (bam1_t* record : records) {
+        bam_destroy1(record);
+    }
+}
+
+
+size_t AlignmentBatch::capacity() const {
+    return records.size();
+}
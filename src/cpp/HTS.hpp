@@ -7,13 +7,16 @@
 #ifndef HTS_HPP
 #define HTS_HPP
 
+#include <cstdint>
 #include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <htslib/bgzf.h>
 #include <htslib/kstring.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 
 #include "Exceptions.hpp"
 #include "Utils.hpp"
@@ -41,4 +44,54 @@ typedef std::map<std::string, std::vector<std::map<std::string, std::string>>> s
 std::string get_qname(const bam1_t* record);
 std::string record_to_string(const bam_hdr_t* header, const bam1_t* record);
 sam_header parse_sam_header(const std::string &header_text);
+
+
+//
+// Read group IDs interned as dense ordinals, in the order they were
+// added, so a record's RG tag can be resolved straight from its aux
+// bytes without building a string or searching an ordered map. The
+// IDs are kept in an open-addressing table with linear probing,
+// which is never more than half full.
+//
+class ReadGroupIndex {
+public:
+    static const int NOT_FOUND = -1;
+
+    int find(const char* id) const;
+    int intern(const std::string& id);
+    const std::string& id(const int ordinal) const;
+    size_t size() const;
+
+private:
+    struct Slot {
+        uint64_t hash = 0;
+        int ordinal = NOT_FOUND;
+    };
+
+    std::vector<std::string> ids = {};
+    std::vector<Slot> slots = std::vector<Slot>(16);
+
+    size_t probe(const uint64_t hash, const char* id, const size_t length) const;
+};
+
+
+//
+// Alignment records allocated once and read into over and over, so
+// filling a batch allocates nothing once each record's data buffer
+// has grown to fit. The first size records hold the batch's reads.
+//
+class AlignmentBatch {
+public:
+    std::vector<bam1_t*> records = {};
+    size_t size = 0;
+
+    explicit AlignmentBatch(const size_t capacity);
+    AlignmentBatch(AlignmentBatch&& other);
+    ~AlignmentBatch();
+
+    AlignmentBatch(const AlignmentBatch&) = delete;
+    AlignmentBatch& operator=(const AlignmentBatch&) = delete;
+
+    size_t capacity() const;
+};
 #endif
@@ -0,0 +1,321 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#include <cmath>
+#include <iomanip>
+
+#include "MetricModules.hpp"
+#include "Metrics.hpp"
+#include "Utils.hpp"
+
+
+std::string MapqModule::name() {
+    return "mapq";
+}
+
+
+std::string MapqModule::description() {
+    return "the distribution of mapping quality";
+}
+
+
+void MapqModule::merge(const MapqModule& other) {
+    for (size_t mapq = 0; mapq < counts.size(); mapq++) {
+        counts[mapq] += other.counts[mapq];
+    }
+}
+
+
+unsigned long long int MapqModule::total() const {
+    unsigned long long int total_reads = 0;
+    for (size_t mapq = 0; mapq < counts.size(); mapq++) {
+        total_reads += counts[mapq];
+    }
+    return total_reads;
+}
+
+
+double MapqModule::mean() const {
+    unsigned long long int total_mapq = 0;
+    for (size_t mapq = 0; mapq < counts.size(); mapq++) {
+        total_mapq += mapq * counts[mapq];
+    }
+    return (double) total_mapq / total();
+}
+
+
+double MapqModule::median() const {
+    double median = 0.0;
+
+    unsigned long long int total_reads = total();
+    if (total_reads == 0) {
+        return 0;
+    }
+
+    unsigned long long int median1;
+    unsigned long long int median2;
+
+    // if the number of reads is even, we need to take the mean of the
+    // two values around the ideal median, but with an odd number of
+    // reads, we just need the existent median value
+
+    if (total_reads % 2 == 0) {
+        median1 = (total_reads / 2) - 1;
+        median2 = total_reads / 2;
+    } else {
+        median1 = median2 = total_reads / 2;
+    }
+
+    unsigned long long int mapq_index = 0;
+    for (size_t mapq = 0; mapq < counts.size(); mapq++) {
+        if (counts[mapq] == 0) {
+            continue;
+        }
+
+        unsigned long long int next_mapq_index = mapq_index + counts[mapq];
+        bool median1_here = (mapq_index <= median1 && median1 <= next_mapq_index);
+        bool median2_here = (mapq_index <= median2 && median2 <= next_mapq_index);
+
+        if (median1_here) {
+            median += mapq;
+        }
+
+        if (median2_here) {
+            median += mapq;
+            median /= 2;
+        }
+        mapq_index += counts[mapq];
+    }
+    return median;
+}
+
+
+void MapqModule::to_json(const Metrics&, const MetricsCollector&, nlohmann::json& json) const {
+    nlohmann::json mapq_counts_json;
+    for (size_t mapq = 0; mapq < counts.size(); mapq++) {
+        if (counts[mapq]) {
+            nlohmann::json mc;
+            mc.push_back(mapq);
+            mc.push_back(counts[mapq]);
+            mapq_counts_json.push_back(mc);
+        }
+    }
+
+    json["mapq_counts_fields"] = std::vector<std::string>{"mapq", "read_count"};
+    json["mapq_counts"] = mapq_counts_json;
+    json["mean_mapq"] = mean();
+    json["median_mapq"] = median();
+}
+
+
+void MapqModule::write(const Metrics& m, std::ostream& os) const {
+    os << std::endl
+
+       << "  Mapping Quality" << std::endl
+       << "  ---------------" << std::endl;
+    if (!m.less_redundant) {
+       os << "  Mean MAPQ: " << std::fixed << mean() << std::endl
+       << "  Median MAPQ: " << std::fixed << median() << std::endl;
+    }
+    os << "  Reads with MAPQ >=..." << std::endl;
+
+    for (int threshold = 5; threshold <= 30; threshold += 5) {
+        unsigned long long int count = 0;
+        for (size_t mapq = threshold; mapq < counts.size(); mapq++) {
+            count += counts[mapq];
+        }
+        os << std::setfill(' ') << std::setw(20) << std::right << threshold << ": " << count << percentage_string(count, m.total_reads) << std::endl;
+    }
+}
+
+
+void MapqModule::partial_state(const MetricsCollector&, nlohmann::json& state) const {
+    std::map<int, unsigned long long int> observed_mapq_counts;
+    for (size_t mapq = 0; mapq < counts.size(); mapq++) {
+        if (counts[mapq]) {
+            observed_mapq_counts[mapq] = counts[mapq];
+        }
+    }
+    state["mapq_counts"] = map_to_pairs(observed_mapq_counts);
+}
+
+
+void MapqModule::load_partial_state(MetricsCollector&, const nlohmann::json& state) {
+    counts.fill(0);
+    for (const auto& it : pairs_to_map<int, unsigned long long int>(state.at("mapq_counts"))) {
+        counts.at(it.first) = it.second;
+    }
+}
+
+
+std::string FragmentLengthModule::name() {
+    return "fragment-lengths";
+}
+
+
+std::string FragmentLengthModule::description() {
+    return "the distribution of HQAA fragment lengths";
+}
+
+
+void FragmentLengthModule::configure(const MetricsCollector& collector) {
+    counts.assign(collector.fragment_length_ceiling + 1, 0);
+    long_counts.clear();
+}
+
+
+void FragmentLengthModule::merge(const FragmentLengthModule& other) {
+    for (size_t fragment_length = 0; fragment_length < other.counts.size(); fragment_length++) {
+        if (other.counts[fragment_length]) {
+            add(fragment_length, other.counts[fragment_length]);
+        }
+    }
+
+    for (const auto& it : other.long_counts) {
+        add(it.first, it.second);
+    }
+}
+
+
+unsigned long long int FragmentLengthModule::count(const unsigned long long int fragment_length) const {
+    if (fragment_length < counts.size()) {
+        return counts[fragment_length];
+    }
+
+    auto it = long_counts.find(fragment_length);
+    return it == long_counts.end() ? 0 : it->second;
+}
+
+
+void FragmentLengthModule::to_json(const Metrics& m, const MetricsCollector&, nlohmann::json& json) const {
+    nlohmann::json fragment_length_counts_json;
+    int max_fragment_length = 1000;
+
+    for (int fragment_length = 0; fragment_length <= max_fragment_length; fragment_length++) {
+        unsigned long long int fragment_count = count(fragment_length);
+        nlohmann::json flc;
+        flc.push_back(fragment_length);
+        flc.push_back(fragment_count);
+        long double fraction_of_total_reads = m.total_reads == 0 ? std::nan("") : fragment_count / (long double) m.total_reads;
+        flc.push_back(fraction_of_total_reads);
+
+        fragment_length_counts_json.push_back(flc);
+    }
+
+    json["fragment_length_counts_fields"] = std::vector<std::string>{"fragment_length", "read_count", "fraction_of_all_reads"};
+    json["fragment_length_counts"] = fragment_length_counts_json;
+    json["fragment_length_distance"] = nullptr;
+}
+
+
+void FragmentLengthModule::partial_state(const MetricsCollector&, nlohmann::json& state) const {
+    // saved sparsely
+    std::map<unsigned long long int, unsigned long long int> all_fragment_length_counts(long_counts);
+    for (size_t fragment_length = 0; fragment_length < counts.size(); fragment_length++) {
+        if (counts[fragment_length]) {
+            all_fragment_length_counts[fragment_length] = counts[fragment_length];
+        }
+    }
+    state["fragment_length_counts"] = map_to_pairs(all_fragment_length_counts);
+}
+
+
+void FragmentLengthModule::load_partial_state(MetricsCollector& collector, const nlohmann::json& state) {
+    configure(collector);
+    for (const auto& it : pairs_to_map<unsigned long long int, unsigned long long int>(state.at("fragment_length_counts"))) {
+        add(it.first, it.second);
+    }
+}
+
+
+std::string ChromosomeModule::name() {
+    return "chromosomes";
+}
+
+
+std::string ChromosomeModule::description() {
+    return "HQAA by reference";
+}
+
+
+void ChromosomeModule::configure(const MetricsCollector& collector) {
+    counts.assign(collector.reference_classifications.size(), 0);
+}
+
+
+//
+// Add to a reference's HQAA count, making room for tids added to the
+// collector's table after these counts were configured.
+//
+void ChromosomeModule::add(const int tid, const unsigned long long int count) {
+    if ((size_t) tid >= counts.size()) {
+        counts.resize(tid + 1, 0);
+    }
+    counts[tid] += count;
+}
+
+
+void ChromosomeModule::merge(const ChromosomeModule& other) {
+    for (size_t tid = 0; tid < other.counts.size(); tid++) {
+        if (other.counts[tid]) {
+            add(tid, other.counts[tid]);
+        }
+    }
+}
+
+
+std::map<std::string, unsigned long long int> ChromosomeModule::named_counts(const MetricsCollector& collector) const {
+    std::map<std::string, unsigned long long int> named_chromosome_counts;
+    for (size_t tid = 0; tid < counts.size(); tid++) {
+        if (counts[tid]) {
+            named_chromosome_counts[collector.reference_classifications[tid].name] = counts[tid];
+        }
+    }
+    return named_chromosome_counts;
+}
+
+
+void ChromosomeModule::to_json(const Metrics&, const MetricsCollector& collector, nlohmann::json& json) const {
+    unsigned long long int max_autosome_counts = 0;
+    unsigned long long int total_autosome_counts = 0;
+    nlohmann::json chromosome_counts_json;
+
+    // listed by name
+    for (size_t tid = 0; tid < counts.size(); tid++) {
+        if (counts[tid] && collector.reference_classifications[tid].autosomal) {
+            total_autosome_counts += counts[tid];
+            if (counts[tid] > max_autosome_counts) {
+                max_autosome_counts = counts[tid];
+            }
+        }
+    }
+
+    for (auto it : named_counts(collector)) {
+        nlohmann::json cc;
+        cc.push_back(it.first);
+        cc.push_back(it.second);
+        chromosome_counts_json.push_back(cc);
+    }
+
+    long double max_fraction_reads_from_single_autosome = total_autosome_counts == 0 ? std::nan("") : max_autosome_counts / (long double) total_autosome_counts;
+
+    json["chromosome_counts"] = chromosome_counts_json;
+    json["max_fraction_reads_from_single_autosome"] = max_fraction_reads_from_single_autosome;
+}
+
+
+void ChromosomeModule::partial_state(const MetricsCollector& collector, nlohmann::json& state) const {
+    // saved by name, as other alignment files' headers may differ
+    state["chromosome_counts"] = named_counts(collector);
+}
+
+
+void ChromosomeModule::load_partial_state(MetricsCollector& collector, const nlohmann::json& state) {
+    configure(collector);
+    for (const auto& it : state.at("chromosome_counts").get<std::map<std::string, unsigned long long int>>()) {
+        add(collector.reference_tid(it.first), it.second);
+    }
+}
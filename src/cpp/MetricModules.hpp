@@ -0,0 +1,295 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#ifndef METRICMODULES_HPP
+#define METRICMODULES_HPP
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+#include "HTS.hpp"
+
+
+class MetricsCollector;
+class Metrics;
+
+
+//
+// A metric module measures one optional aspect of a read group's
+// alignments. Modules are listed in the MetricModules registry below,
+// which calls the hooks of each one enabled on the command line,
+// without virtual calls, so each module's hooks can be inlined into
+// the per-read path. Every module provides:
+//
+//   static std::string name();
+//       what it's called on the command line
+//   static std::string description();
+//       what it measures, for the usage message
+//   void configure(const MetricsCollector& collector);
+//       sizes its counters, before any reads are observed
+//   void observe(const bam1_t* record, const uint8_t categories);
+//       each read measured, with its ReadBatchClassifier categories
+//   void observe_hqaa(const bam1_t* record, const unsigned long long int fragment_length);
+//       each read counted as HQAA
+//   void merge(const Module& other);
+//   void finalize(const Metrics& metrics);
+//   void to_json(const Metrics& metrics, const MetricsCollector& collector, nlohmann::json& json) const;
+//       adds its fields to the JSON metrics
+//   void write(const Metrics& metrics, std::ostream& os) const;
+//       adds its section to the text report, if it has one
+//   void partial_state(const MetricsCollector& collector, nlohmann::json& state) const;
+//   void load_partial_state(MetricsCollector& collector, const nlohmann::json& state);
+//
+// A module that doesn't need a hook leaves it empty.
+//
+
+
+//
+// The mapping quality of every read.
+//
+class MapqModule {
+public:
+    std::array<unsigned long long int, 256> counts = {};
+
+    static std::string name();
+    static std::string description();
+
+    void configure(const MetricsCollector&) {}
+
+    void observe(const bam1_t* record, const uint8_t) {
+        counts[record->core.qual]++;
+    }
+
+    void observe_hqaa(const bam1_t*, const unsigned long long int) {}
+
+    void merge(const MapqModule& other);
+    void finalize(const Metrics&) {}
+    void to_json(const Metrics& metrics, const MetricsCollector& collector, nlohmann::json& json) const;
+    void write(const Metrics& metrics, std::ostream& os) const;
+    void partial_state(const MetricsCollector& collector, nlohmann::json& state) const;
+    void load_partial_state(MetricsCollector& collector, const nlohmann::json& state);
+
+    unsigned long long int total() const;
+    double mean() const;
+    double median() const;
+};
+
+
+//
+// The distribution of HQAA fragment lengths. Lengths up to the
+// collector's fragment_length_ceiling are counted in a flat array,
+// the rare longer ones in a map.
+//
+class FragmentLengthModule {
+public:
+    std::vector<unsigned long long int> counts = {};
+    std::map<unsigned long long int, unsigned long long int> long_counts = {};
+
+    static std::string name();
+    static std::string description();
+
+    void configure(const MetricsCollector& collector);
+
+    void observe(const bam1_t*, const uint8_t) {}
+
+    void observe_hqaa(const bam1_t*, const unsigned long long int fragment_length) {
+        add(fragment_length, 1);
+    }
+
+    void merge(const FragmentLengthModule& other);
+    void finalize(const Metrics&) {}
+    void to_json(const Metrics& metrics, const MetricsCollector& collector, nlohmann::json& json) const;
+    void write(const Metrics&, std::ostream&) const {}
+    void partial_state(const MetricsCollector& collector, nlohmann::json& state) const;
+    void load_partial_state(MetricsCollector& collector, const nlohmann::json& state);
+
+    void add(const unsigned long long int fragment_length, const unsigned long long int count) {
+        if (fragment_length < counts.size()) {
+            counts[fragment_length] += count;
+        } else {
+            long_counts[fragment_length] += count;
+        }
+    }
+
+    unsigned long long int count(const unsigned long long int fragment_length) const;
+};
+
+
+//
+// HQAA by tid, named by the collector's reference_classifications.
+//
+class ChromosomeModule {
+public:
+    std::vector<unsigned long long int> counts = {};
+
+    static std::string name();
+    static std::string description();
+
+    void configure(const MetricsCollector& collector);
+
+    void observe(const bam1_t*, const uint8_t) {}
+
+    void observe_hqaa(const bam1_t* record, const unsigned long long int) {
+        counts[record->core.tid]++;
+    }
+
+    void merge(const ChromosomeModule& other);
+    void finalize(const Metrics&) {}
+    void to_json(const Metrics& metrics, const MetricsCollector& collector, nlohmann::json& json) const;
+    void write(const Metrics&, std::ostream&) const {}
+    void partial_state(const MetricsCollector& collector, nlohmann::json& state) const;
+    void load_partial_state(MetricsCollector& collector, const nlohmann::json& state);
+
+    void add(const int tid, const unsigned long long int count);
+    std::map<std::string, unsigned long long int> named_counts(const MetricsCollector& collector) const;
+};
+
+
+// the sparse counts in partial metrics are saved as [key, value] pairs
+template <typename K, typename V>
+nlohmann::json map_to_pairs(const std::map<K, V>& m) {
+    nlohmann::json pairs = nlohmann::json::array();
+    for (const auto& it : m) {
+        pairs.push_back({it.first, it.second});
+    }
+    return pairs;
+}
+
+
+template <typename K, typename V>
+std::map<K, V> pairs_to_map(const nlohmann::json& pairs) {
+    std::map<K, V> m;
+    for (const auto& pair : pairs) {
+        m[pair.at(0).get<K>()] = pair.at(1).get<V>();
+    }
+    return m;
+}
+
+
+// the position of Module in Modules
+template <typename Module, typename... Modules>
+struct metric_module_index;
+
+template <typename Module, typename... Rest>
+struct metric_module_index<Module, Module, Rest...> {
+    static const unsigned int value = 0;
+};
+
+template <typename Module, typename First, typename... Rest>
+struct metric_module_index<Module, First, Rest...> {
+    static const unsigned int value = 1 + metric_module_index<Module, Rest...>::value;
+};
+
+
+//
+// A fixed set of metric modules, any of which can be enabled. The
+// hooks are expanded over the module types at compile time, so each
+// read only costs an enabled module its inlined observe calls, and a
+// disabled one a test of its bit in the mask. Disabled modules are
+// never configured, so they don't allocate their counters either.
+//
+template <typename... Modules>
+class MetricModuleRegistry : private Modules... {
+public:
+    static std::vector<std::string> names() {
+        return {Modules::name()...};
+    }
+
+    static std::vector<std::string> descriptions() {
+        return {Modules::description()...};
+    }
+
+    // the mask enabling the named modules
+    static unsigned int mask(const std::vector<std::string>& enabled_names) {
+        std::vector<std::string> all_names = names();
+        unsigned int enabled_mask = 0;
+        for (const auto& enabled_name : enabled_names) {
+            size_t index = 0;
+            while (index < all_names.size() && all_names[index] != enabled_name) {
+                index++;
+            }
+            if (index == all_names.size()) {
+                throw std::invalid_argument("There is no metric module named \"" + enabled_name + "\".");
+            }
+            enabled_mask |= 1u << index;
+        }
+        return enabled_mask;
+    }
+
+    void configure(const MetricsCollector& collector, const unsigned int enabled_mask) {
+        enabled_modules = enabled_mask;
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().configure(collector) : void(), 0)...};
+    }
+
+    unsigned int enabled() const {
+        return enabled_modules;
+    }
+
+    template <typename Module>
+    bool is_enabled() const {
+        return enabled_modules & (1u << metric_module_index<Module, Modules...>::value);
+    }
+
+    template <typename Module>
+    Module& get() {
+        return static_cast<Module&>(*this);
+    }
+
+    template <typename Module>
+    const Module& get() const {
+        return static_cast<const Module&>(*this);
+    }
+
+    void observe(const bam1_t* record, const uint8_t categories) {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().observe(record, categories) : void(), 0)...};
+    }
+
+    void observe_hqaa(const bam1_t* record, const unsigned long long int fragment_length) {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().observe_hqaa(record, fragment_length) : void(), 0)...};
+    }
+
+    void merge(const MetricModuleRegistry& other) {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().merge(other.get<Modules>()) : void(), 0)...};
+    }
+
+    void finalize(const Metrics& metrics) {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().finalize(metrics) : void(), 0)...};
+    }
+
+    void to_json(const Metrics& metrics, const MetricsCollector& collector, nlohmann::json& json) const {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().to_json(metrics, collector, json) : void(), 0)...};
+    }
+
+    void write(const Metrics& metrics, std::ostream& os) const {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().write(metrics, os) : void(), 0)...};
+    }
+
+    void partial_state(const MetricsCollector& collector, nlohmann::json& state) const {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().partial_state(collector, state) : void(), 0)...};
+    }
+
+    void load_partial_state(MetricsCollector& collector, const nlohmann::json& state) {
+        (void) expand{0, (is_enabled<Modules>() ? get<Modules>().load_partial_state(collector, state) : void(), 0)...};
+    }
+
+private:
+    // evaluates a hook for each module in turn, left to right
+    typedef int expand[];
+
+    unsigned int enabled_modules = 0;
+};
+
+
+typedef MetricModuleRegistry<MapqModule, FragmentLengthModule, ChromosomeModule> MetricModules;
+
+#endif  // METRICMODULES_HPP
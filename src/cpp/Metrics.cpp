@@ -4,22 +4,32 @@
 // Licensed under Version 3 of the GPL or any later version
 //
 
-#include <chrono>
+#include <algorithm>
 #include <cmath>
 #include <cstdarg>
-#include <future>
+#include <cstring>
+#include <exception>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <queue>
 #include <unordered_map>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include <boost/chrono.hpp>
+#include <boost/filesystem.hpp>
 
 #include "Features.hpp"
 #include "HTS.hpp"
 #include "IO.hpp"
 #include "Metrics.hpp"
 #include "Utils.hpp"
+#include "WorkerPool.hpp"
 
 
 MetricsCollector::MetricsCollector(const std::string& name,
@@ -82,6 +92,16 @@ std::string MetricsCollector::configuration_string() const {
         << "Thread limit: " << thread_limit << std::endl
         << "Ignoring read groups: " << (ignore_read_groups ? "yes" : "no") << std::endl;
 
+    if (shard_count) {
+        cs << "Shard: " << shard_number << " of " << shard_count << std::endl;
+    }
+
+    if (drop_excluded_reads) {
+        cs << "Dropping reads overlapping excluded regions: yes" << std::endl;
+    }
+
+    cs << "Metric modules: " << (metric_modules.empty() ? "none" : join(metric_modules, ", ")) << std::endl;
+
     if (!tss_filename.empty()) {
         cs << "TSS extension: " << tss_extension << std::endl;
     }
@@ -200,25 +220,119 @@ void MetricsCollector::load_autosomal_references() {
 }
 
 
+//
+// This is called from every thread measuring alignments, so it must
+// not modify anything.
+//
 bool MetricsCollector::is_autosomal(const std::string& reference_name) {
-    static std::unordered_map<std::string, bool> refcache;
+    auto organism_references = autosomal_references.find(organism);
+    return organism_references != autosomal_references.end() && organism_references->second.count(reference_name) > 0;
+}
+
+
+bool MetricsCollector::is_mitochondrial(const std::string& reference_name) {
+    return mitochondrial_reference_name.compare(reference_name) == 0;
+}
+
+
+//
+// Classify a tid from the alignment file's header, which must have
+// been passed to classify_references.
+//
+bool MetricsCollector::is_autosomal(const int tid) const {
+    return reference_classifications[tid].autosomal;
+}
+
+
+bool MetricsCollector::is_mitochondrial(const int tid) const {
+    return reference_classifications[tid].mitochondrial;
+}
+
+
+//
+// Record how each of the header's references is to be treated,
+// before any alignments are measured.
+//
+void MetricsCollector::classify_references(const bam_hdr_t* header) {
+    reference_classifications.clear();
+    reference_classifications.reserve(header->n_targets);
+    for (int tid = 0; tid < header->n_targets; tid++) {
+        std::string reference_name(header->target_name[tid]);
+        reference_classifications.push_back({reference_name, ReferenceNames::id(reference_name), is_autosomal(reference_name), is_mitochondrial(reference_name)});
+    }
+}
 
-    if (refcache.count(reference_name) == 0) {
-        refcache[reference_name] = autosomal_references[organism].find(reference_name) != autosomal_references[organism].end();
+
+//
+// Find a reference's tid by name, adding it to the table if it's not
+// there. That only happens when merging partial metrics, which may
+// come from alignment files with different headers.
+//
+int MetricsCollector::reference_tid(const std::string& reference_name) {
+    for (size_t tid = 0; tid < reference_classifications.size(); tid++) {
+        if (reference_classifications[tid].name == reference_name) {
+            return tid;
+        }
     }
 
-    return refcache.at(reference_name);
+    reference_classifications.push_back({reference_name, ReferenceNames::id(reference_name), is_autosomal(reference_name), is_mitochondrial(reference_name)});
+    return reference_classifications.size() - 1;
 }
 
 
-bool MetricsCollector::is_mitochondrial(const std::string& reference_name) {
-    return mitochondrial_reference_name.compare(reference_name) == 0;
+//
+// Create Metrics for a read group, and intern its ID so records can
+// find them by ordinal.
+//
+Metrics* MetricsCollector::add_read_group(const std::string& read_group_id) {
+    Metrics* m = new Metrics(this, read_group_id);
+    metrics[read_group_id] = m;
+
+    size_t read_group = read_groups.intern(read_group_id);
+    if (read_group == read_group_metrics.size()) {
+        read_group_metrics.push_back(m);
+    } else {
+        read_group_metrics[read_group] = m;
+    }
+    return m;
+}
+
+
+//
+// The Metrics for a record's read group, with the read group's
+// ordinal, or ReadGroupIndex::NOT_FOUND when the record is measured
+// in the default Metrics, which are looked up once and cached in
+// default_metrics.
+//
+Metrics* MetricsCollector::find_record_metrics(const bam1_t* record, const std::string& default_metrics_id, Metrics*& default_metrics, int& read_group) {
+    uint8_t* rgaux = bam_aux_get(record, "RG");
+    const char* read_group_id = rgaux ? bam_aux2Z(rgaux) : nullptr;
+    if (!ignore_read_groups && read_group_id) {
+        read_group = read_groups.find(read_group_id);
+
+        // It can happen that records have RG tags that don't
+        // exist in the file header. If we're not ignoring
+        // read groups altogether, create new Metrics
+        // instances for these rapscallions.
+        if (read_group == ReadGroupIndex::NOT_FOUND) {
+            std::cout << "Adding metrics for read group missing from file header: " << read_group_id << std::endl;
+            Metrics* m = add_read_group(read_group_id);
+            read_group = read_groups.find(read_group_id);
+            return m;
+        }
+        return read_group_metrics[read_group];
+    }
+
+    read_group = ReadGroupIndex::NOT_FOUND;
+    if (default_metrics == nullptr) {
+        default_metrics = metrics[default_metrics_id];
+    }
+    return default_metrics;
 }
 
-bool MetricsCollector::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
-    bool hqaa = false;
 
-    if (
+bool MetricsCollector::is_hqaa(const bam_hdr_t*, const bam1_t* record) const {
+    return
         !IS_UNMAPPED(record) &&
         !IS_MATE_UNMAPPED(record) &&
         !IS_DUP(record) &&
@@ -226,15 +340,99 @@ bool MetricsCollector::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
         IS_PROPERLYPAIRED(record) &&
         IS_PRIMARY(record) &&
         (record->core.qual >= 30) &&
-        (record->core.tid >= 0)) {
+        (record->core.tid >= 0) &&
+        is_autosomal(record->core.tid);
+}
+
+
+//
+// The ReadBatchClassifier categories of a single read.
+//
+uint8_t MetricsCollector::read_categories(const bam1_t* record) const {
+    uint8_t categories = 0;
+    if (record->core.tid >= 0) {
+        if (is_autosomal(record->core.tid)) {
+            categories |= ReadBatchClassifier::AUTOSOMAL;
+        }
+        if (is_mitochondrial(record->core.tid)) {
+            categories |= ReadBatchClassifier::MITOCHONDRIAL;
+        }
+        if (is_hqaa(nullptr, record)) {
+            categories |= ReadBatchClassifier::HQAA;
+        }
+    }
+    return categories;
+}
+
+
+//
+// Start the HTSlib thread pool used to decompress alignments, with
+// the given number of threads.
+//
+void MetricsCollector::create_thread_pool(const int threads) {
+    if (threads < 1 || thread_pool.pool) {
+        return;
+    }
 
-        std::string reference_name(header->target_name[record->core.tid]);
-        if (is_autosomal(reference_name)) {
-            hqaa = true;
+    if ((thread_pool.pool = hts_tpool_init(threads)) == nullptr) {
+        std::cerr << "Could not create a pool of " << threads << " threads for decompressing alignments; continuing with one." << std::endl;
+    } else {
+        decompression_threads = threads;
+        if (verbose) {
+            std::cout << "Decompressing alignments with " << threads << (threads == 1 ? " thread." : " threads.") << std::endl;
         }
     }
+}
+
+
+void MetricsCollector::destroy_thread_pool() {
+    if (thread_pool.pool) {
+        hts_tpool_destroy(thread_pool.pool);
+        thread_pool.pool = nullptr;
+        decompression_threads = 1;
+    }
+}
+
+
+void MetricsCollector::attach_thread_pool(samFile* alignment_file) {
+    if (thread_pool.pool && hts_set_thread_pool(alignment_file, &thread_pool) != 0) {
+        std::cerr << "Could not use the thread pool to decompress " << alignment_file->fn << "; continuing with one thread." << std::endl;
+    }
+}
+
+
+//
+// Describe how quickly alignments are coming out of the file: the
+// compressed bytes consumed per second spent in sam_read1, which is
+// where BGZF blocks are decompressed, or where we wait for the thread
+// pool to finish decompressing them.
+//
+static std::string decompression_rate_string(samFile* alignment_file, const boost::chrono::duration<double>& read_duration, const int threads) {
+    BGZF* bgzf = hts_get_bgzfp(alignment_file);
+    if (!bgzf || read_duration.count() <= 0) {
+        return "";
+    }
+
+    double megabytes = (bgzf_tell(bgzf) >> 16) / (1024.0 * 1024.0);
+
+    std::stringstream ss;
+    ss << "Decompressed " << std::fixed << std::setprecision(1) << megabytes << " MB of alignments in " << read_duration
+       << " (" << (megabytes / read_duration.count()) << " MB/second with " << threads << (threads == 1 ? " thread" : " threads") << ").";
+    return ss.str();
+}
+
 
-    return hqaa;
+//
+// Count the BGZF block the last alignment was read from, if it's a
+// new one.
+//
+static void count_bgzf_block(samFile* alignment_file, int64_t& last_block, unsigned long long int& blocks_read, std::unordered_set<int64_t>& blocks_seen) {
+    BGZF* bgzf = hts_get_bgzfp(alignment_file);
+    if (bgzf && bgzf->block_address != last_block) {
+        last_block = bgzf->block_address;
+        blocks_read++;
+        blocks_seen.insert(last_block);
+    }
 }
 
 
@@ -259,13 +457,13 @@ void MetricsCollector::load_tss() {
 
     while (*tss_istream >> tss) {
         bool excluded = false;
-        for (auto er : excluded_regions) {
-            if (tss.overlaps(er)) {
+        if (!excluded_regions.empty()) {
+            const Interval* er = excluded_regions.find_overlap(Interval(tss));
+            if (er) {
                 if (verbose) {
-                    std::cout << "Excluding TSS [" << tss << "] which overlaps excluded region [" << er << "]" << std::endl;
+                    std::cout << "Excluding TSS [" << tss << "] which overlaps excluded region [" << excluded_regions.to_feature(*er) << "]" << std::endl;
                 }
                 excluded = true;
-                break;
             }
         }
         if (!excluded && is_autosomal(tss.reference)) {
@@ -273,11 +471,130 @@ void MetricsCollector::load_tss() {
         }
     }
 
+    boost::chrono::high_resolution_clock::time_point build_start = boost::chrono::high_resolution_clock::now();
+    tss_tree.build();
+    tss_count = tss_tree.size();
+
     if (verbose) {
-        duration = boost::chrono::high_resolution_clock::now() - start;
+        boost::chrono::high_resolution_clock::time_point end = boost::chrono::high_resolution_clock::now();
+        duration = end - start;
+        boost::chrono::duration<double> build_duration = end - build_start;
         tss_tree.print_reference_feature_counts();
-        std::cout << "Loaded " << tss_tree.size() << " TSS in " << duration << "." << " (" << (tss_tree.size() / duration.count()) << " TSS/second)." << std::endl << std::endl;
+        std::cout << "Loaded " << tss_tree.size() << " TSS in " << duration << "." << " (" << (tss_tree.size() / duration.count()) << " TSS/second, " << build_duration << " of it indexing)." << std::endl << std::endl;
+    }
+}
+
+
+//
+// Arrange the TSS windows by the alignment file's target IDs, so each
+// alignment can find the TSS it's near as it's measured.
+//
+// A TSS's coverage is recorded over the region within tss_extension
+// bases of it, from fragments with a read within three times that.
+//
+void MetricsCollector::index_tss(const bam_hdr_t* header) {
+    const hts_pos_t extension = tss_extension;
+
+    tss_windows.assign(header->n_targets, {});
+    tss_window_spans.assign(header->n_targets, 0);
+
+    for (int tid = 0; tid < header->n_targets; tid++) {
+        std::vector<TSSWindow>& windows = tss_windows[tid];
+        for (const auto& tss : tss_tree.get_reference_feature_collection(header->target_name[tid])->features) {
+            TSSWindow window;
+            window.tss_count = 1;
+            window.region_start = std::max((hts_pos_t) tss.start - extension, (hts_pos_t) 0);
+            window.region_end = tss.end + extension;
+            // as if for the 1-based region query "reference:start-end"
+            window.query_start = std::max(window.region_start - extension * 2, (hts_pos_t) 0) - 1;
+            window.query_end = window.region_end + extension * 2;
+            window.reverse = tss.is_reverse();
+            windows.push_back(window);
+
+            tss_window_spans[tid] = std::max(tss_window_spans[tid], window.query_end - window.query_start);
+        }
+
+        std::sort(windows.begin(), windows.end(), [](const TSSWindow& a, const TSSWindow& b) {
+            if (a.query_start != b.query_start) {
+                return a.query_start < b.query_start;
+            }
+            if (a.region_start != b.region_start) {
+                return a.region_start < b.region_start;
+            }
+            if (a.region_end != b.region_end) {
+                return a.region_end < b.region_end;
+            }
+            return a.reverse < b.reverse;
+        });
+
+        // Alternative transcripts often share a TSS. Their windows
+        // are identical, so each read only needs to be compared to one.
+        // Windows near the start of a reference can have the same
+        // clamped query_start with different regions, so the whole
+        // region is compared.
+        std::vector<TSSWindow> distinct_windows;
+        for (const auto& window : windows) {
+            TSSWindow* last = distinct_windows.empty() ? nullptr : &distinct_windows.back();
+            if (last && last->query_start == window.query_start && last->region_start == window.region_start && last->region_end == window.region_end && last->reverse == window.reverse) {
+                last->tss_count += window.tss_count;
+            } else {
+                distinct_windows.push_back(window);
+            }
+        }
+        windows.swap(distinct_windows);
+    }
+}
+
+
+//
+// Collect the TSS windows whose queries overlap [start, end) on the
+// reference with the given target ID.
+//
+void MetricsCollector::find_tss_windows(const int tid, const hts_pos_t start, const hts_pos_t end, std::vector<const TSSWindow*>& windows) const {
+    windows.clear();
+
+    if (tid < 0 || (size_t) tid >= tss_windows.size()) {
+        return;
+    }
+
+    const std::vector<TSSWindow>& reference_windows = tss_windows[tid];
+
+    // no window query is longer than the span, so the first that can
+    // reach start begins after start - span
+    auto window = std::upper_bound(reference_windows.begin(), reference_windows.end(), start - tss_window_spans[tid], [](const hts_pos_t pos, const TSSWindow& w) {
+        return pos < w.query_start;
+    });
+
+    for (; window != reference_windows.end() && window->query_start < end; window++) {
+        if (window->query_end > start) {
+            windows.push_back(&*window);
+        }
+    }
+}
+
+
+//
+// Find the primary alignment of a record's mate, using the index.
+//
+bool MetricsCollector::find_mate(samFile* alignment_file, const hts_idx_t* alignment_file_index, const bam1_t* record, bam1_t* mate) const {
+    hts_itr_t* iterator = sam_itr_queryi(alignment_file_index, record->core.mtid, record->core.mpos, record->core.mpos + 1);
+    if (iterator == nullptr) {
+        return false;
+    }
+
+    bool found = false;
+    while (!found && sam_itr_next(alignment_file, iterator, mate) >= 0) {
+        found =
+            mate->core.pos == record->core.mpos &&
+            mate->core.mpos == record->core.pos &&
+            IS_PRIMARY(mate) &&
+            (mate->core.flag & (BAM_FREAD1 | BAM_FREAD2)) != (record->core.flag & (BAM_FREAD1 | BAM_FREAD2)) &&
+            strcmp(bam_get_qname(mate), bam_get_qname(record)) == 0;
     }
+
+    hts_itr_destroy(iterator);
+
+    return found;
 }
 
 
@@ -299,11 +616,32 @@ void MetricsCollector::load_alignments() {
         throw FileException("Could not open alignment file \"" + alignment_filename + "\".");
     }
 
-    if (!tss_filename.empty()) {
-        if ((alignment_file_index = sam_index_load(alignment_file, alignment_filename.c_str())) == nullptr) {
-            throw FileException("Before TSS enrichment can be calculated, you must create an index file\nfor alignment file \"" + alignment_filename + "\" with \"samtools index " + alignment_filename + "\".");
+    // With an index, we can measure different parts of the genome at
+    // the same time. Problematic reads have to be logged in file
+    // order, though, so that still requires a single pass. (Shards
+    // can't log problematic reads.)
+    bool measure_in_parallel = shard_count > 0 || (thread_limit > 1 && !log_problematic_reads);
+
+    if (measure_in_parallel) {
+        alignment_file_index = sam_index_load(alignment_file, alignment_filename.c_str());
+        if (alignment_file_index == nullptr) {
+            if (shard_count > 0) {
+                throw FileException("Before alignment file \"" + alignment_filename + "\" can be sharded, you must create an index file\nfor it with \"samtools index " + alignment_filename + "\".");
+            }
+            measure_in_parallel = false;
         }
+    }
+
+    // Read in one pass, the file is decompressed by half the threads,
+    // while the rest measure the batches read (see
+    // load_alignments_in_batches). Chunks measured in parallel are
+    // each decompressed on the thread reading them.
+    if (!measure_in_parallel && thread_limit > 1) {
+        create_thread_pool(thread_limit / 2);
+        attach_thread_pool(alignment_file);
+    }
 
+    if (!tss_filename.empty()) {
         load_tss();
     }
 
@@ -316,14 +654,28 @@ void MetricsCollector::load_alignments() {
         throw FileException("Could not read a valid header from alignment file \"" + alignment_filename +  "\".");
     }
 
+    classify_references(alignment_file_header);
+
+    if (!tss_filename.empty()) {
+        index_tss(alignment_file_header);
+    }
+
+    if (shard_count > 0) {
+        shard_chunks = make_shard_chunks(alignment_file_header, alignment_file_index);
+    }
+
     std::string default_metrics_id = name.empty() ? basename(alignment_filename) : name;
 
     try {
         sam_header header = parse_sam_header(alignment_file_header->text);
+
+        // indexed files are sorted, and chunks are measured in order
+        coordinate_sorted = measure_in_parallel || (header.count("HD") > 0 && header["HD"][0]["SO"] == "coordinate");
+
         if (!ignore_read_groups && header.count("RG") > 0) {
             for (auto read_group : header["RG"]) {
                 std::string read_group_id = read_group["ID"];
-                metrics[read_group_id] = new Metrics(this, read_group_id);
+                Metrics* read_group_metrics = add_read_group(read_group_id);
 
                 Library library;
                 library.library = read_group["LB"];
@@ -339,7 +691,7 @@ void MetricsCollector::load_alignments() {
                 library.programs = read_group["PG"];
                 library.predicted_median_insert_size = read_group["PI"];
 
-                metrics[read_group_id]->library = library;
+                read_group_metrics->library = library;
             }
         } else {
             metrics[default_metrics_id] = new Metrics(this, default_metrics_id);
@@ -355,60 +707,80 @@ void MetricsCollector::load_alignments() {
         boost::chrono::duration<double> duration;
         double rate = 0.0;
 
+        // time spent reading (and so decompressing) alignments, kept
+        // apart from the time spent measuring them
+        boost::chrono::high_resolution_clock::time_point read_start;
+        boost::chrono::duration<double> read_duration(0);
+        int64_t last_block = -1;
+
         unsigned long long int total_reads = 0;
+        Metrics* default_metrics = nullptr;
 
-        while (sam_read1(alignment_file, alignment_file_header, record) >= 0) {
-            Metrics* m;
+        if (measure_in_parallel) {
+            total_reads = load_alignments_in_parallel(alignment_file_header, alignment_file_index, default_metrics_id);
+        } else if (thread_limit > 1) {
+            total_reads = load_alignments_in_batches(alignment_file, alignment_file_header, default_metrics_id);
+        } else {
+            for (;;) {
+                if (verbose) {
+                    read_start = boost::chrono::high_resolution_clock::now();
+                }
 
-            uint8_t* rgaux = bam_aux_get(record, "RG");
-            if (!ignore_read_groups && rgaux) {
-                std::string read_group_id = bam_aux2Z(rgaux);
+                int read_status = sam_read1(alignment_file, alignment_file_header, record);
 
-                // It can happen that records have RG tags that don't
-                // exist in the file header. If we're not ignoring
-                // read groups altogether, create new Metrics
-                // instances for these rapscallions.
-                try {
-                    m = metrics.at(read_group_id);
-                } catch (std::out_of_range&) {
-                    std::cout << "Adding metrics for read group missing from file header: " << read_group_id << std::endl;
-                    metrics[read_group_id] = new Metrics(this, read_group_id);
-                    m = metrics[read_group_id];
+                if (verbose) {
+                    read_duration += boost::chrono::high_resolution_clock::now() - read_start;
                 }
-            } else {
-                m = metrics[default_metrics_id];
-            }
 
-            m->add_alignment(alignment_file_header, record);
+                if (read_status < 0) {
+                    break;
+                }
+
+                if (verbose) {
+                    count_bgzf_block(alignment_file, last_block, bgzf_blocks_read, bgzf_blocks_seen);
+                }
+
+                int read_group;
+                Metrics* m = find_record_metrics(record, default_metrics_id, default_metrics, read_group);
+                m->add_alignment(alignment_file_header, record);
+
+                total_reads++;
 
-            total_reads++;
+                if (verbose && total_reads % 100000 == 0) {
+                    duration = boost::chrono::high_resolution_clock::now() - start;
+                    rate = (total_reads / duration.count());
+                    std::cout << "Analyzed " << total_reads << " reads in " << duration << " (" << rate << " reads/second)." << std::endl;
+                    std::cout << decompression_rate_string(alignment_file, read_duration, decompression_threads) << std::endl;
+                }
+            }
 
-            if (verbose && total_reads % 100000 == 0) {
-                duration = boost::chrono::high_resolution_clock::now() - start;
-                rate = (total_reads / duration.count());
-                std::cout << "Analyzed " << total_reads << " reads in " << duration << " (" << rate << " reads/second)." << std::endl;
+            if (verbose) {
+                std::cout << decompression_rate_string(alignment_file, read_duration, decompression_threads) << std::endl;
             }
         }
 
-        calculate_tss_coverage();
+        if (verbose) {
+            std::cout << "Decompressed " << bgzf_blocks_read << " BGZF blocks (" << bgzf_blocks_seen.size() << " distinct)." << std::endl;
+        }
 
-        for (auto& it : metrics) {
-            Metrics* m = it.second;
-            if (m->total_reads == 0) {
-                std::cout << "Dropping metrics " << m->name << " which has no reads." << std::endl;
-                metrics.erase(it.first);
-            } else {
-                m->make_aggregate_diagnoses();
-                m->peaks.determine_top_peaks();
-                m->calculate_tss_metrics();
-            }
+        // settle the peak overlaps still queued from unsorted input
+        for (auto& m : metrics) {
+            m.second->peaks.record_queued_alignments();
+        }
+
+        // a shard's metrics can't be finished until they've been
+        // merged with the others
+        if (shard_count == 0) {
+            finalize_metrics();
         }
 
         bam_destroy1(record);
         bam_hdr_destroy(alignment_file_header);
+        hts_idx_destroy(alignment_file_index);
         if (alignment_file) {
             hts_close(alignment_file);
         }
+        destroy_thread_pool();
 
         if (verbose) {
             duration = boost::chrono::high_resolution_clock::now() - start;
@@ -422,122 +794,1433 @@ void MetricsCollector::load_alignments() {
         if (alignment_file) {
             hts_close(alignment_file);
         }
+        destroy_thread_pool();
         throw;
     }
 }
 
 
-Metrics::Metrics(MetricsCollector* collector, const std::string& name): collector(collector), name(name), peaks(), log_problematic_reads(collector->log_problematic_reads), less_redundant(collector->less_redundant) {
+///
+/// Complete the metrics once every alignment has been measured
+///
+void MetricsCollector::finalize_metrics() {
+    for (auto it = metrics.begin(); it != metrics.end();) {
+        Metrics* m = it->second;
+        if (m->total_reads == 0) {
+            std::cout << "Dropping metrics " << m->name << " which has no reads." << std::endl;
+            it = metrics.erase(it);
+        } else {
+            m->count_flags();
+            m->make_aggregate_diagnoses();
+            m->peaks.determine_top_peaks();
+            m->sum_tss_coverage();
+            m->calculate_tss_metrics();
+            m->modules.finalize(*m);
+            it++;
+        }
+    }
+}
 
-    if (log_problematic_reads) {
-        try {
-            problematic_read_filename = make_metrics_filename(".problems");
 
-            if (collector->verbose) {
-                std::cout << "Logging problematic reads to " << problematic_read_filename << "." << std::endl << std::endl;
+//
+// The compressed file offset of the first alignment the index says
+// might overlap pos, or -1 if there are none.
+//
+static int64_t indexed_offset(const hts_idx_t* index, const int tid, const hts_pos_t pos) {
+    int64_t offset = -1;
+
+    hts_itr_t* iterator = sam_itr_queryi(index, tid, pos, pos + 1);
+    if (iterator) {
+        for (int i = 0; i < iterator->n_off; i++) {
+            int64_t chunk_offset = iterator->off[i].u >> 16;
+            if (offset < 0 || chunk_offset < offset) {
+                offset = chunk_offset;
             }
-
-            problematic_read_stream = mostream(problematic_read_filename);
-        } catch (FileException& e) {
-            throw FileException("Could not open problematic read file " + problematic_read_filename + ": " + e.what());
         }
+        hts_itr_destroy(iterator);
     }
 
-    if (!collector->peak_filename.empty()) {
-        peaks_requested = true;
-        load_peaks();
+    return offset;
+}
+
+
+//
+// Divide the references into about chunk_count chunks of similar
+// cost for parallel measurement.
+//
+// The cost of each reference is estimated from the index's counts of
+// the reads on it, or if the index doesn't have them, from the
+// reference's length, plus the number of TSS windows on it. Each
+// reference gets its share of the chunks, with boundaries placed so
+// each chunk spans a similar amount of the compressed file. Chunk
+// boundaries fall on the 16kb windows of the BAM linear index, so a
+// chunk's query doesn't have to wade through much of its neighbours'
+// data.
+//
+// Each alignment belongs to the chunk containing its start, so the
+// last chunk of each reference is open-ended, in case anything has
+// been placed past the reference's stated length. The final chunk
+// holds the reads that weren't placed on any reference.
+//
+std::vector<MetricsCollector::AlignmentChunk> MetricsCollector::make_alignment_chunks(const bam_hdr_t* header, const hts_idx_t* index, const hts_pos_t chunk_count) const {
+    const hts_pos_t window_size = 1 << 14;
+
+    std::vector<unsigned long long int> reference_costs(header->n_targets, 0);
+    bool have_read_counts = true;
+    for (int tid = 0; tid < header->n_targets && have_read_counts; tid++) {
+        uint64_t mapped, unmapped;
+        have_read_counts = hts_idx_get_stat(index, tid, &mapped, &unmapped) == 0;
+        reference_costs[tid] = mapped + unmapped;
     }
 
-    if (!collector->tss_filename.empty()) {
-        tss_requested = true;
-        for (int i = 1; i <= 1 + 2 * collector->tss_extension; i++) {
-            tss_coverage[i] = 0;
+    unsigned long long int total_cost = 0;
+    for (int tid = 0; tid < header->n_targets; tid++) {
+        if (!have_read_counts) {
+            reference_costs[tid] = header->target_len[tid];
+        }
+        if ((size_t) tid < tss_windows.size()) {
+            reference_costs[tid] += tss_windows[tid].size();
+        }
+        total_cost += reference_costs[tid];
+    }
+
+    std::vector<AlignmentChunk> chunks;
+    for (int tid = 0; tid < header->n_targets; tid++) {
+        const hts_pos_t reference_length = header->target_len[tid];
+        const hts_pos_t windows = std::max((hts_pos_t) 1, (reference_length + window_size - 1) / window_size);
+
+        hts_pos_t reference_chunks = total_cost == 0 ? 1 : (hts_pos_t) std::llround((double) reference_costs[tid] * chunk_count / total_cost);
+        reference_chunks = std::min(std::max(reference_chunks, (hts_pos_t) 1), windows);
+
+        // where the reference's alignments start and end in the file
+        int64_t data_start = -1;
+        int64_t data_end = -1;
+        hts_itr_t* iterator = sam_itr_queryi(index, tid, 0, std::numeric_limits<int32_t>::max());
+        if (iterator) {
+            for (int i = 0; i < iterator->n_off; i++) {
+                int64_t chunk_start = iterator->off[i].u >> 16;
+                int64_t chunk_end = iterator->off[i].v >> 16;
+                data_start = data_start < 0 ? chunk_start : std::min(data_start, chunk_start);
+                data_end = std::max(data_end, chunk_end);
+            }
+            hts_itr_destroy(iterator);
+        }
+
+        std::vector<hts_pos_t> boundaries = {0};
+        for (hts_pos_t i = 1; i < reference_chunks; i++) {
+            hts_pos_t previous = boundaries.back() / window_size;
+            hts_pos_t window = previous + std::max((hts_pos_t) 1, (windows - previous) / (reference_chunks - i + 1));
+            if (data_start >= 0 && data_end > data_start) {
+                // find the first window starting at or past this
+                // chunk's share of the compressed data
+                int64_t target_offset = data_start + (data_end - data_start) * i / reference_chunks;
+                hts_pos_t low = previous + 1;
+                hts_pos_t high = windows;
+                while (low < high) {
+                    hts_pos_t middle = low + (high - low) / 2;
+                    if (indexed_offset(index, tid, middle * window_size) >= target_offset) {
+                        high = middle;
+                    } else {
+                        low = middle + 1;
+                    }
+                }
+                window = low;
+            }
+            if (window >= windows) {
+                break;
+            }
+            boundaries.push_back(window * window_size);
+        }
+
+        unsigned long long int chunk_cost = reference_costs[tid] / boundaries.size();
+        for (size_t i = 0; i < boundaries.size(); i++) {
+            hts_pos_t end = i + 1 < boundaries.size() ? boundaries[i + 1] : std::numeric_limits<int32_t>::max();
+            chunks.push_back({tid, boundaries[i], end, chunk_cost});
         }
     }
+    chunks.push_back({HTS_IDX_NOCOOR, 0, 0, have_read_counts ? hts_idx_get_n_no_coor(index) : 0});
+
+    return chunks;
 }
 
 
-std::string Metrics::make_metrics_filename(const std::string& suffix) {
-    return name + suffix;
-}
+//
+// Pick this shard's run of chunks, with about its share of the total
+// cost. The chunking depends only on the alignment file and the
+// number of shards, so every shard agrees on it, however many threads
+// each is using.
+//
+std::vector<MetricsCollector::AlignmentChunk> MetricsCollector::make_shard_chunks(const bam_hdr_t* header, const hts_idx_t* index) const {
+    const hts_pos_t chunks_per_shard = 64;
 
+    std::vector<AlignmentChunk> chunks = make_alignment_chunks(header, index, shard_count * chunks_per_shard);
 
-void Metrics::log_problematic_read(const std::string& problem, const std::string& record) {
-    if (!log_problematic_reads) {
-        return;
+    unsigned long long int total_cost = 0;
+    for (const auto& chunk : chunks) {
+        total_cost += chunk.cost;
     }
 
-    *problematic_read_stream << problem;
-
-    if (!record.empty()) {
-        *problematic_read_stream << '\t' << record;
+    // each chunk goes to the shard holding the cost that precedes it
+    std::vector<AlignmentChunk> shard;
+    unsigned long long int preceding_cost = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        int chunk_shard = 1 + (total_cost == 0 ? (i * shard_count / chunks.size()) : (preceding_cost * shard_count / total_cost));
+        if (chunk_shard > shard_count) {
+            // costless chunks at the end
+            chunk_shard = shard_count;
+        }
+        if (chunk_shard == shard_number) {
+            shard.push_back(chunks[i]);
+        }
+        preceding_cost += chunks[i].cost;
     }
 
-    *problematic_read_stream << '\n';
+    return shard;
 }
 
 
-void Metrics::make_aggregate_diagnoses() {
-    // last-minute classification of undiagnosed reads
-    reads_with_mate_too_distant = 0;
-    reads_mapped_and_paired_but_improperly = 0;
-
-    for (auto&& suspect_iterator : unlikely_fragment_sizes) {
-        for (auto&& unlikely_fragment_size : suspect_iterator.second) {
-            if (maximum_proper_pair_fragment_size < unlikely_fragment_size) {
-                reads_with_mate_too_distant++;
-                if (log_problematic_reads) {
-                    log_problematic_read("Mate too distant", suspect_iterator.first);
-                }
-            } else {
-                reads_mapped_and_paired_but_improperly++;
-                if (log_problematic_reads) {
-                    log_problematic_read("Undiagnosed", suspect_iterator.first);
-                }
-            }
-        }
-        suspect_iterator.second.clear();
+//
+// The collector's pool of thread_limit threads for parallel work,
+// started when it's first needed.
+//
+WorkerPool& MetricsCollector::get_worker_pool() {
+    if (!worker_pool) {
+        worker_pool.reset(new WorkerPool(thread_limit));
     }
+    return *worker_pool;
 }
 
 
-bool Metrics::is_autosomal(const std::string& reference_name) {
-    return collector->is_autosomal(reference_name);
+std::string MetricsCollector::describe_chunk(const bam_hdr_t* header, const AlignmentChunk& chunk) const {
+    if (chunk.tid < 0) {
+        return "unplaced reads";
+    }
+
+    std::stringstream description;
+    description << header->target_name[chunk.tid] << ":" << chunk.start << "-";
+    if (chunk.end < header->target_len[chunk.tid]) {
+        description << chunk.end;
+    } else {
+        description << "end";
+    }
+    return description.str();
 }
 
 
-bool Metrics::is_mitochondrial(const std::string& reference_name) {
-    return collector->is_mitochondrial(reference_name);
-}
+///
+/// Measure the reads in an indexed alignment file on the worker
+/// pool. Each of the pool's threads gets its own file handle and
+/// private Metrics for each read group, which are merged into the
+/// collector's when all the chunks have been measured.
+///
+unsigned long long int MetricsCollector::load_alignments_in_parallel(const bam_hdr_t* header, const hts_idx_t* index, const std::string& default_metrics_id) {
+    const hts_pos_t chunks_per_thread = 16;
 
+    // with plenty more chunks than threads, a few densely covered
+    // regions won't leave the other threads idle
+    std::vector<AlignmentChunk> chunks = shard_count > 0 ? shard_chunks : make_alignment_chunks(header, index, thread_limit * chunks_per_thread);
 
-std::string Metrics::configuration_string() const {
-    std::stringstream cs;
-    cs << "Read Group\n==========\nID: " << name << std::endl << library << std::endl;
-    return cs.str();
+    WorkerPool& pool = get_worker_pool();
+    std::vector<ChunkReader> readers(pool.size());
+    std::vector<unsigned long long int> chunk_reads(chunks.size(), 0);
+    std::mutex metrics_mutex;
+
+    // the range of chunks measured by each task
+    std::map<size_t, std::pair<size_t, size_t>> task_chunks;
+
+    auto measure_chunks = [&](const size_t first, const size_t last, const int worker) {
+        for (size_t chunk_index = first; chunk_index < last; chunk_index++) {
+            chunk_reads[chunk_index] = measure_alignment_chunk(chunks[chunk_index], readers[worker], metrics_mutex, default_metrics_id);
+        }
+    };
+
+    if (log_problematic_reads) {
+        // a single task measures the chunks in file order, which is
+        // necessary for logging problematic reads
+        size_t task = pool.submit([&](int worker) { measure_chunks(0, chunks.size(), worker); });
+        task_chunks[task] = std::make_pair(0, chunks.size());
+    } else {
+        // the costliest chunks go first, so the threads finish
+        // together, with whatever small chunks are left taken up by
+        // whichever threads are idle
+        std::vector<size_t> chunk_order(chunks.size());
+        for (size_t chunk_index = 0; chunk_index < chunks.size(); chunk_index++) {
+            chunk_order[chunk_index] = chunk_index;
+        }
+        std::stable_sort(chunk_order.begin(), chunk_order.end(), [&chunks](const size_t a, const size_t b) { return chunks[a].cost > chunks[b].cost; });
+
+        for (size_t chunk_index : chunk_order) {
+            size_t task = pool.submit([&, chunk_index](int worker) { measure_chunks(chunk_index, chunk_index + 1, worker); });
+            task_chunks[task] = std::make_pair(chunk_index, chunk_index + 1);
+        }
+    }
+
+    if (verbose) {
+        std::cout << "Measuring alignments in " << chunks.size() << " chunks on " << (log_problematic_reads ? 1 : pool.size()) << " threads." << std::endl;
+    }
+
+    unsigned long long int total_reads = 0;
+    std::exception_ptr error = nullptr;
+
+    for (size_t remaining = task_chunks.size(); remaining > 0; remaining--) {
+        WorkerPool::Completion completion = pool.next_completion();
+        if (completion.error) {
+            if (!error) {
+                error = completion.error;
+            }
+            continue;
+        }
+
+        const std::pair<size_t, size_t>& task_range = task_chunks.at(completion.task);
+        unsigned long long int task_reads = 0;
+        for (size_t chunk_index = task_range.first; chunk_index < task_range.second; chunk_index++) {
+            task_reads += chunk_reads[chunk_index];
+        }
+        total_reads += task_reads;
+
+        if (verbose) {
+            std::cout << "Measured ";
+            if (task_range.second - task_range.first == 1) {
+                std::cout << "chunk " << (task_range.first + 1) << " of " << chunks.size() << " (" << describe_chunk(header, chunks[task_range.first]) << ")";
+            } else {
+                std::cout << (task_range.second - task_range.first) << " chunks";
+            }
+            std::cout << " on thread " << completion.worker << " in " << completion.duration << ": " << task_reads << " reads." << std::endl;
+
+            if (total_reads / 100000 != (total_reads - task_reads) / 100000) {
+                std::cout << "Analyzed " << total_reads << " reads." << std::endl;
+            }
+        }
+    }
+
+    for (auto& reader : readers) {
+        close_chunk_reader(reader);
+        for (size_t read_group = 0; read_group < reader.partial_metrics.size(); read_group++) {
+            if (!error) {
+                metrics.at(reader.read_groups.id(read_group))->merge(*reader.partial_metrics[read_group]);
+            }
+            delete reader.partial_metrics[read_group];
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    return total_reads;
 }
 
 
-bool Metrics::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
-    bool hqaa = false;
+///
+/// Measure the reads in an alignment file that can't be split into
+/// chunks, reading them on this thread in batches while the worker
+/// pool measures earlier batches. Batches are passed through a ring
+/// of reused AlignmentBatch buffers, so once the ring's records have
+/// grown to fit, reading allocates nothing. Each read group's Metrics
+/// are measured by one of the pool's threads; this thread only reads
+/// the records and lists each thread's records in every batch, which
+/// the thread then classifies and measures, keeping each Metrics'
+/// reads in file order.
+///
+unsigned long long int MetricsCollector::load_alignments_in_batches(samFile* alignment_file, bam_hdr_t* header, const std::string& default_metrics_id) {
+    const size_t batch_size = 8192;
+    const size_t batches_per_consumer = 2;
+
+    WorkerPool& pool = get_worker_pool();
+
+    // the threads not decompressing the file measure it, but threads
+    // beyond the number of read groups would have nothing to do
+    const int consumers = std::max(1, std::min(thread_limit - (thread_pool.pool ? decompression_threads : 0), (int) metrics.size()));
+
+    BroadcastRing ring(batches_per_consumer * consumers + 1, consumers);
+    std::vector<AlignmentBatch> batches;
+    batches.reserve(ring.size());
+    for (size_t i = 0; i < ring.size(); i++) {
+        batches.emplace_back(batch_size);
+    }
+
+    // each batch's records' Metrics, and the indexes of the records
+    // each consumer measures
+    std::vector<std::vector<Metrics*>> batch_metrics(ring.size(), std::vector<Metrics*>(batch_size, nullptr));
+    std::vector<std::vector<std::vector<size_t>>> batch_consumer_records(ring.size(), std::vector<std::vector<size_t>>(consumers));
+
+    std::vector<unsigned long long int> consumer_reads(consumers, 0);
+    std::map<size_t, int> task_consumers;
+    for (int consumer = 0; consumer < consumers; consumer++) {
+        size_t task = pool.submit([&, consumer](int) {
+            unsigned long long int reads = 0;
+            try {
+                // the consumer's records from each batch, classified
+                // together
+                ReadBatchClassifier classifier(reference_classifications);
+                std::vector<const bam1_t*> records(batch_size, nullptr);
+                std::vector<uint32_t> flag_keys(batch_size, 0);
+                std::vector<uint8_t> categories(batch_size, 0);
+
+                size_t slot;
+                while (ring.next(consumer, slot)) {
+                    const AlignmentBatch& batch = batches[slot];
+                    const std::vector<Metrics*>& record_metrics = batch_metrics[slot];
+                    const std::vector<size_t>& consumer_records = batch_consumer_records[slot][consumer];
+
+                    for (size_t i = 0; i < consumer_records.size(); i++) {
+                        records[i] = batch.records[consumer_records[i]];
+                    }
+
+                    classifier.classify(records.data(), consumer_records.size(), flag_keys.data(), categories.data());
+
+                    for (size_t i = 0; i < consumer_records.size(); i++) {
+                        record_metrics[consumer_records[i]]->add_alignment(header, records[i], flag_keys[i], categories[i]);
+                    }
+                    reads += consumer_records.size();
+                    ring.release(consumer);
+                }
+                consumer_reads[consumer] = reads;
+            } catch (...) {
+                ring.abandon(consumer);
+                throw;
+            }
+        });
+        task_consumers[task] = consumer;
+    }
+
+    if (verbose) {
+        std::cout << "Measuring alignments in batches of " << batch_size << " on " << consumers << (consumers == 1 ? " thread" : " threads")
+                  << ", classifying them with the " << ReadBatchClassifier::kernel_name(ReadBatchClassifier::best_kernel()) << " kernel." << std::endl;
+    }
+
+    boost::chrono::high_resolution_clock::time_point read_start;
+    boost::chrono::duration<double> read_duration(0);
+    int64_t last_block = -1;
+
+    // Metrics are given to consumers in turn as they're first seen
+    std::unordered_map<const Metrics*, int> metrics_consumers;
+    Metrics* default_metrics = nullptr;
+
+    unsigned long long int total_reads = 0;
+    std::exception_ptr error = nullptr;
+
+    try {
+        bool reading = true;
+        while (reading && !ring.abandoned()) {
+            size_t slot = ring.claim();
+            AlignmentBatch& batch = batches[slot];
+            std::vector<Metrics*>& record_metrics = batch_metrics[slot];
+            std::vector<std::vector<size_t>>& consumer_records = batch_consumer_records[slot];
+            for (auto& records : consumer_records) {
+                records.clear();
+            }
+
+            if (verbose) {
+                read_start = boost::chrono::high_resolution_clock::now();
+            }
+
+            for (batch.size = 0; batch.size < batch.capacity(); batch.size++) {
+                bam1_t* record = batch.records[batch.size];
+                if (sam_read1(alignment_file, header, record) < 0) {
+                    reading = false;
+                    break;
+                }
+
+                if (verbose) {
+                    count_bgzf_block(alignment_file, last_block, bgzf_blocks_read, bgzf_blocks_seen);
+                }
+
+                int read_group;
+                Metrics* m = find_record_metrics(record, default_metrics_id, default_metrics, read_group);
+                auto assignment = metrics_consumers.find(m);
+                if (assignment == metrics_consumers.end()) {
+                    assignment = metrics_consumers.insert(std::make_pair(m, (int) (metrics_consumers.size() % consumers))).first;
+                }
+                record_metrics[batch.size] = m;
+                consumer_records[assignment->second].push_back(batch.size);
+            }
+
+            if (verbose) {
+                read_duration += boost::chrono::high_resolution_clock::now() - read_start;
+            }
+
+            ring.publish();
+
+            if (verbose && total_reads / 100000 != (total_reads + batch.size) / 100000) {
+                std::cout << "Read " << (total_reads + batch.size) << " reads." << std::endl;
+                std::cout << decompression_rate_string(alignment_file, read_duration, decompression_threads) << std::endl;
+            }
+            total_reads += batch.size;
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    ring.close();
+
+    for (size_t remaining = task_consumers.size(); remaining > 0; remaining--) {
+        WorkerPool::Completion completion = pool.next_completion();
+        if (completion.error && !error) {
+            error = completion.error;
+        }
+        if (verbose && !completion.error) {
+            int consumer = task_consumers.at(completion.task);
+            std::cout << "Measured " << consumer_reads[consumer] << " reads on thread " << completion.worker << " in " << completion.duration << "." << std::endl;
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    if (verbose) {
+        std::cout << decompression_rate_string(alignment_file, read_duration, decompression_threads) << std::endl;
+    }
+
+    return total_reads;
+}
+
+
+void MetricsCollector::open_chunk_reader(ChunkReader& reader) {
+    reader.record = bam_init1();
+    reader.mate = bam_init1();
+
+    if ((reader.alignment_file = sam_open(alignment_filename.c_str(), "r")) == nullptr) {
+        throw FileException("Could not open alignment file \"" + alignment_filename + "\".");
+    }
+
+    if ((reader.alignment_file_index = sam_index_load(reader.alignment_file, alignment_filename.c_str())) == nullptr) {
+        throw FileException("Could not open index for alignment file \"" + alignment_filename + "\".");
+    }
+
+    reader.alignment_file_header = sam_hdr_read(reader.alignment_file);
+    if (reader.alignment_file_header == NULL) {
+        throw FileException("Could not read a valid header from alignment file \"" + alignment_filename +  "\".");
+    }
+}
+
+
+void MetricsCollector::close_chunk_reader(ChunkReader& reader) {
+    if (verbose) {
+        bgzf_blocks_read += reader.blocks_read;
+        bgzf_blocks_seen.insert(reader.blocks_seen.begin(), reader.blocks_seen.end());
+    }
+
+    if (reader.mate) {
+        bam_destroy1(reader.mate);
+    }
+    if (reader.mate_file) {
+        hts_close(reader.mate_file);
+    }
+    if (reader.record) {
+        bam_destroy1(reader.record);
+    }
+    bam_hdr_destroy(reader.alignment_file_header);
+    hts_idx_destroy(reader.alignment_file_index);
+    if (reader.alignment_file) {
+        hts_close(reader.alignment_file);
+    }
+
+    reader.mate = reader.record = nullptr;
+    reader.mate_file = reader.alignment_file = nullptr;
+    reader.alignment_file_header = nullptr;
+    reader.alignment_file_index = nullptr;
+}
+
+
+//
+// Measure one chunk of the alignment file into the reader's partial
+// metrics, returning the number of reads in it.
+//
+unsigned long long int MetricsCollector::measure_alignment_chunk(const AlignmentChunk& chunk,
+                                                                 ChunkReader& reader,
+                                                                 std::mutex& metrics_mutex,
+                                                                 const std::string& default_metrics_id) {
+    if (reader.alignment_file == nullptr) {
+        open_chunk_reader(reader);
+    }
+
+    bam1_t* record = reader.record;
+    bam1_t* mate = reader.mate;
+    const bam_hdr_t* header = reader.alignment_file_header;
+    unsigned long long int chunk_reads = 0;
+
+    hts_itr_t *alignment_iterator = sam_itr_queryi(reader.alignment_file_index, chunk.tid, chunk.start, chunk.end);
+    if (alignment_iterator == nullptr) {
+        throw FileException("Could not query alignment file \"" + alignment_filename + "\" for a chunk of reference " + std::to_string(chunk.tid) + ".");
+    }
+
+    try {
+        while (sam_itr_next(reader.alignment_file, alignment_iterator, record) >= 0) {
+            if (verbose) {
+                count_bgzf_block(reader.alignment_file, reader.last_block, reader.blocks_read, reader.blocks_seen);
+            }
+
+            // skip alignments that belong to neighbouring chunks
+            if (chunk.tid == HTS_IDX_NOCOOR ? record->core.tid >= 0 : (record->core.pos < chunk.start || record->core.pos >= chunk.end)) {
+                continue;
+            }
+
+            const char* metrics_id = default_metrics_id.c_str();
+            uint8_t* rgaux = bam_aux_get(record, "RG");
+            const char* read_group_id = rgaux ? bam_aux2Z(rgaux) : nullptr;
+            if (!ignore_read_groups && read_group_id) {
+                metrics_id = read_group_id;
+            }
+
+            int read_group = reader.read_groups.find(metrics_id);
+            if (read_group == ReadGroupIndex::NOT_FOUND) {
+                std::lock_guard<std::mutex> lock(metrics_mutex);
+                auto m = metrics.find(metrics_id);
+                if (m == metrics.end()) {
+                    std::cout << "Adding metrics for read group missing from file header: " << metrics_id << std::endl;
+                    m = metrics.insert(std::make_pair(metrics_id, new Metrics(this, metrics_id))).first;
+                }
+                // the collector's Metrics are untouched until the
+                // merge, so this is a clean slate with its peaks
+                read_group = reader.read_groups.intern(metrics_id);
+                reader.partial_metrics.push_back(new Metrics(*m->second));
+            }
+            Metrics* partial = reader.partial_metrics[read_group];
+
+            // A fragment near a TSS counts once, for the first of
+            // its reads in the file. If that was measured in an
+            // earlier chunk, it must be introduced to its mate.
+            if (!tss_filename.empty() &&
+                record->core.mtid >= 0 &&
+                std::make_pair(record->core.mtid, record->core.mpos) < std::make_pair(chunk.tid, chunk.start) &&
+                is_hqaa(header, record)) {
+
+                if (reader.mate_file == nullptr && (reader.mate_file = sam_open(alignment_filename.c_str(), "r")) == nullptr) {
+                    throw FileException("Could not open alignment file \"" + alignment_filename + "\".");
+                }
+
+                if (find_mate(reader.mate_file, reader.alignment_file_index, record, mate)) {
+                    partial->add_tss_mate(header, mate);
+                }
+            }
+
+            partial->add_alignment(header, record);
+            chunk_reads++;
+        }
+    } catch (...) {
+        hts_itr_destroy(alignment_iterator);
+        throw;
+    }
+
+    hts_itr_destroy(alignment_iterator);
+
+    return chunk_reads;
+}
+
+
+//
+// Reads are classified by the FLAG bits below, whether their mates
+// are on the same reference, whether both are placed past position
+// zero, the sign of their template length, and whether their mapping
+// quality is zero. Those few fields are packed into a key, so each
+// read only has to bump a count, and look up its class in a table.
+//
+// The FLAG bits in the key are the six lowest, PAIRED through
+// MREVERSE, with QCFAIL moved down next to them. The rest are only
+// counted, each on its own, so they're kept out of the key, and
+// counted by the index made of them, shifted down.
+//
+static const int32_t LOW_CLASS_FLAGS = BAM_FPAIRED | BAM_FPROPER_PAIR | BAM_FUNMAP | BAM_FMUNMAP | BAM_FREVERSE | BAM_FMREVERSE;
+static const int FLAG_BITS = 7;
+static const int QCFAIL_SHIFT = 3;
+static const size_t FLAG_VALUES = 1 << FLAG_BITS;
+static const size_t PAIR_PLACEMENTS = 5;
+static const size_t FLAG_KEYS = 2 * PAIR_PLACEMENTS * FLAG_VALUES;
+
+static const int32_t COUNTED_FLAGS = BAM_FREAD1 | BAM_FREAD2 | BAM_FSECONDARY | BAM_FDUP | BAM_FSUPPLEMENTARY;
+static const int COUNTED_FLAGS_SHIFT = 6;
+static const size_t COUNTED_FLAG_VALUES = (COUNTED_FLAGS >> COUNTED_FLAGS_SHIFT) + 1;
+
+static_assert(LOW_CLASS_FLAGS == FLAG_VALUES / 2 - 1 && (BAM_FQCFAIL >> QCFAIL_SHIFT) == FLAG_VALUES / 2, "the class flags are packed into FLAG_BITS");
+static_assert((COUNTED_FLAGS & (LOW_CLASS_FLAGS | BAM_FQCFAIL)) == 0 && (COUNTED_FLAGS | LOW_CLASS_FLAGS | BAM_FQCFAIL) == 0xfff, "each FLAG bit is in the key or counted");
+
+
+static size_t make_flag_key(const bam1_t* record) {
+    bool same_reference = record->core.tid == record->core.mtid;
+    bool placed = record->core.pos != 0 && record->core.mpos != 0;
+    int isize_sign = (record->core.isize > 0) - (record->core.isize < 0);
+
+    // mates on different references, on the same one but unplaced,
+    // or placed with negative, zero or positive template length
+    size_t placement = same_reference ? (placed ? 3 + isize_sign : 1) : 0;
+
+    size_t flags = (record->core.flag & LOW_CLASS_FLAGS) | ((record->core.flag & BAM_FQCFAIL) >> QCFAIL_SHIFT);
+    return ((record->core.qual == 0) * PAIR_PLACEMENTS + placement) * FLAG_VALUES + flags;
+}
+
+
+static size_t make_counted_flags_index(const bam1_t* record) {
+    return (record->core.flag & COUNTED_FLAGS) >> COUNTED_FLAGS_SHIFT;
+}
+
+
+//
+// Fill in the fields of a record that would produce the given key.
+//
+static void make_flag_record(const size_t key, bam1_t* record) {
+    size_t placement = key / FLAG_VALUES % PAIR_PLACEMENTS;
+    size_t flags = key % FLAG_VALUES;
+
+    record->core.flag = (flags & LOW_CLASS_FLAGS) | ((flags << QCFAIL_SHIFT) & BAM_FQCFAIL);
+    record->core.qual = key / (FLAG_VALUES * PAIR_PLACEMENTS) ? 0 : 1;
+    record->core.tid = 0;
+    record->core.mtid = placement == 0 ? 1 : 0;
+    record->core.pos = record->core.mpos = placement >= 2 ? 1 : 0;
+    record->core.isize = placement >= 2 ? (int) placement - 3 : 0;
+}
+
+
+//
+// The mutually exclusive classification of reads, in the order it's
+// decided.
+//
+enum class ReadClass {
+    QC_FAILED,
+    UNPAIRED,
+    UNMAPPED,
+    UNMAPPED_MATE,
+    RF,
+    FF,
+    RR,
+    ZERO_QUALITY,
+    PROPERLY_PAIRED,
+    MATE_ON_DIFFERENT_REFERENCE,
+    IMPROPERLY_PAIRED,
+    UNCLASSIFIED
+};
+
+
+static ReadClass classify_read(const bam1_t* record) {
+    if (IS_QCFAIL(record)) {
+        return ReadClass::QC_FAILED;
+    } else if (!IS_PAIRED(record)) {
+        return ReadClass::UNPAIRED;
+    } else if (IS_UNMAPPED(record)) {
+        return ReadClass::UNMAPPED;
+    } else if (IS_MATE_UNMAPPED(record)) {
+        return ReadClass::UNMAPPED_MATE;
+    } else if (Metrics::is_rf(record)) {
+        return ReadClass::RF;
+    } else if (Metrics::is_ff(record)) {
+        return ReadClass::FF;
+    } else if (Metrics::is_rr(record)) {
+        return ReadClass::RR;
+    } else if (record->core.qual == 0) {
+        return ReadClass::ZERO_QUALITY;
+    } else if (IS_PAIRED_AND_MAPPED(record)) {
+        if (IS_PROPERLYPAIRED(record)) {
+            return ReadClass::PROPERLY_PAIRED;
+        } else if (record->core.tid != record->core.mtid) {
+            // Compare the record's reference ID to its mate's
+            // reference ID. If they're different, the internet is
+            // full of interesting explanations. This might be
+            // because of adapter errors, where pairs of fragments
+            // that each have one adapter attached look like one
+            // proper fragment with both adapters. Or maybe you have
+            // something interesting: translocations, fusions, or in
+            // the case of allosomal references, perhaps a chimera, a
+            // pregnant mother with offspring of a different gender,
+            // or simply alignment to regions homologous between the X
+            // and Y chromosomes.
+            return ReadClass::MATE_ON_DIFFERENT_REFERENCE;
+        } else {
+            return ReadClass::IMPROPERLY_PAIRED;
+        }
+    }
+
+    // Most cases should have been caught by now, so let's make a
+    // special note of any unexpected oddballs.
+    return ReadClass::UNCLASSIFIED;
+}
 
-    if (
-        !IS_UNMAPPED(record) &&
-        !IS_MATE_UNMAPPED(record) &&
-        !IS_DUP(record) &&
-        IS_PAIRED_AND_MAPPED(record) &&
-        IS_PROPERLYPAIRED(record) &&
-        IS_PRIMARY(record) &&
-        (record->core.qual >= 30) &&
-        (record->core.tid >= 0)) {
 
-        std::string reference_name(header->target_name[record->core.tid]);
-        if (is_autosomal(reference_name)) {
-            hqaa = true;
+//
+// The class of the reads with each flag key. It's built once, and
+// only read afterward, so it can be shared by all threads.
+//
+static const std::vector<ReadClass>& flag_key_classes() {
+    static const std::vector<ReadClass> classes = []() {
+        std::vector<ReadClass> classes(FLAG_KEYS);
+        bam1_t record = {};
+        for (size_t key = 0; key < FLAG_KEYS; key++) {
+            make_flag_record(key, &record);
+            classes[key] = classify_read(&record);
         }
+        return classes;
+    }();
+    return classes;
+}
+
+
+//
+// How problematic reads of each class are described in the log.
+//
+static const std::map<ReadClass, std::string> read_class_problems = {
+    {ReadClass::QC_FAILED, "QC failed"},
+    {ReadClass::UNPAIRED, "Unpaired"},
+    {ReadClass::UNMAPPED, "Unmapped"},
+    {ReadClass::UNMAPPED_MATE, "Unmapped mate"},
+    {ReadClass::RF, "RF"},
+    {ReadClass::FF, "FF"},
+    {ReadClass::RR, "RR"},
+    {ReadClass::ZERO_QUALITY, "Mapped with zero quality"},
+    {ReadClass::MATE_ON_DIFFERENT_REFERENCE, "Mate mapped to different reference"},
+    {ReadClass::IMPROPERLY_PAIRED, "Improper"},
+    {ReadClass::UNCLASSIFIED, "Unclassified"}
+};
+
+
+//
+// The flags an HQAA read must have, among those that matter: paired,
+// properly, with both mates mapped, and neither a duplicate nor a
+// secondary or supplementary alignment.
+//
+static const int32_t HQAA_FLAG_MASK = BAM_FPAIRED | BAM_FPROPER_PAIR | BAM_FUNMAP | BAM_FMUNMAP | BAM_FDUP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY;
+static const int32_t HQAA_FLAGS = BAM_FPAIRED | BAM_FPROPER_PAIR;
+static const int32_t HQAA_MINIMUM_QUALITY = 30;
+
+const uint8_t ReadBatchClassifier::AUTOSOMAL;
+const uint8_t ReadBatchClassifier::MITOCHONDRIAL;
+const uint8_t ReadBatchClassifier::HQAA;
+const size_t ReadBatchClassifier::LANES;
+
+
+ReadBatchClassifier::ReadBatchClassifier(const std::vector<ReferenceClassification>& references, const Kernel kernel) : kernel(kernel) {
+    if (!supports(kernel)) {
+        throw std::invalid_argument("This CPU can't classify reads with the " + kernel_name(kernel) + " kernel.");
+    }
+
+    reference_categories.reserve(references.size());
+    for (const auto& reference : references) {
+        reference_categories.push_back((reference.autosomal ? AUTOSOMAL : 0) | (reference.mitochondrial ? MITOCHONDRIAL : 0));
+    }
+}
+
+
+ReadBatchClassifier::Kernel ReadBatchClassifier::get_kernel() const {
+    return kernel;
+}
+
+
+bool ReadBatchClassifier::supports(const Kernel kernel) {
+    switch (kernel) {
+    case Kernel::SCALAR:
+        return true;
+#if defined(__x86_64__) || defined(__i386__)
+    case Kernel::SSE4:
+        return __builtin_cpu_supports("sse4.1");
+    case Kernel::AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
     }
+}
 
-    return hqaa;
+
+ReadBatchClassifier::Kernel ReadBatchClassifier::best_kernel() {
+    if (supports(Kernel::AVX2)) {
+        return Kernel::AVX2;
+    } else if (supports(Kernel::SSE4)) {
+        return Kernel::SSE4;
+    }
+    return Kernel::SCALAR;
+}
+
+
+std::string ReadBatchClassifier::kernel_name(const Kernel kernel) {
+    switch (kernel) {
+    case Kernel::SSE4:
+        return "SSE4";
+    case Kernel::AVX2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}
+
+
+//
+// Evaluate lanes [first, count) one at a time.
+//
+static void classify_lanes_scalar(const ReadBatchClassifier::Lanes& lanes, const size_t first, const size_t count, uint32_t* flag_keys, uint8_t* categories) {
+    for (size_t i = first; i < count; i++) {
+        int32_t placement = lanes.tids[i] == lanes.mate_tids[i] ? (lanes.placed[i] ? 3 + lanes.isize_signs[i] : 1) : 0;
+        int32_t flags = (lanes.flags[i] & LOW_CLASS_FLAGS) | ((lanes.flags[i] & BAM_FQCFAIL) >> QCFAIL_SHIFT);
+        flag_keys[i] = ((lanes.qualities[i] == 0) * PAIR_PLACEMENTS + placement) * FLAG_VALUES + flags;
+
+        bool hqaa =
+            (lanes.flags[i] & HQAA_FLAG_MASK) == HQAA_FLAGS &&
+            lanes.qualities[i] >= HQAA_MINIMUM_QUALITY &&
+            lanes.tids[i] >= 0 &&
+            (lanes.references[i] & ReadBatchClassifier::AUTOSOMAL);
+        categories[i] = lanes.references[i] | (hqaa ? ReadBatchClassifier::HQAA : 0);
+    }
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//
+// The vector kernels compute the same as classify_lanes_scalar, four
+// or eight lanes at a time. The placement of mates, 0 on different
+// references, 1 unplaced, or 3 plus the sign of the template length,
+// is selected with masks, as is each read's key row, which is offset
+// by PAIR_PLACEMENTS for reads with zero mapping quality, and shifted
+// above the packed FLAG bits.
+//
+__attribute__((target("sse4.1")))
+static size_t classify_lanes_sse4(const ReadBatchClassifier::Lanes& lanes, const size_t count, uint32_t* flag_keys, uint8_t* categories) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i three = _mm_set1_epi32(3);
+    const __m128i pair_placements = _mm_set1_epi32(PAIR_PLACEMENTS);
+    const __m128i low_class_flags = _mm_set1_epi32(LOW_CLASS_FLAGS);
+    const __m128i qcfail = _mm_set1_epi32(BAM_FQCFAIL);
+    const __m128i hqaa_flag_mask = _mm_set1_epi32(HQAA_FLAG_MASK);
+    const __m128i hqaa_flags = _mm_set1_epi32(HQAA_FLAGS);
+    const __m128i below_hqaa_quality = _mm_set1_epi32(HQAA_MINIMUM_QUALITY - 1);
+    const __m128i minus_one = _mm_set1_epi32(-1);
+    const __m128i autosomal = _mm_set1_epi32(ReadBatchClassifier::AUTOSOMAL);
+    const __m128i hqaa = _mm_set1_epi32(ReadBatchClassifier::HQAA);
+
+    alignas(16) int32_t category_lanes[4];
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i flags = _mm_load_si128((const __m128i*) (lanes.flags + i));
+        __m128i qualities = _mm_load_si128((const __m128i*) (lanes.qualities + i));
+        __m128i tids = _mm_load_si128((const __m128i*) (lanes.tids + i));
+        __m128i mate_tids = _mm_load_si128((const __m128i*) (lanes.mate_tids + i));
+        __m128i placed = _mm_load_si128((const __m128i*) (lanes.placed + i));
+        __m128i isize_signs = _mm_load_si128((const __m128i*) (lanes.isize_signs + i));
+        __m128i references = _mm_load_si128((const __m128i*) (lanes.references + i));
+
+        __m128i placement = _mm_blendv_epi8(one, _mm_add_epi32(three, isize_signs), placed);
+        placement = _mm_and_si128(placement, _mm_cmpeq_epi32(tids, mate_tids));
+        __m128i row = _mm_add_epi32(_mm_and_si128(_mm_cmpeq_epi32(qualities, zero), pair_placements), placement);
+        __m128i key_flags = _mm_or_si128(_mm_and_si128(flags, low_class_flags), _mm_srli_epi32(_mm_and_si128(flags, qcfail), QCFAIL_SHIFT));
+        __m128i keys = _mm_add_epi32(_mm_slli_epi32(row, FLAG_BITS), key_flags);
+        _mm_storeu_si128((__m128i*) (flag_keys + i), keys);
+
+        __m128i is_hqaa = _mm_cmpeq_epi32(_mm_and_si128(flags, hqaa_flag_mask), hqaa_flags);
+        is_hqaa = _mm_and_si128(is_hqaa, _mm_cmpgt_epi32(qualities, below_hqaa_quality));
+        is_hqaa = _mm_and_si128(is_hqaa, _mm_cmpgt_epi32(tids, minus_one));
+        is_hqaa = _mm_and_si128(is_hqaa, _mm_cmpeq_epi32(_mm_and_si128(references, autosomal), autosomal));
+        _mm_store_si128((__m128i*) category_lanes, _mm_or_si128(references, _mm_and_si128(is_hqaa, hqaa)));
+
+        for (size_t j = 0; j < 4; j++) {
+            categories[i + j] = category_lanes[j];
+        }
+    }
+    return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t classify_lanes_avx2(const ReadBatchClassifier::Lanes& lanes, const size_t count, uint32_t* flag_keys, uint8_t* categories) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i pair_placements = _mm256_set1_epi32(PAIR_PLACEMENTS);
+    const __m256i low_class_flags = _mm256_set1_epi32(LOW_CLASS_FLAGS);
+    const __m256i qcfail = _mm256_set1_epi32(BAM_FQCFAIL);
+    const __m256i hqaa_flag_mask = _mm256_set1_epi32(HQAA_FLAG_MASK);
+    const __m256i hqaa_flags = _mm256_set1_epi32(HQAA_FLAGS);
+    const __m256i below_hqaa_quality = _mm256_set1_epi32(HQAA_MINIMUM_QUALITY - 1);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i autosomal = _mm256_set1_epi32(ReadBatchClassifier::AUTOSOMAL);
+    const __m256i hqaa = _mm256_set1_epi32(ReadBatchClassifier::HQAA);
+
+    alignas(32) int32_t category_lanes[8];
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i flags = _mm256_load_si256((const __m256i*) (lanes.flags + i));
+        __m256i qualities = _mm256_load_si256((const __m256i*) (lanes.qualities + i));
+        __m256i tids = _mm256_load_si256((const __m256i*) (lanes.tids + i));
+        __m256i mate_tids = _mm256_load_si256((const __m256i*) (lanes.mate_tids + i));
+        __m256i placed = _mm256_load_si256((const __m256i*) (lanes.placed + i));
+        __m256i isize_signs = _mm256_load_si256((const __m256i*) (lanes.isize_signs + i));
+        __m256i references = _mm256_load_si256((const __m256i*) (lanes.references + i));
+
+        __m256i placement = _mm256_blendv_epi8(one, _mm256_add_epi32(three, isize_signs), placed);
+        placement = _mm256_and_si256(placement, _mm256_cmpeq_epi32(tids, mate_tids));
+        __m256i row = _mm256_add_epi32(_mm256_and_si256(_mm256_cmpeq_epi32(qualities, zero), pair_placements), placement);
+        __m256i key_flags = _mm256_or_si256(_mm256_and_si256(flags, low_class_flags), _mm256_srli_epi32(_mm256_and_si256(flags, qcfail), QCFAIL_SHIFT));
+        __m256i keys = _mm256_add_epi32(_mm256_slli_epi32(row, FLAG_BITS), key_flags);
+        _mm256_storeu_si256((__m256i*) (flag_keys + i), keys);
+
+        __m256i is_hqaa = _mm256_cmpeq_epi32(_mm256_and_si256(flags, hqaa_flag_mask), hqaa_flags);
+        is_hqaa = _mm256_and_si256(is_hqaa, _mm256_cmpgt_epi32(qualities, below_hqaa_quality));
+        is_hqaa = _mm256_and_si256(is_hqaa, _mm256_cmpgt_epi32(tids, minus_one));
+        is_hqaa = _mm256_and_si256(is_hqaa, _mm256_cmpeq_epi32(_mm256_and_si256(references, autosomal), autosomal));
+        _mm256_store_si256((__m256i*) category_lanes, _mm256_or_si256(references, _mm256_and_si256(is_hqaa, hqaa)));
+
+        for (size_t j = 0; j < 8; j++) {
+            categories[i + j] = category_lanes[j];
+        }
+    }
+    return i;
+}
+
+#endif
+
+
+//
+// Fill flag_keys and categories for each of the records, LANES at a
+// time: the fields are gathered from the records, then evaluated
+// with the classifier's kernel, and any lanes left over by the
+// vector kernels are finished one by one.
+//
+void ReadBatchClassifier::classify(const bam1_t* const* records, const size_t count, uint32_t* flag_keys, uint8_t* categories) {
+    for (size_t first = 0; first < count; first += LANES) {
+        const size_t lane_count = std::min(LANES, count - first);
+
+        for (size_t i = 0; i < lane_count; i++) {
+            const bam1_core_t& core = records[first + i]->core;
+            lanes.flags[i] = core.flag;
+            lanes.qualities[i] = core.qual;
+            lanes.tids[i] = core.tid;
+            lanes.mate_tids[i] = core.mtid;
+            lanes.placed[i] = (core.pos != 0 && core.mpos != 0) ? -1 : 0;
+            lanes.isize_signs[i] = (core.isize > 0) - (core.isize < 0);
+            lanes.references[i] = (core.tid >= 0 && (size_t) core.tid < reference_categories.size()) ? reference_categories[core.tid] : 0;
+        }
+
+        size_t classified = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        if (kernel == Kernel::AVX2) {
+            classified = classify_lanes_avx2(lanes, lane_count, flag_keys + first, categories + first);
+        } else if (kernel == Kernel::SSE4) {
+            classified = classify_lanes_sse4(lanes, lane_count, flag_keys + first, categories + first);
+        }
+#endif
+        classify_lanes_scalar(lanes, classified, lane_count, flag_keys + first, categories + first);
+    }
+}
+
+
+ImproperPairLog::ImproperPairLog(const size_t buffer_limit) : buffer_limit(buffer_limit) {}
+
+
+void ImproperPairLog::add(const char* name, const unsigned long long int fragment_size) {
+    entries.push_back(Entry{fragment_size, names.size()});
+    names.append(name, std::strlen(name) + 1);
+    count++;
+
+    if (names.size() + entries.size() * sizeof(Entry) >= buffer_limit) {
+        spill();
+    }
+}
+
+
+//
+// Take the other log's reads, after this log's own. Its spilled runs
+// are shared, not copied.
+//
+void ImproperPairLog::merge(const ImproperPairLog& other) {
+    if (!other.runs.empty()) {
+        // keep the runs in the order their reads were added
+        if (!entries.empty()) {
+            spill();
+        }
+        runs.insert(runs.end(), other.runs.begin(), other.runs.end());
+        count += other.count - other.entries.size();
+    }
+
+    for (const Entry& entry : other.entries) {
+        add(other.names.c_str() + entry.name, entry.fragment_size);
+    }
+}
+
+
+//
+// The buffered entries' indexes in name order, with the entries for
+// each name in the order they were added, as they'd be listed from a
+// map of names to vectors of sizes.
+//
+std::vector<size_t> ImproperPairLog::sorted_entries() const {
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [this](const size_t a, const size_t b) {
+        return std::strcmp(names.c_str() + entries[a].name, names.c_str() + entries[b].name) < 0;
+    });
+    return order;
+}
+
+
+void ImproperPairLog::spill() {
+    std::string filename;
+    try {
+        filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("ataqv-%%%%-%%%%-%%%%-%%%%.improper")).string();
+    } catch (boost::filesystem::filesystem_error& e) {
+        throw FileException("Could not name a temporary file for improperly paired reads: " + std::string(e.what()));
+    }
+
+    std::shared_ptr<const std::string> run(new std::string(filename), [](const std::string* filename) {
+        boost::system::error_code error;
+        boost::filesystem::remove(*filename, error);
+        delete filename;
+    });
+
+    std::ofstream out(filename, std::ios::binary);
+    for (size_t i : sorted_entries()) {
+        const char* name = names.c_str() + entries[i].name;
+        out.write(name, std::strlen(name) + 1);
+        out.write(reinterpret_cast<const char*>(&entries[i].fragment_size), sizeof(entries[i].fragment_size));
+    }
+    out.close();
+    if (!out) {
+        throw FileException("Could not write improperly paired reads to temporary file " + filename + ".");
+    }
+
+    runs.push_back(run);
+    names.clear();
+    entries.clear();
+}
+
+
+//
+// Visit every read in name order, with each name's reads in the order
+// they were added, and empty the log.
+//
+void ImproperPairLog::drain(const std::function<void(const std::string&, const unsigned long long int)>& visit) {
+    if (runs.empty()) {
+        for (size_t i : sorted_entries()) {
+            visit(names.c_str() + entries[i].name, entries[i].fragment_size);
+        }
+    } else {
+        if (!entries.empty()) {
+            spill();
+        }
+
+        struct RunReader {
+            std::ifstream in;
+            std::string name;
+            unsigned long long int fragment_size;
+
+            bool next() {
+                return std::getline(in, name, '\0') && in.read(reinterpret_cast<char*>(&fragment_size), sizeof(fragment_size));
+            }
+        };
+
+        std::vector<std::unique_ptr<RunReader>> readers;
+        for (const auto& run : runs) {
+            readers.emplace_back(new RunReader());
+            readers.back()->in.open(*run, std::ios::binary);
+            if (!readers.back()->in) {
+                throw FileException("Could not read improperly paired reads from temporary file " + *run + ".");
+            }
+        }
+
+        // merge the runs, taking equal names from older runs first
+        auto later = [&readers](const size_t a, const size_t b) {
+            int order = readers[a]->name.compare(readers[b]->name);
+            return order > 0 || (order == 0 && a > b);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heads(later);
+        for (size_t i = 0; i < readers.size(); i++) {
+            if (readers[i]->next()) {
+                heads.push(i);
+            }
+        }
+
+        while (!heads.empty()) {
+            size_t i = heads.top();
+            heads.pop();
+            visit(readers[i]->name, readers[i]->fragment_size);
+            if (readers[i]->next()) {
+                heads.push(i);
+            }
+        }
+    }
+
+    names.clear();
+    entries.clear();
+    runs.clear();
+    count = 0;
+}
+
+
+size_t ImproperPairLog::size() const {
+    return count;
+}
+
+
+size_t ImproperPairLog::spilled_runs() const {
+    return runs.size();
+}
+
+
+Metrics::Metrics(MetricsCollector* collector, const std::string& name): collector(collector), name(name), peaks(), log_problematic_reads(collector->log_problematic_reads), less_redundant(collector->less_redundant), drop_excluded_reads(collector->drop_excluded_reads) {
+
+    if (log_problematic_reads) {
+        try {
+            problematic_read_filename = make_metrics_filename(".problems");
+
+            if (collector->verbose) {
+                std::cout << "Logging problematic reads to " << problematic_read_filename << "." << std::endl << std::endl;
+            }
+
+            problematic_read_stream = mostream(problematic_read_filename);
+        } catch (FileException& e) {
+            throw FileException("Could not open problematic read file " + problematic_read_filename + ": " + e.what());
+        }
+    }
+
+    if (!collector->peak_filename.empty()) {
+        peaks_requested = true;
+        load_peaks();
+    }
+
+    flag_counts.assign(FLAG_KEYS, 0);
+    counted_flag_counts.assign(COUNTED_FLAG_VALUES, 0);
+    improper_fragment_size_counts.assign(collector->fragment_length_ceiling + 1, 0);
+    modules.configure(*collector, MetricModules::mask(collector->metric_modules));
+
+    if (!collector->tss_filename.empty()) {
+        tss_requested = true;
+        for (int i = 1; i <= 1 + 2 * collector->tss_extension; i++) {
+            tss_coverage[i] = 0;
+        }
+        tss_coverage_changes.assign(3 + 2 * collector->tss_extension, 0);
+    }
+
+    select_alignment_measurer();
+}
+
+
+std::string Metrics::make_metrics_filename(const std::string& suffix) {
+    return name + suffix;
+}
+
+
+void Metrics::log_problematic_read(const std::string& problem, const std::string& record) {
+    if (!log_problematic_reads) {
+        return;
+    }
+
+    *problematic_read_stream << problem;
+
+    if (!record.empty()) {
+        *problematic_read_stream << '\t' << record;
+    }
+
+    *problematic_read_stream << '\n';
+}
+
+
+//
+// Add the measurements of another Metrics for the same read group,
+// collected from a different part of the alignment file.
+//
+void Metrics::merge(const Metrics& other) {
+    total_reads += other.total_reads;
+    excluded_region_reads += other.excluded_region_reads;
+
+    // the counters derived from these are counted when finalizing
+    for (size_t key = 0; key < flag_counts.size(); key++) {
+        flag_counts[key] += other.flag_counts[key];
+    }
+
+    for (size_t index = 0; index < counted_flag_counts.size(); index++) {
+        counted_flag_counts[index] += other.counted_flag_counts[index];
+    }
+
+    reads_mapped_and_paired_but_improperly += other.reads_mapped_and_paired_but_improperly;
+
+    // the diagnosis of improper pairs has to wait until the maximum
+    // is known across the whole file, so it's not merged here, but
+    // the suspects are carried over for make_aggregate_diagnoses
+    maximum_proper_pair_fragment_size = std::max(maximum_proper_pair_fragment_size, other.maximum_proper_pair_fragment_size);
+    reads_with_mate_too_distant += other.reads_with_mate_too_distant;
+
+    for (size_t fragment_size = 0; fragment_size < other.improper_fragment_size_counts.size(); fragment_size++) {
+        if (other.improper_fragment_size_counts[fragment_size]) {
+            add_improper_fragment_size_count(fragment_size, other.improper_fragment_size_counts[fragment_size]);
+        }
+    }
+
+    for (const auto& it : other.long_improper_fragment_size_counts) {
+        add_improper_fragment_size_count(it.first, it.second);
+    }
+
+    improper_pairs.merge(other.improper_pairs);
+
+    total_autosomal_reads += other.total_autosomal_reads;
+    total_mitochondrial_reads += other.total_mitochondrial_reads;
+    duplicate_autosomal_reads += other.duplicate_autosomal_reads;
+    duplicate_mitochondrial_reads += other.duplicate_mitochondrial_reads;
+
+    hqaa += other.hqaa;
+
+    hqaa_short_count += other.hqaa_short_count;
+    hqaa_mononucleosomal_count += other.hqaa_mononucleosomal_count;
+
+    modules.merge(other.modules);
+
+    for (const auto& it : other.tss_coverage) {
+        tss_coverage[it.first] += it.second;
+    }
+
+    for (size_t i = 0; i < std::min(tss_coverage_changes.size(), other.tss_coverage_changes.size()); i++) {
+        tss_coverage_changes[i] += other.tss_coverage_changes[i];
+    }
+
+    peaks.merge(other.peaks);
+}
+
+
+//
+// Derive the counters of reads with each property, and of each class
+// of read, from the flag counts.
+//
+void Metrics::count_flags() {
+    forward_reads = reverse_reads = secondary_reads = supplementary_reads = duplicate_reads = 0;
+    paired_reads = paired_and_mapped_reads = properly_paired_and_mapped_reads = 0;
+    first_reads = second_reads = forward_mate_reads = reverse_mate_reads = fr_reads = 0;
+    unmapped_reads = unmapped_mate_reads = qcfailed_reads = unpaired_reads = 0;
+    ff_reads = rf_reads = rr_reads = 0;
+    reads_with_mate_mapped_to_different_reference = reads_mapped_with_zero_quality = unclassified_reads = 0;
+
+    const std::vector<ReadClass>& classes = flag_key_classes();
+    bam1_t flag_record = {};
+    bam1_t* record = &flag_record;
+
+    for (size_t index = 0; index < counted_flag_counts.size(); index++) {
+        unsigned long long int count = counted_flag_counts[index];
+        record->core.flag = index << COUNTED_FLAGS_SHIFT;
+
+        if (IS_SECONDARY(record)) {
+            secondary_reads += count;
+        }
+
+        if (IS_SUPPLEMENTARY(record)) {
+            supplementary_reads += count;
+        }
+
+        if (IS_DUP(record)) {
+            duplicate_reads += count;
+        }
+
+        if (IS_READ1(record)) {
+            first_reads += count;
+        }
+
+        if (IS_READ2(record)) {
+            second_reads += count;
+        }
+    }
+
+    for (size_t key = 0; key < flag_counts.size(); key++) {
+        unsigned long long int count = flag_counts[key];
+        if (count == 0) {
+            continue;
+        }
+
+        make_flag_record(key, record);
+
+        (IS_REVERSE(record) ? reverse_reads : forward_reads) += count;
+        (IS_MATE_REVERSE(record) ? reverse_mate_reads : forward_mate_reads) += count;
+
+        if (IS_PAIRED(record)) {
+            paired_reads += count;
+        }
+
+        switch (classes[key]) {
+        case ReadClass::QC_FAILED:
+            qcfailed_reads += count;
+            break;
+        case ReadClass::UNPAIRED:
+            unpaired_reads += count;
+            break;
+        case ReadClass::UNMAPPED:
+            unmapped_reads += count;
+            break;
+        case ReadClass::UNMAPPED_MATE:
+            unmapped_mate_reads += count;
+            break;
+        case ReadClass::RF:
+            rf_reads += count;
+            break;
+        case ReadClass::FF:
+            ff_reads += count;
+            break;
+        case ReadClass::RR:
+            rr_reads += count;
+            break;
+        case ReadClass::ZERO_QUALITY:
+            reads_mapped_with_zero_quality += count;
+            break;
+        case ReadClass::PROPERLY_PAIRED:
+            paired_and_mapped_reads += count;
+            properly_paired_and_mapped_reads += count;
+            if (is_fr(record)) {
+                fr_reads += count;
+            }
+            break;
+        case ReadClass::MATE_ON_DIFFERENT_REFERENCE:
+            paired_and_mapped_reads += count;
+            reads_with_mate_mapped_to_different_reference += count;
+            break;
+        case ReadClass::IMPROPERLY_PAIRED:
+            paired_and_mapped_reads += count;
+            break;
+        case ReadClass::UNCLASSIFIED:
+            unclassified_reads += count;
+            break;
+        }
+    }
+}
+
+
+void Metrics::make_aggregate_diagnoses() {
+    // last-minute classification of undiagnosed reads
+    reads_mapped_and_paired_but_improperly = improper_fragment_sizes_up_to(maximum_proper_pair_fragment_size);
+    reads_with_mate_too_distant = improper_fragment_sizes_up_to(std::numeric_limits<unsigned long long int>::max()) - reads_mapped_and_paired_but_improperly;
+
+    if (log_problematic_reads) {
+        improper_pairs.drain([this](const std::string& name, const unsigned long long int fragment_size) {
+            log_problematic_read(maximum_proper_pair_fragment_size < fragment_size ? "Mate too distant" : "Undiagnosed", name);
+        });
+    }
+}
+
+
+bool Metrics::is_autosomal(const std::string& reference_name) {
+    return collector->is_autosomal(reference_name);
+}
+
+
+bool Metrics::is_mitochondrial(const std::string& reference_name) {
+    return collector->is_mitochondrial(reference_name);
+}
+
+
+bool Metrics::is_autosomal(const int tid) const {
+    return collector->is_autosomal(tid);
+}
+
+
+bool Metrics::is_mitochondrial(const int tid) const {
+    return collector->is_mitochondrial(tid);
+}
+
+
+std::string Metrics::configuration_string() const {
+    std::stringstream cs;
+    cs << "Read Group\n==========\nID: " << name << std::endl << library << std::endl;
+    return cs.str();
+}
+
+
+bool Metrics::is_hqaa(const bam_hdr_t* header, const bam1_t* record) const {
+    return collector->is_hqaa(header, record);
 }
 
 
@@ -605,53 +2288,28 @@ bool Metrics::is_rr(const bam1_t* record) {
 }
 
 
-double Metrics::mean_mapq() const {
-    unsigned long long int total_mapq = 0;
-    for (auto it : mapq_counts) {
-        total_mapq += it.first * it.second;
+void Metrics::add_improper_fragment_size_count(const unsigned long long int fragment_size, const unsigned long long int count) {
+    if (fragment_size < improper_fragment_size_counts.size()) {
+        improper_fragment_size_counts[fragment_size] += count;
+    } else {
+        long_improper_fragment_size_counts[fragment_size] += count;
     }
-    return (double) total_mapq / total_reads;
 }
 
 
-double Metrics::median_mapq() const {
-    double median = 0.0;
-
-    if (total_reads == 0) {
-        return 0;
-    }
-
-    unsigned long long int median1;
-    unsigned long long int median2;
-
-    // if the number of reads is even, we need to take the mean of the
-    // two values around the ideal median, but with an odd number of
-    // reads, we just need the existent median value
-
-    if (total_reads % 2 == 0) {
-        median1 = ((unsigned long long int)total_reads / 2) - 1;
-        median2 = (unsigned long long int)total_reads / 2;
-    } else {
-        median1 = median2 = (unsigned long long int)total_reads / 2;
+//
+// The number of improperly paired reads with fragments no longer than
+// the given size.
+//
+unsigned long long int Metrics::improper_fragment_sizes_up_to(const unsigned long long int fragment_size) const {
+    unsigned long long int count = 0;
+    for (size_t size = 0; size < improper_fragment_size_counts.size() && size <= fragment_size; size++) {
+        count += improper_fragment_size_counts[size];
     }
-
-    unsigned long long int mapq_index = 0;
-    for (auto it : mapq_counts) {
-        unsigned long long int next_mapq_index = mapq_index + it.second;
-        bool median1_here = (mapq_index <= median1 && median1 <= next_mapq_index);
-        bool median2_here = (mapq_index <= median2 && median2 <= next_mapq_index);
-
-        if (median1_here) {
-            median += it.first;
-        }
-
-        if (median2_here) {
-            median += it.first;
-            median /= 2;
-        }
-        mapq_index += it.second;
+    for (auto it = long_improper_fragment_size_counts.begin(); it != long_improper_fragment_size_counts.end() && it->first <= fragment_size; it++) {
+        count += it->second;
     }
-    return median;
+    return count;
 }
 
 
@@ -672,7 +2330,7 @@ void MetricsCollector::load_excluded_regions() {
         }
 
         while (*region_file >> region) {
-            excluded_regions.push_back(region);
+            excluded_regions.add(region);
             count++;
         }
 
@@ -680,6 +2338,8 @@ void MetricsCollector::load_excluded_regions() {
             std::cout << "Read " << count << " excluded regions from " << filename << "." << std::endl;
         }
     }
+
+    excluded_regions.build();
 }
 
 
@@ -687,195 +2347,160 @@ void MetricsCollector::load_excluded_regions() {
 /// Measure and record a single read
 ///
 void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record) {
-    unsigned long long int fragment_length = llabs(record->core.isize);
-
-    total_reads++;
-
-    // record the read's quality
-    mapq_counts[record->core.qual]++;
-
-    if (IS_REVERSE(record)) {
-        reverse_reads++;
-    } else {
-        forward_reads++;
-    }
+    add_alignment(header, record, make_flag_key(record), collector->read_categories(record));
+}
 
-    if (IS_SECONDARY(record)) {
-        secondary_reads++;
-    }
 
-    if (IS_SUPPLEMENTARY(record)) {
-        supplementary_reads++;
-    }
+///
+/// Measure and record a single read, already classified, alone or by
+/// a ReadBatchClassifier
+///
+void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record, const size_t flag_key, const uint8_t categories) {
+    (this->*alignment_measurer)(header, record, flag_key, categories);
+}
 
-    if (IS_DUP(record)) {
-        duplicate_reads++;
-    }
 
-    if (IS_READ1(record)) {
-        first_reads++;
-    }
+//
+// Pick the measure_alignment instantiation for these Metrics'
+// options, which are settled once they're constructed.
+//
+void Metrics::select_alignment_measurer() {
+    static const AlignmentMeasurer measurers[] = {
+        &Metrics::measure_alignment<false, false, false, false>,
+        &Metrics::measure_alignment<false, false, false, true>,
+        &Metrics::measure_alignment<false, false, true, false>,
+        &Metrics::measure_alignment<false, false, true, true>,
+        &Metrics::measure_alignment<false, true, false, false>,
+        &Metrics::measure_alignment<false, true, false, true>,
+        &Metrics::measure_alignment<false, true, true, false>,
+        &Metrics::measure_alignment<false, true, true, true>,
+        &Metrics::measure_alignment<true, false, false, false>,
+        &Metrics::measure_alignment<true, false, false, true>,
+        &Metrics::measure_alignment<true, false, true, false>,
+        &Metrics::measure_alignment<true, false, true, true>,
+        &Metrics::measure_alignment<true, true, false, false>,
+        &Metrics::measure_alignment<true, true, false, true>,
+        &Metrics::measure_alignment<true, true, true, false>,
+        &Metrics::measure_alignment<true, true, true, true>
+    };
 
-    if (IS_READ2(record)) {
-        second_reads++;
-    }
+    alignment_measurer = measurers[(log_problematic_reads << 3) | (!peaks.empty() << 2) | (tss_requested << 1) | drop_excluded_reads];
+}
 
-    if (IS_MATE_REVERSE(record)) {
-        reverse_mate_reads++;
-    } else {
-        forward_mate_reads++;
-    }
 
-    if (IS_PAIRED(record)) {
-        paired_reads++;
-    }
+//
+// The body of add_alignment, with the options that don't change from
+// one read to the next as template parameters, so each combination
+// gets its own copy, without the checks that don't apply to it.
+//
+template <bool LogProblematicReads, bool MeasurePeaks, bool MeasureTSS, bool DropExcludedReads>
+void Metrics::measure_alignment(const bam_hdr_t* header, const bam1_t* record, const size_t flag_key, const uint8_t categories) {
+    unsigned long long int fragment_length = llabs(record->core.isize);
 
-    if (IS_QCFAIL(record)) {
-        qcfailed_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("QC failed", record_to_string(header, record));
-        }
-    } else if (!IS_PAIRED(record)) {
-        unpaired_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unpaired", record_to_string(header, record));
-        }
-    } else if (IS_UNMAPPED(record)) {
-        unmapped_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unmapped", record_to_string(header, record));
-        }
-    } else if (IS_MATE_UNMAPPED(record)) {
-        unmapped_mate_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unmapped mate", record_to_string(header, record));
-        }
-    } else if (is_rf(record)) {
-        rf_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("RF", record_to_string(header, record));
-        }
-    } else if (is_ff(record)) {
-        ff_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("FF", record_to_string(header, record));
-        }
-    } else if (is_rr(record)) {
-        rr_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("RR", record_to_string(header, record));
+    if (DropExcludedReads && record->core.tid >= 0 && !IS_UNMAPPED(record) &&
+        collector->excluded_regions.overlaps(Interval(record, collector->reference_classifications[record->core.tid].reference_id))) {
+        excluded_region_reads++;
+        if (MeasureTSS) {
+            forget_tss_mate(record);
         }
-    } else if (record->core.qual == 0) {
-        reads_mapped_with_zero_quality++;
-        if (log_problematic_reads) {
-            log_problematic_read("Mapped with zero quality", record_to_string(header, record));
+        return;
+    }
+
+    total_reads++;
+
+    modules.observe(record, categories);
+
+    flag_counts[flag_key]++;
+    counted_flag_counts[make_counted_flags_index(record)]++;
+
+    // TSS coverage considers every HQAA read, even those classified
+    // below as QC failures or in unexpected orientations
+    if (MeasureTSS) {
+        if (categories & ReadBatchClassifier::HQAA) {
+            add_tss_coverage(record);
+        } else {
+            forget_tss_mate(record);
         }
-    } else if (IS_PAIRED_AND_MAPPED(record)) {
-        paired_and_mapped_reads++;
+    }
 
-        if (IS_PROPERLYPAIRED(record)) {
-            properly_paired_and_mapped_reads++;
+    ReadClass read_class = flag_key_classes()[flag_key];
 
-            if (is_fr(record)) {
-                fr_reads++;
-            }
+    if (LogProblematicReads && read_class != ReadClass::PROPERLY_PAIRED) {
+        log_problematic_read(read_class_problems.at(read_class), record_to_string(header, record));
+    }
 
-            // we'll only assert that a read is autosomal or
-            // mitochondrial if it's properly paired and mapped and
-            // (of course) has a valid reference name
-            if (record->core.tid >= 0) {
-                std::string reference_name(header->target_name[record->core.tid]);
+    if (read_class == ReadClass::PROPERLY_PAIRED) {
+        // we'll only assert that a read is autosomal or
+        // mitochondrial if it's properly paired and mapped and
+        // (of course) has a valid reference name
+        if (record->core.tid >= 0) {
+            if (categories & ReadBatchClassifier::MITOCHONDRIAL) {
+                total_mitochondrial_reads++;
+                if (IS_DUP(record)) {
+                    duplicate_mitochondrial_reads++;
+                }
+            } else {
+                if (categories & ReadBatchClassifier::AUTOSOMAL) {
+                    total_autosomal_reads++;
 
-                if (is_mitochondrial(reference_name)) {
-                    total_mitochondrial_reads++;
-                    if (IS_DUP(record)) {
-                        duplicate_mitochondrial_reads++;
+                    if (MeasurePeaks) {
+                        Interval alignment(record, collector->reference_classifications[record->core.tid].reference_id);
+                        if (collector->coordinate_sorted) {
+                            peaks.record_sorted_alignment(alignment, categories & ReadBatchClassifier::HQAA, IS_DUP(record));
+                        } else {
+                            peaks.queue_alignment(alignment, categories & ReadBatchClassifier::HQAA, IS_DUP(record));
+                        }
                     }
-                } else {
-                    if (is_autosomal(reference_name)) {
-                        total_autosomal_reads++;
 
-                        if (!peaks.empty()) {
-                            peaks.record_alignment(Feature(header, record), is_hqaa(header, record), IS_DUP(record));
-                        }
+                    if (IS_DUP(record)) {
+                        duplicate_autosomal_reads++;
+                    } else {
+                        // nonduplicate, properly paired and uniquely mapped
+                        // autosomal reads will be the basis of our fragment
+                        // size and peak statistics
+                        if (categories & ReadBatchClassifier::HQAA) {
+                            hqaa++;
+                            modules.observe_hqaa(record, fragment_length);
+
+                            if (50 <= fragment_length && fragment_length <= 100) {
+                                hqaa_short_count++;
+                            }
 
-                        if (IS_DUP(record)) {
-                            duplicate_autosomal_reads++;
-                        } else {
-                            // nonduplicate, properly paired and uniquely mapped
-                            // autosomal reads will be the basis of our fragment
-                            // size and peak statistics
-                            if (is_hqaa(header, record)) {
-                                hqaa++;
-                                chromosome_counts[reference_name]++;
-
-                                // record proper pairs' fragment lengths
-                                fragment_length_counts[fragment_length]++;
-
-                                if (50 <= fragment_length && fragment_length <= 100) {
-                                    hqaa_short_count++;
-                                }
-
-                                if (150 <= fragment_length && fragment_length <= 200) {
-                                    hqaa_mononucleosomal_count++;
-                                }
+                            if (150 <= fragment_length && fragment_length <= 200) {
+                                hqaa_mononucleosomal_count++;
                             }
                         }
                     }
                 }
             }
+        }
 
-            // Keep track of the longest fragment seen in a proper
-            // pair (ignoring secondary and supplementary
-            // alignments). BWA has an idea of the maximum reasonable
-            // fragment size a proper pair can have, but rather than
-            // choose one aligner-specific heuristic, we'll just go
-            // with the observed result, and hopefully work with other
-            // aligners too.
-            //
-            // When we've added all the reads, we'll use this to
-            // identify those that mapped too far from their
-            // mates.
-            //
-            if (IS_PRIMARY(record) &&  maximum_proper_pair_fragment_size < fragment_length) {
-                maximum_proper_pair_fragment_size = fragment_length;
-                if (collector->verbose) {
-                    std::cerr << "New maximum proper pair fragment length: " << maximum_proper_pair_fragment_size << " from [" << record_to_string(header, record) << "]" << std::endl;
-                }
-            }
-        } else if (record->core.tid != record->core.mtid) {
-            // Compare the record's reference ID to its mate's
-            // reference ID. If they're different, the internet is
-            // full of interesting explanations. This might be
-            // because of adapter errors, where pairs of fragments
-            // that each have one adapter attached look like one
-            // proper fragment with both adapters. Or maybe you have
-            // something interesting: translocations, fusions, or in
-            // the case of allosomal references, perhaps a chimera, a
-            // pregnant mother with offspring of a different gender,
-            // or simply alignment to regions homologous between the X
-            // and Y chromosomes.
-            reads_with_mate_mapped_to_different_reference++;
-            if (log_problematic_reads) {
-                log_problematic_read("Mate mapped to different reference", record_to_string(header, record));
-            }
-        } else {
-            // OK, the read was paired, and mapped, but not in a
-            // proper pair, for a reason we don't yet know. Its
-            // mate may have mapped too far away, but we can't
-            // check until we've seen all the reads.
-            std::string record_name = get_qname(record);
-            unlikely_fragment_sizes[record_name].push_back(fragment_length);
-            if (log_problematic_reads) {
-                log_problematic_read("Improper", record_to_string(header, record));
+        // Keep track of the longest fragment seen in a proper
+        // pair (ignoring secondary and supplementary
+        // alignments). BWA has an idea of the maximum reasonable
+        // fragment size a proper pair can have, but rather than
+        // choose one aligner-specific heuristic, we'll just go
+        // with the observed result, and hopefully work with other
+        // aligners too.
+        //
+        // When we've added all the reads, we'll use this to
+        // identify those that mapped too far from their
+        // mates.
+        //
+        if (IS_PRIMARY(record) &&  maximum_proper_pair_fragment_size < fragment_length) {
+            maximum_proper_pair_fragment_size = fragment_length;
+            if (collector->verbose) {
+                std::cerr << "New maximum proper pair fragment length: " << maximum_proper_pair_fragment_size << " from [" << record_to_string(header, record) << "]" << std::endl;
             }
         }
-    } else {
-        // Most cases should have been caught by now, so let's
-        // make a special note of any unexpected oddballs.
-        unclassified_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unclassified", record_to_string(header, record));
+    } else if (read_class == ReadClass::IMPROPERLY_PAIRED) {
+        // OK, the read was paired, and mapped, but not in a proper
+        // pair, for a reason we don't yet know. Its mate may have
+        // mapped too far away, but we can't check until we've seen
+        // all the reads.
+        add_improper_fragment_size_count(fragment_length, 1);
+        if (LogProblematicReads) {
+            improper_pairs.add(bam_get_qname(record), fragment_length);
         }
     }
 }
@@ -884,8 +2509,17 @@ void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record) {
 void Metrics::load_peaks() {
     std::string peak_filename = collector->peak_filename;
 
-    if (peak_filename == "auto") {
+    bool shared = peak_filename != "auto";
+    if (!shared) {
         peak_filename = make_metrics_filename(".peaks");
+    } else if (collector->peak_index) {
+        // every read group's peaks are the same, so only their counts
+        // need to be kept apart
+        if (collector->verbose) {
+            std::cout << "Using the peaks already loaded from " << peak_filename << " for read group " << name << "." << std::endl;
+        }
+        peaks = PeakTree(collector->peak_index);
+        return;
     }
 
     if (collector->verbose) {
@@ -908,214 +2542,185 @@ void Metrics::load_peaks() {
             continue;
         }
         bool excluded = false;
-        for (auto er : collector->excluded_regions) {
-            if (peak.overlaps(er)) {
+        if (!collector->excluded_regions.empty()) {
+            const Interval* er = collector->excluded_regions.find_overlap(Interval(peak));
+            if (er) {
                 if (collector->verbose) {
-                    std::cout << "Excluding peak [" << peak << "] which overlaps excluded region [" << er << "]" << std::endl;
+                    std::cout << "Excluding peak [" << peak << "] which overlaps excluded region [" << collector->excluded_regions.to_feature(*er) << "]" << std::endl;
                 }
                 excluded = true;
-                break;
             }
         }
         if (!excluded) {
-            peaks.add(peak);
+            peaks.append(peak);
         }
     }
 
+    boost::chrono::high_resolution_clock::time_point build_start = boost::chrono::high_resolution_clock::now();
+    peaks.build();
+
+    if (shared) {
+        collector->peak_index = peaks.get_index();
+    }
+
     if (collector->verbose) {
-        duration = boost::chrono::high_resolution_clock::now() - start;
+        boost::chrono::high_resolution_clock::time_point end = boost::chrono::high_resolution_clock::now();
+        duration = end - start;
+        boost::chrono::duration<double> build_duration = end - build_start;
         peaks.print_reference_peak_counts();
-        std::cout << "Loaded " << peaks.size() << " peaks in " << duration << "." << " (" << (peaks.size() / duration.count()) << " peaks/second)." << std::endl << std::endl;
+        std::cout << "Loaded " << peaks.size() << " peaks in " << duration << "." << " (" << (peaks.size() / duration.count()) << " peaks/second, " << build_duration << " of it indexing)." << std::endl << std::endl;
     }
 }
 
 
-std::map<std::string,std::map<int, unsigned long long int>> MetricsCollector::get_tss_coverage_for_reference(const std::string &reference, const int extension) {
-    std::map<std::string,std::map<int, unsigned long long int>> ref_tss_cov = {};
-
-    ReferenceFeatureCollection *tss_collection = tss_tree.get_reference_feature_collection(reference);
-
-    if (!tss_collection->features.empty()) {
-        samFile *alignment_file = nullptr;
-        bam_hdr_t *alignment_file_header = nullptr;
-        hts_idx_t *alignment_file_index = nullptr;
-        bam1_t *record = bam_init1();
-
-        try {
-            if (alignment_filename.empty()) {
-                throw FileException("Alignment file has not been specified.");
-            }
-
-            if ((alignment_file = sam_open(alignment_filename.c_str(), "r")) == nullptr) {
-                throw FileException("Could not open alignment file \"" + alignment_filename + "\".");
-            }
-
-            if ((alignment_file_index = sam_index_load(alignment_file, alignment_filename.c_str())) == nullptr) {
-                throw FileException("Could not open index for alignment file \"" + alignment_filename + "\".");
-            }
+//
+// Add an HQAA read's fragment to the coverage of the TSS it's near.
+//
+// Each fragment counts once for each TSS with either of its reads in
+// the TSS window, so the first of a pair's reads to be measured
+// covers its windows, and is remembered until its mate turns up to
+// cover any windows only the mate reaches. Reads are matched to
+// their mates by position, so no read names need to be kept.
+//
+void Metrics::add_tss_coverage(const bam1_t* record) {
+    const int tid = record->core.tid;
+    const hts_pos_t start = record->core.pos;
+    const unsigned long long int fragment_length = llabs(record->core.isize);
+    const uint16_t read_flags = record->core.flag & (BAM_FREAD1 | BAM_FREAD2);
+    const std::pair<int, hts_pos_t> position(tid, start);
+    const std::pair<int, hts_pos_t> mate_position(record->core.mtid, record->core.mpos);
+
+    // in coordinate order, reads still waiting for mates we've passed
+    // were paired with reads that weren't HQAA or near a TSS
+    if (collector->coordinate_sorted) {
+        while (!tss_mates.empty() && tss_mates.begin()->first < position) {
+            tss_mates.erase(tss_mates.begin());
+        }
+    }
 
-            alignment_file_header = sam_hdr_read(alignment_file);
-            if (alignment_file_header == NULL) {
-                throw FileException("Could not read a valid header from alignment file \"" + alignment_filename +  "\".");
-            }
+    // the mate is taken even if this read isn't near a TSS, so it
+    // isn't left waiting
+    TSSMate mate = {};
+    const bool mate_seen = take_tss_mate(record, mate);
 
-            for (auto tss : tss_collection->features) {
-                std::map<std::string, bool> fragments_seen = {};
+    collector->find_tss_windows(tid, start, bam_endpos(record), tss_windows);
+    if (tss_windows.empty()) {
+        return;
+    }
 
-                Feature tss_region(tss);
-                tss_region.start = std::max((unsigned long long int)0, tss_region.start - extension);
-                tss_region.end += extension;
+    if (!mate_seen && !(collector->coordinate_sorted && mate_position < position)) {
+        tss_mates.insert(std::make_pair(mate_position, TSSMate{tid, start, bam_endpos(record), fragment_length, read_flags}));
+    }
 
-                std::stringstream query;
+    const hts_pos_t fragment_start = std::min(record->core.pos, record->core.mpos);
+    const hts_pos_t fragment_end = fragment_start + fragment_length;
+    const hts_pos_t max_base = 1 + 2 * collector->tss_extension;
 
-                // The HTSlib iterator starts at the first record starting after the beginning of the region, so
-                // we ask for records further before and after the TSS region, then filter them ourselves
-                query << tss_region.reference << ":" << std::max(tss_region.start - extension * 2, 0ULL) << "-" << (tss_region.end + extension * 2);
+    for (const TSSWindow* window : tss_windows) {
+        if (mate_seen && mate.tid == tid && mate.end > window->query_start && mate.start < window->query_end) {
+            continue;
+        }
 
-                hts_itr_t *alignment_iterator;
-                if ((alignment_iterator = sam_itr_querys(alignment_file_index, alignment_file_header, query.str().c_str())) == nullptr) {
-                    std::cerr <<  "Could not find TSS region " << query.str() << " in your BAM file. Check that your TSS file's chromosome naming scheme matches your reference." << std::endl;
-                    continue;
-                }
+        // the fragment must overlap the region as in Feature::overlaps
+        const hts_pos_t region_start = window->region_start;
+        const hts_pos_t region_end = window->region_end;
+        if (!((fragment_start <= region_start && region_start < fragment_end) ||
+              (fragment_start < region_end && region_end < fragment_end) ||
+              (region_start <= fragment_start && fragment_start < region_end) ||
+              (region_start < fragment_end && fragment_end < region_end))) {
+            continue;
+        }
 
-                while (sam_itr_next(alignment_file, alignment_iterator, record) >= 0) {
-                    if (is_hqaa(alignment_file_header, record)) {
-                        std::string qname = get_qname(record);
-                        if (fragments_seen.count(qname) == 0) {
-                            Feature fragment;
-                            fragment.reference = reference;
-                            fragment.start = std::min(record->core.pos, record->core.mpos);
-                            fragment.end = fragment.start + abs(record->core.isize);
-                            fragments_seen[qname] = true;
-
-                            if (fragment.overlaps(tss_region)) {
-                                std::string metrics_id = name.empty() ? basename(alignment_filename) : name;
-                                uint8_t* rgaux = bam_aux_get(record, "RG");
-                                if (!ignore_read_groups && rgaux) {
-                                    metrics_id = bam_aux2Z(rgaux);
-                                }
-                                for (unsigned long long int pos = tss_region.start; pos <= tss_region.end; pos++) {
-                                    if (pos >= fragment.start && pos <= fragment.end) {
-                                        int base = tss.is_reverse() ? (tss_region.end - pos) : (pos - tss_region.start);
-                                        ref_tss_cov[metrics_id][base]++;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+        // the bases covered, numbered from the upstream end of the region
+        const hts_pos_t first = std::max(region_start, fragment_start);
+        const hts_pos_t last = std::min(region_end, fragment_end);
+        const hts_pos_t first_base = std::max(window->reverse ? (region_end - last) : (first - region_start), (hts_pos_t) 1);
+        const hts_pos_t last_base = std::min(window->reverse ? (region_end - first) : (last - region_start), max_base);
 
-            bam_destroy1(record);
-            bam_hdr_destroy(alignment_file_header);
-            hts_idx_destroy(alignment_file_index);
-            if (alignment_file) {
-                hts_close(alignment_file);
-            }
-        } catch (FileException& e) {
-            bam_destroy1(record);
-            bam_hdr_destroy(alignment_file_header);
-            hts_idx_destroy(alignment_file_index);
-            if (alignment_file) {
-                hts_close(alignment_file);
-            }
-            throw;
+        if (first_base <= last_base) {
+            tss_coverage_changes[first_base] += window->tss_count;
+            tss_coverage_changes[last_base + 1] -= window->tss_count;
         }
     }
-
-    return ref_tss_cov;
 }
 
-void MetricsCollector::calculate_tss_coverage() {
-
-    if (tss_filename == "") {
-        return;
-    }
 
-    if (verbose) {
-        std::cout << "Calculating TSS coverage..." << std::endl;
+//
+// Find and remove the read waiting for this one, if there is one.
+//
+bool Metrics::take_tss_mate(const bam1_t* record, TSSMate& mate) {
+    if (tss_mates.empty()) {
+        return false;
+    }
+
+    const unsigned long long int fragment_length = llabs(record->core.isize);
+    const uint16_t read_flags = record->core.flag & (BAM_FREAD1 | BAM_FREAD2);
+
+    auto candidates = tss_mates.equal_range(std::make_pair(record->core.tid, record->core.pos));
+    for (auto candidate = candidates.first; candidate != candidates.second; candidate++) {
+        if (candidate->second.tid == record->core.mtid &&
+            candidate->second.start == record->core.mpos &&
+            candidate->second.fragment_length == fragment_length &&
+            candidate->second.read_flags != read_flags) {
+            mate = candidate->second;
+            tss_mates.erase(candidate);
+            return true;
+        }
     }
+    return false;
+}
 
-    boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
-    boost::chrono::duration<double> duration;
 
-    double tss_count = (double) tss_tree.size();
-    std::map<std::string,std::map<int, unsigned long long int>> tss_coverage = {};
+//
+// A read that won't reach add_tss_coverage, because it isn't HQAA
+// or was dropped, can't cover any windows, but a read waiting for it
+// can stop waiting. In coordinate order, add_tss_coverage prunes the
+// reads passed by anyway; otherwise, they'd wait for the whole file.
+//
+void Metrics::forget_tss_mate(const bam1_t* record) {
+    if (!collector->coordinate_sorted && IS_PRIMARY(record)) {
+        TSSMate mate;
+        take_tss_mate(record, mate);
+    }
+}
 
-    if (tss_count > 0) {
-        for (auto it: metrics) {
-            std::string metrics_id = it.first;
-            for (int i = 1; i <= 1 + 2 * tss_extension; i++) {
-                tss_coverage[metrics_id][i] = 0;
-            }
-        }
 
-        std::vector<std::future<std::map<std::string,std::map<int, unsigned long long int>>>> results = {};
-        int thread_count = 0;
-        for (auto reference : tss_tree.get_references_by_feature_count()) {
-            results.push_back(std::async(std::launch::async, &MetricsCollector::get_tss_coverage_for_reference, this, reference, tss_extension));
-            thread_count++;
-            if (verbose) {
-                std::cout << "Added TSS coverage for " << reference << "; thread count=" << thread_count << std::endl;
-            }
-            while (thread_count == thread_limit) {
-                for (auto result = results.begin(); result != results.end(); result++) {
-                    if (!(*result).valid()) {
-                        results.erase(result);
-                        thread_count--;
-                        break;
-                    } else {
-                        std::future_status status = (*result).wait_for(std::chrono::milliseconds(100));
-                        if (status == std::future_status::ready) {
-                            auto ref_cov = (*result).get();
-                            for (auto it: metrics) {
-                                std::string metrics_id = it.first;
-                                for (int i = 1; i <= 1 + 2 * tss_extension; i++) {
-                                    tss_coverage[metrics_id][i] += ref_cov[metrics_id][i];
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
+//
+// Add the accumulated changes in TSS coverage to tss_coverage.
+//
+void Metrics::sum_tss_coverage() {
+    long long int coverage = 0;
+    for (size_t base = 1; base + 1 < tss_coverage_changes.size(); base++) {
+        coverage += tss_coverage_changes[base];
+        tss_coverage[base] += coverage;
+    }
 
-        if (verbose) {
-            std::cout << "All TSS jobs started. Waiting for last ones to complete." << std::endl;
-        }
+    std::fill(tss_coverage_changes.begin(), tss_coverage_changes.end(), 0);
+}
 
-        while (!results.empty()) {
-            for (auto result = results.begin(); result != results.end(); result++) {
-                if (!(*result).valid()) {
-                    results.erase(result);
-                    break;
-                }
 
-                std::future_status status = (*result).wait_for(std::chrono::milliseconds(100));
-                if (status == std::future_status::ready) {
-                    auto ref_cov = (*result).get();
-                    for (auto it: metrics) {
-                        std::string metrics_id = it.first;
-                        for (int i = 1; i <= 1 + 2 * tss_extension; i++) {
-                            tss_coverage[metrics_id][i] += ref_cov[metrics_id][i];
-                        }
-                    }
-                }
-            }
-        }
+//
+// Remember a read measured elsewhere, usually in another chunk of the
+// alignment file, whose mate will be measured here.
+//
+void Metrics::add_tss_mate(const bam_hdr_t* header, const bam1_t* mate) {
+    if (!tss_requested || !is_hqaa(header, mate)) {
+        return;
+    }
 
-        for (auto it: metrics) {
-            Metrics* m = it.second;
-            m->tss_coverage = tss_coverage[it.first];
-        }
+    // a mate dropped where it was measured never reached any TSS
+    if (drop_excluded_reads && collector->excluded_regions.overlaps(Interval(mate, collector->reference_classifications[mate->core.tid].reference_id))) {
+        return;
     }
 
-    duration = boost::chrono::high_resolution_clock::now() - start;
-    if (verbose) {
-        std::cout << "Calculated TSS coverage in " << duration << "." << std::endl;
+    collector->find_tss_windows(mate->core.tid, mate->core.pos, bam_endpos(mate), tss_windows);
+    if (!tss_windows.empty()) {
+        TSSMate waiting = {mate->core.tid, mate->core.pos, bam_endpos(mate), (unsigned long long int) llabs(mate->core.isize), (uint16_t) (mate->core.flag & (BAM_FREAD1 | BAM_FREAD2))};
+        tss_mates.insert(std::make_pair(std::make_pair(mate->core.mtid, mate->core.mpos), waiting));
     }
 }
 
+
 void Metrics::calculate_tss_metrics() {
 
     if (!tss_requested) {
@@ -1126,7 +2731,7 @@ void Metrics::calculate_tss_metrics() {
         std::cout << "Calculating TSS metrics..." << std::endl;
     }
 
-    double tss_count = (double) collector->tss_tree.size();
+    double tss_count = (double) collector->tss_count;
 
     boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
     boost::chrono::duration<double> duration;
@@ -1213,7 +2818,13 @@ std::ostream& operator<<(std::ostream& os, const Metrics& m) {
        << "  Properly paired and mapped reads: " << m.properly_paired_and_mapped_reads << percentage_string(m.properly_paired_and_mapped_reads, m.total_reads) << std::endl
        << "  Secondary reads: " << m.secondary_reads << percentage_string(m.secondary_reads, m.total_reads) << std::endl
        << "  Supplementary reads: " << m.supplementary_reads << percentage_string(m.supplementary_reads, m.total_reads) << std::endl
-       << "  Duplicate reads: " << m.duplicate_reads << percentage_string(m.duplicate_reads, m.total_reads, 3, " (", "% of all reads)") << std::endl
+       << "  Duplicate reads: " << m.duplicate_reads << percentage_string(m.duplicate_reads, m.total_reads, 3, " (", "% of all reads)") << std::endl;
+
+    if (m.drop_excluded_reads) {
+        os << "  Reads dropped for overlapping excluded regions: " << m.excluded_region_reads << std::endl;
+    }
+
+    os
 
        << std::endl
 
@@ -1278,25 +2889,7 @@ std::ostream& operator<<(std::ostream& os, const Metrics& m) {
        os << "  Duplicate mitochondrial reads: " << m.duplicate_mitochondrial_reads << percentage_string(m.duplicate_mitochondrial_reads, m.total_mitochondrial_reads, 3, " (", "% of all mitochondrial reads)") << std::endl << std::endl;
     }
 
-    os << std::endl
-
-       << "  Mapping Quality" << std::endl
-       << "  ---------------" << std::endl;
-    if (!m.less_redundant) {
-       os << "  Mean MAPQ: " << std::fixed << m.mean_mapq() << std::endl
-       << "  Median MAPQ: " << std::fixed << m.median_mapq() << std::endl;
-    }
-    os << "  Reads with MAPQ >=..." << std::endl;
-
-    for (int threshold = 5; threshold <= 30; threshold += 5) {
-        unsigned long long int count = 0;
-        for (auto it : m.mapq_counts) {
-            if (it.first >= threshold) {
-                count += it.second;
-            }
-        }
-        os << std::setfill(' ') << std::setw(20) << std::right << threshold << ": " << count << percentage_string(count, m.total_reads) << std::endl;
-    }
+    m.modules.write(m, os);
 
     if (m.peaks_requested) {
         os << std::endl << "  Peak Metrics" << std::endl
@@ -1324,6 +2917,22 @@ std::ostream& operator<<(std::ostream& os, const Metrics& m) {
 }
 
 
+void Library::from_json(const nlohmann::json& json) {
+    library = json.at("library").get<std::string>();
+    sample = json.at("sample").get<std::string>();
+    description = json.at("description").get<std::string>();
+    center = json.at("sequencingcenter").get<std::string>();
+    date = json.at("sequencingdate").get<std::string>();
+    platform = json.at("sequencingplatform").get<std::string>();
+    platform_model = json.at("platformmodel").get<std::string>();
+    platform_unit = json.at("platformunit").get<std::string>();
+    flow_order = json.at("floworder").get<std::string>();
+    key_sequence = json.at("keysequence").get<std::string>();
+    predicted_median_insert_size = json.at("predicted_median_insert_size").get<std::string>();
+    programs = json.at("programs").get<std::string>();
+}
+
+
 nlohmann::json Library::to_json() {
     nlohmann::json result = {
         {"library", library},
@@ -1344,53 +2953,6 @@ nlohmann::json Library::to_json() {
 
 
 nlohmann::json Metrics::to_json() {
-    std::vector<std::string> fragment_length_counts_fields = {"fragment_length", "read_count", "fraction_of_all_reads"};
-    nlohmann::json fragment_length_counts_json;
-    int max_fragment_length = std::min(1000, std::max(1000, fragment_length_counts.empty() ? 0 : fragment_length_counts.rbegin()->first));
-
-    for (int fragment_length = 0; fragment_length <= max_fragment_length; fragment_length++) {
-        int count = fragment_length_counts[fragment_length];
-        nlohmann::json flc;
-        flc.push_back(fragment_length);
-        flc.push_back(count);
-        long double fraction_of_total_reads = total_reads == 0 ? std::nan("") : count / (long double) total_reads;
-        flc.push_back(fraction_of_total_reads);
-
-        fragment_length_counts_json.push_back(flc);
-    }
-
-    unsigned long long int max_autosome_counts = 0;
-    unsigned long long int total_autosome_counts = 0;
-    nlohmann::json chromosome_counts_json;
-
-    for (auto it : chromosome_counts) {
-        std::string chromosome = it.first;
-        unsigned long long int reads_from_chromosome = it.second;
-        nlohmann::json cc;
-        cc.push_back(chromosome);
-        cc.push_back(reads_from_chromosome);
-        chromosome_counts_json.push_back(cc);
-
-        if (is_autosomal(chromosome)) {
-                total_autosome_counts += reads_from_chromosome;
-                if (reads_from_chromosome > max_autosome_counts) {
-                        max_autosome_counts = reads_from_chromosome;
-                }
-        }
-    }
-
-    long double max_fraction_reads_from_single_autosome = total_autosome_counts == 0 ? std::nan("") : max_autosome_counts / (long double) total_autosome_counts;
-
-    std::vector<std::string> mapq_counts_fields = {"mapq", "read_count"};
-
-    nlohmann::json mapq_counts_json;
-    for (auto it : mapq_counts) {
-        nlohmann::json mc;
-        mc.push_back(it.first);
-        mc.push_back(it.second);
-        mapq_counts_json.push_back(mc);
-    }
-
     std::vector<std::string> peaks_fields = {
         "name",
         "overlapping_hqaa",
@@ -1405,8 +2967,7 @@ nlohmann::json Metrics::to_json() {
         {"cumulative_fraction_of_territory", {}}
     };
 
-    auto default_peak_list = peaks.list_peaks();
-    unsigned long long int peak_count = default_peak_list.size();
+    unsigned long long int peak_count = peaks.size();
     unsigned long long int hqaa_overlapping_peaks = 0;
 
 
@@ -1414,22 +2975,23 @@ nlohmann::json Metrics::to_json() {
         percentile_indices.insert(peak_count * (percentile / 100.0));
     }
 
-    for (auto peak: default_peak_list) {
-        hqaa_overlapping_peaks += peak.overlapping_hqaa;
+    peak_list.reserve(peak_count);
+    peaks.visit_peaks([&](const char* name, unsigned long long int overlapping_hqaa, unsigned long long int size) {
+        hqaa_overlapping_peaks += overlapping_hqaa;
 
         nlohmann::json jp;
-        jp.push_back(peak.name);
-        jp.push_back(peak.overlapping_hqaa);
-        jp.push_back(peak.size());
+        jp.push_back(name);
+        jp.push_back(overlapping_hqaa);
+        jp.push_back(size);
 
         peak_list.push_back(jp);
-    }
+    });
 
     unsigned long long int count = 0;
     long double cumulative_fraction_of_hqaa = 0.0;
-    for (auto peak: peaks.list_peaks_by_overlapping_hqaa_descending()) {
+    for (auto overlapping_hqaa : peaks.overlapping_hqaa_descending(peak_count)) {
         count++;
-        cumulative_fraction_of_hqaa += hqaa == 0 ? std::nan("") : (peak.overlapping_hqaa / (long double)hqaa);
+        cumulative_fraction_of_hqaa += hqaa == 0 ? std::nan("") : (overlapping_hqaa / (long double)hqaa);
 
         if (percentile_indices.count(count) == 1) {
             peak_percentiles["cumulative_fraction_of_hqaa"].push_back(cumulative_fraction_of_hqaa);
@@ -1438,9 +3000,9 @@ nlohmann::json Metrics::to_json() {
 
     count = 0;
     long double cumulative_fraction_of_territory = 0.0;
-    for (auto peak: peaks.list_peaks_by_size_descending()) {
+    for (auto size : peaks.sizes_descending()) {
         count++;
-        cumulative_fraction_of_territory += (peak.size() / (long double)peaks.total_peak_territory);
+        cumulative_fraction_of_territory += (size / (long double)peaks.total_peak_territory);
 
         if (percentile_indices.count(count) == 1) {
             peak_percentiles["cumulative_fraction_of_territory"].push_back(cumulative_fraction_of_territory);
@@ -1509,13 +3071,6 @@ nlohmann::json Metrics::to_json() {
              {"duplicate_fraction_in_peaks", fraction(peaks.duplicates_in_peaks, peaks.ppm_in_peaks)},
              {"duplicate_fraction_not_in_peaks", fraction(peaks.duplicates_not_in_peaks, peaks.ppm_not_in_peaks)},
              {"peak_duplicate_ratio", fraction(fraction(peaks.duplicates_not_in_peaks, peaks.ppm_not_in_peaks), fraction(peaks.duplicates_in_peaks, peaks.ppm_in_peaks))},
-             {"fragment_length_counts_fields", fragment_length_counts_fields},
-             {"fragment_length_counts", fragment_length_counts_json},
-             {"fragment_length_distance", nullptr},
-             {"mapq_counts_fields", mapq_counts_fields},
-             {"mapq_counts", mapq_counts_json},
-             {"mean_mapq", mean_mapq()},
-             {"median_mapq", median_mapq()},
              {"peaks_fields", peaks_fields},
              {"peaks", peak_list},
              {"peak_percentiles", peak_percentiles},
@@ -1523,15 +3078,133 @@ nlohmann::json Metrics::to_json() {
              {"total_peak_territory", peaks.total_peak_territory},
              {"hqaa_overlapping_peaks_percent", percentage(hqaa_overlapping_peaks, hqaa)},
              {"tss_coverage", tss_coverage_vec},
-             {"tss_enrichment", tss_enrichment},
-             {"chromosome_counts", chromosome_counts_json},
-             {"max_fraction_reads_from_single_autosome", max_fraction_reads_from_single_autosome}
+             {"tss_enrichment", tss_enrichment}
          }
         }
     };
+
+    if (drop_excluded_reads) {
+        result["metrics"]["excluded_region_reads"] = excluded_region_reads;
+    }
+
+    modules.to_json(*this, *collector, result["metrics"]);
+
     return result;
 }
 
+
+//
+// The counters saved in partial metrics, which are combined by merge.
+// The improper pair diagnoses aren't among them, as they're only made
+// from the improper fragment sizes once every part has been merged.
+//
+static const std::vector<std::pair<std::string, unsigned long long int Metrics::*>> partial_state_counters = {
+    {"total_reads", &Metrics::total_reads},
+    {"excluded_region_reads", &Metrics::excluded_region_reads},
+    {"maximum_proper_pair_fragment_size", &Metrics::maximum_proper_pair_fragment_size},
+    {"total_autosomal_reads", &Metrics::total_autosomal_reads},
+    {"total_mitochondrial_reads", &Metrics::total_mitochondrial_reads},
+    {"duplicate_autosomal_reads", &Metrics::duplicate_autosomal_reads},
+    {"duplicate_mitochondrial_reads", &Metrics::duplicate_mitochondrial_reads},
+    {"hqaa", &Metrics::hqaa},
+    {"hqaa_short_count", &Metrics::hqaa_short_count},
+    {"hqaa_mononucleosomal_count", &Metrics::hqaa_mononucleosomal_count}
+};
+
+
+///
+/// Save everything needed to merge these metrics with those collected
+/// from other parts of the alignment file, or other alignment files
+/// from the same library, before finalizing them. The TSS coverage is
+/// the raw count, as scaling can only be done after the merge.
+///
+nlohmann::json Metrics::partial_state() {
+    sum_tss_coverage();
+
+    nlohmann::json counters;
+    for (const auto& counter : partial_state_counters) {
+        counters[counter.first] = this->*counter.second;
+    }
+
+    // the counters are saved sparsely, as are the modules' own
+
+    // the improperly paired reads, which can't be diagnosed until the
+    // maximum proper pair fragment size is known, are only counted;
+    // their names aren't saved, so they can't be logged after a merge,
+    // which is why shards don't log problematic reads
+    std::map<unsigned long long int, unsigned long long int> all_improper_fragment_size_counts(long_improper_fragment_size_counts);
+    for (size_t fragment_size = 0; fragment_size < improper_fragment_size_counts.size(); fragment_size++) {
+        if (improper_fragment_size_counts[fragment_size]) {
+            all_improper_fragment_size_counts[fragment_size] = improper_fragment_size_counts[fragment_size];
+        }
+    }
+
+    std::map<size_t, unsigned long long int> observed_flag_counts;
+    for (size_t key = 0; key < flag_counts.size(); key++) {
+        if (flag_counts[key]) {
+            observed_flag_counts[key] = flag_counts[key];
+        }
+    }
+
+    std::map<size_t, unsigned long long int> observed_counted_flag_counts;
+    for (size_t index = 0; index < counted_flag_counts.size(); index++) {
+        if (counted_flag_counts[index]) {
+            observed_counted_flag_counts[index] = counted_flag_counts[index];
+        }
+    }
+
+    nlohmann::json state = {
+        {"name", name},
+        {"library", library.to_json()},
+        {"peaks_requested", peaks_requested},
+        {"tss_requested", tss_requested},
+        {"counters", counters},
+        {"improper_fragment_size_counts", map_to_pairs(all_improper_fragment_size_counts)},
+        {"flag_counts", map_to_pairs(observed_flag_counts)},
+        {"counted_flag_counts", map_to_pairs(observed_counted_flag_counts)},
+        {"tss_coverage", map_to_pairs(tss_coverage)},
+        {"peaks", peaks.partial_state()}
+    };
+
+    modules.partial_state(*collector, state);
+
+    return state;
+}
+
+
+void Metrics::load_partial_state(const nlohmann::json& state) {
+    library.from_json(state.at("library"));
+    peaks_requested = state.at("peaks_requested").get<bool>();
+    tss_requested = state.at("tss_requested").get<bool>();
+
+    const nlohmann::json& counters = state.at("counters");
+    for (const auto& counter : partial_state_counters) {
+        this->*counter.second = counters.at(counter.first).get<unsigned long long int>();
+    }
+
+    improper_fragment_size_counts.assign(collector->fragment_length_ceiling + 1, 0);
+    long_improper_fragment_size_counts.clear();
+    for (const auto& it : pairs_to_map<unsigned long long int, unsigned long long int>(state.at("improper_fragment_size_counts"))) {
+        add_improper_fragment_size_count(it.first, it.second);
+    }
+
+    flag_counts.assign(FLAG_KEYS, 0);
+    for (const auto& it : pairs_to_map<size_t, unsigned long long int>(state.at("flag_counts"))) {
+        flag_counts.at(it.first) = it.second;
+    }
+
+    counted_flag_counts.assign(COUNTED_FLAG_VALUES, 0);
+    for (const auto& it : pairs_to_map<size_t, unsigned long long int>(state.at("counted_flag_counts"))) {
+        counted_flag_counts.at(it.first) = it.second;
+    }
+
+    modules.load_partial_state(*collector, state);
+
+    tss_coverage = pairs_to_map<int, unsigned long long int>(state.at("tss_coverage"));
+    peaks.load_partial_state(state.at("peaks"));
+}
+
+
 //
 // Produce text version of all of a collector's Metrics
 //
@@ -1552,3 +3225,165 @@ nlohmann::json MetricsCollector::to_json() {
     }
     return result;
 }
+
+
+///
+/// Save the collector's configuration and the unfinished metrics for
+/// each read group, so they can be merged with those from other
+/// shards of the alignment file or other alignment files.
+///
+nlohmann::json MetricsCollector::partial_state() {
+    std::vector<std::string> references;
+    if (autosomal_references.count(organism)) {
+        for (const auto& it : autosomal_references.at(organism)) {
+            references.push_back(it.first);
+        }
+        std::sort(references.begin(), references.end(), sort_strings_numerically);
+    }
+
+    nlohmann::json metrics_state = nlohmann::json::array();
+    for (auto m : metrics) {
+        metrics_state.push_back(m.second->partial_state());
+    }
+
+    return {
+        {"ataqv_version", version_string()},
+        {"alignment_filename", alignment_filename},
+        {"shard_number", shard_number},
+        {"shard_count", shard_count},
+        {"name", name},
+        {"organism", organism},
+        {"description", description},
+        {"url", url},
+        {"autosomal_references", references},
+        {"mitochondrial_reference_name", mitochondrial_reference_name},
+        {"tss_extension", tss_extension},
+        {"tss_count", tss_count},
+        {"less_redundant", less_redundant},
+        {"drop_excluded_reads", drop_excluded_reads},
+        {"metric_modules", metric_modules},
+        {"metrics", metrics_state}
+    };
+}
+
+
+void MetricsCollector::write_partial_state(std::ostream& os) {
+    std::vector<uint8_t> cbor = nlohmann::json::to_cbor(partial_state());
+    os.write(reinterpret_cast<const char*>(cbor.data()), cbor.size());
+}
+
+
+void MetricsCollector::load_partial_state(const std::string& filename, std::map<std::string, std::set<int>>& shards_seen, std::map<std::string, int>& shard_counts) {
+    boost::shared_ptr<boost::iostreams::filtering_istream> partial_file;
+    try {
+        partial_file = mistream(filename);
+    } catch (FileException& e) {
+        throw FileException("Could not open partial metrics file \"" + filename + "\": " + e.what());
+    }
+
+    if (verbose) {
+        std::cout << "Merging partial metrics from " << filename << "." << std::endl;
+    }
+
+    std::vector<uint8_t> cbor((std::istreambuf_iterator<char>(*partial_file)), std::istreambuf_iterator<char>());
+
+    try {
+        nlohmann::json state = nlohmann::json::from_cbor(cbor);
+
+        if (state.at("ataqv_version").get<std::string>() != version_string()) {
+            throw FileException("Partial metrics file \"" + filename + "\" was written by ataqv " + state.at("ataqv_version").get<std::string>() + ", not " + version_string() + ".");
+        }
+
+        std::string source = state.at("alignment_filename").get<std::string>();
+        int source_shard_number = state.at("shard_number").get<int>();
+        int source_shard_count = state.at("shard_count").get<int>();
+
+        if (shards_seen[source].count(source_shard_number)) {
+            throw FileException("Partial metrics file \"" + filename + "\" repeats shard " + std::to_string(source_shard_number) + " of " + source + ".");
+        }
+        if (shard_counts.count(source) && shard_counts[source] != source_shard_count) {
+            throw FileException("Partial metrics file \"" + filename + "\" divides " + source + " into a different number of shards than the others.");
+        }
+        shards_seen[source].insert(source_shard_number);
+        shard_counts[source] = source_shard_count;
+
+        if (shards_seen.size() == 1 && shards_seen[source].size() == 1) {
+            // the first partial state configures the collector
+            alignment_filename = source;
+            name = state.at("name").get<std::string>();
+            organism = state.at("organism").get<std::string>();
+            description = state.at("description").get<std::string>();
+            url = state.at("url").get<std::string>();
+            mitochondrial_reference_name = state.at("mitochondrial_reference_name").get<std::string>();
+            tss_extension = state.at("tss_extension").get<int>();
+            tss_count = state.at("tss_count").get<unsigned long long int>();
+            less_redundant = state.at("less_redundant").get<bool>();
+            drop_excluded_reads = state.at("drop_excluded_reads").get<bool>();
+            metric_modules = state.at("metric_modules").get<std::vector<std::string>>();
+
+            autosomal_references[organism] = {};
+            for (const auto& reference : state.at("autosomal_references")) {
+                autosomal_references[organism][reference.get<std::string>()] = 1;
+            }
+        } else if (organism != state.at("organism").get<std::string>() ||
+                   tss_extension != state.at("tss_extension").get<int>() ||
+                   tss_count != state.at("tss_count").get<unsigned long long int>()) {
+            throw FileException("Partial metrics file \"" + filename + "\" was collected with a different organism or TSS configuration than the others.");
+        } else if (drop_excluded_reads != state.at("drop_excluded_reads").get<bool>()) {
+            throw FileException("Partial metrics file \"" + filename + "\" was collected with a different treatment of reads in excluded regions than the others.");
+        } else if (MetricModules::mask(metric_modules) != MetricModules::mask(state.at("metric_modules").get<std::vector<std::string>>())) {
+            throw FileException("Partial metrics file \"" + filename + "\" was collected with different metric modules than the others.");
+        }
+
+        for (const auto& metrics_state : state.at("metrics")) {
+            std::string metrics_id = metrics_state.at("name").get<std::string>();
+            Metrics* partial = new Metrics(this, metrics_id);
+            partial->load_partial_state(metrics_state);
+
+            auto m = metrics.find(metrics_id);
+            if (m == metrics.end()) {
+                metrics[metrics_id] = partial;
+            } else {
+                try {
+                    m->second->merge(*partial);
+                } catch (std::out_of_range& e) {
+                    delete partial;
+                    throw FileException("Partial metrics for read group " + metrics_id + " in \"" + filename + "\" do not match the others: " + e.what());
+                }
+                delete partial;
+            }
+        }
+    } catch (std::invalid_argument& e) {
+        throw FileException("Could not read partial metrics file \"" + filename + "\": " + e.what());
+    } catch (std::out_of_range& e) {
+        throw FileException("Could not read partial metrics file \"" + filename + "\": " + e.what());
+    } catch (std::domain_error& e) {
+        throw FileException("Could not read partial metrics file \"" + filename + "\": " + e.what());
+    }
+}
+
+
+///
+/// Combine partial metrics files and finish the metrics, just as if
+/// all the alignments had been measured in one run
+///
+void MetricsCollector::merge_partial_states(const std::vector<std::string>& filenames) {
+    std::map<std::string, std::set<int>> shards_seen;
+    std::map<std::string, int> shard_counts;
+
+    if (filenames.empty()) {
+        throw FileException("No partial metrics files have been specified.");
+    }
+
+    for (const auto& filename : filenames) {
+        load_partial_state(filename, shards_seen, shard_counts);
+    }
+
+    for (const auto& it : shard_counts) {
+        if ((int) shards_seen[it.first].size() != it.second) {
+            throw FileException("Only " + std::to_string(shards_seen[it.first].size()) + " of the " + std::to_string(it.second) + " shards of " + it.first + " were supplied.");
+        }
+    }
+
+    finalize_metrics();
+}
@@ -7,10 +7,16 @@
 #ifndef METRICS_HPP
 #define METRICS_HPP
 
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "json.hpp"
@@ -19,13 +25,129 @@
 #include "Features.hpp"
 #include "HTS.hpp"
 #include "IO.hpp"
+#include "MetricModules.hpp"
 #include "Peaks.hpp"
+#include "WorkerPool.hpp"
 
 
 class MetricsCollector;
 class Metrics;
 
 
+//
+// The neighbourhood of a TSS: coverage is recorded over the region
+// around it, by fragments with a read in the wider query window.
+//
+struct TSSWindow {
+    hts_pos_t query_start;  // alignments overlapping [query_start, query_end)
+    hts_pos_t query_end;
+    hts_pos_t region_start;  // coverage of [region_start, region_end]
+    hts_pos_t region_end;
+    bool reverse;
+    unsigned int tss_count;  // TSS sharing the window, counted once each
+};
+
+
+//
+// How a reference in the alignment file's header is treated. The
+// collector keeps one for each tid, built when the header is read, so
+// reads can be classified without looking up their reference names.
+//
+struct ReferenceClassification {
+    std::string name;
+    int reference_id;  // in ReferenceNames
+    bool autosomal;
+    bool mitochondrial;
+};
+
+
+//
+// Works out the flag keys by which reads are counted and classified,
+// and the categories below, for a batch of reads at once. The fields
+// involved are gathered from the records into lanes, which are
+// evaluated with the widest vector instructions the CPU supports.
+//
+class ReadBatchClassifier {
+public:
+    // the read categories, as bits
+    static const uint8_t AUTOSOMAL = 1;
+    static const uint8_t MITOCHONDRIAL = 2;
+    static const uint8_t HQAA = 4;
+
+    enum class Kernel {
+        SCALAR,
+        SSE4,
+        AVX2
+    };
+
+    explicit ReadBatchClassifier(const std::vector<ReferenceClassification>& references, const Kernel kernel = best_kernel());
+
+    void classify(const bam1_t* const* records, const size_t count, uint32_t* flag_keys, uint8_t* categories);
+    Kernel get_kernel() const;
+
+    static Kernel best_kernel();
+    static bool supports(const Kernel kernel);
+    static std::string kernel_name(const Kernel kernel);
+
+    // records gathered into lanes at a time
+    static const size_t LANES = 32;
+
+    struct Lanes {
+        alignas(32) int32_t flags[LANES];
+        alignas(32) int32_t qualities[LANES];
+        alignas(32) int32_t tids[LANES];
+        alignas(32) int32_t mate_tids[LANES];
+        alignas(32) int32_t placed[LANES];  // -1 if both mates are past position zero
+        alignas(32) int32_t isize_signs[LANES];
+        alignas(32) int32_t references[LANES];  // AUTOSOMAL and MITOCHONDRIAL of the read's reference
+    };
+
+private:
+    std::vector<uint8_t> reference_categories = {};
+    Kernel kernel;
+    Lanes lanes;
+};
+
+
+//
+// The names and fragment sizes of improperly paired reads, kept while
+// problematic reads are logged, so each can be logged once the longest
+// proper fragment is known and it can be diagnosed. The names are
+// packed into one buffer, which past a limit is sorted and spilled to
+// a temporary file; the spilled runs are merged back in name order as
+// the reads are drained.
+//
+class ImproperPairLog {
+public:
+    explicit ImproperPairLog(const size_t buffer_limit = 16 << 20);
+
+    void add(const char* name, const unsigned long long int fragment_size);
+    void merge(const ImproperPairLog& other);
+    void drain(const std::function<void(const std::string&, const unsigned long long int)>& visit);
+    size_t size() const;
+    size_t spilled_runs() const;
+
+private:
+    struct Entry {
+        unsigned long long int fragment_size;
+        size_t name;  // offset in names
+    };
+
+    size_t buffer_limit;
+    std::string names = {};
+    std::vector<Entry> entries = {};
+
+    // temporary files of sorted entries, oldest first, each removed
+    // once no log refers to it
+    std::vector<std::shared_ptr<const std::string>> runs = {};
+
+    size_t count = 0;
+
+    std::vector<size_t> sorted_entries() const;
+    void spill();
+};
+
+
 //
 // The MetricsCollector examines a BAM file and optionally, a BED file
 // containing peaks, to collect metrics for each read group found. If
@@ -34,9 +156,88 @@ class Metrics;
 //
 class MetricsCollector {
 private:
+    // HTSlib thread pool for decompressing BGZF blocks while the
+    // alignment file is read in one pass, with its share of the
+    // --threads threads.
+    htsThreadPool thread_pool = {nullptr, 0};
+    int decompression_threads = 1;
+
+    // threads for measuring in parallel, available to any phase
+    std::unique_ptr<WorkerPool> worker_pool = nullptr;
+
+    // A stretch of one reference, or the unplaced reads at the end of
+    // the file, whose alignments can be measured independently of the
+    // rest of the file using the alignment index.
+    struct AlignmentChunk {
+        int tid;
+        hts_pos_t start;
+        hts_pos_t end;
+        unsigned long long int cost;  // estimated from the index
+    };
+
     void make_default_autosomal_references();
     void load_autosomal_references();
     void load_excluded_regions();
+    void create_thread_pool(const int threads);
+    void destroy_thread_pool();
+    void attach_thread_pool(samFile* alignment_file);
+
+    // when measuring one shard of the alignment file, the chunks in it
+    std::vector<AlignmentChunk> shard_chunks = {};
+
+    // TSS windows on each reference in the alignment file, indexed by
+    // target ID and sorted by query start, with the longest window
+    // query on each reference
+    std::vector<std::vector<TSSWindow>> tss_windows = {};
+    std::vector<hts_pos_t> tss_window_spans = {};
+
+    // BGZF blocks decompressed while measuring alignments, counted
+    // when verbose, to show how much of the file is read twice
+    unsigned long long int bgzf_blocks_read = 0;
+    std::unordered_set<int64_t> bgzf_blocks_seen = {};
+
+    // the read groups' Metrics by ordinal, so each record's RG tag
+    // only needs a hash lookup
+    ReadGroupIndex read_groups = {};
+    std::vector<Metrics*> read_group_metrics = {};
+
+    Metrics* add_read_group(const std::string& read_group_id);
+    Metrics* find_record_metrics(const bam1_t* record, const std::string& default_metrics_id, Metrics*& default_metrics, int& read_group);
+    std::vector<AlignmentChunk> make_alignment_chunks(const bam_hdr_t* header, const hts_idx_t* index, const hts_pos_t chunk_count) const;
+    std::vector<AlignmentChunk> make_shard_chunks(const bam_hdr_t* header, const hts_idx_t* index) const;
+    void index_tss(const bam_hdr_t* header);
+    bool find_mate(samFile* alignment_file, const hts_idx_t* alignment_file_index, const bam1_t* record, bam1_t* mate) const;
+    void load_partial_state(const std::string& filename, std::map<std::string, std::set<int>>& shards_seen, std::map<std::string, int>& shard_counts);
+    unsigned long long int load_alignments_in_parallel(const bam_hdr_t* header, const hts_idx_t* index, const std::string& default_metrics_id);
+    unsigned long long int load_alignments_in_batches(samFile* alignment_file, bam_hdr_t* header, const std::string& default_metrics_id);
+    std::string describe_chunk(const bam_hdr_t* header, const AlignmentChunk& chunk) const;
+
+    // What one of the worker pool's threads needs to measure chunks
+    // of the alignment file: its own file handles, and Metrics for
+    // each read group it encounters.
+    struct ChunkReader {
+        samFile* alignment_file = nullptr;
+        bam_hdr_t* alignment_file_header = nullptr;
+        hts_idx_t* alignment_file_index = nullptr;
+        bam1_t* record = nullptr;
+        // a separate handle for fetching the mates of reads near TSS
+        // from preceding chunks, leaving the chunk iterator's place
+        samFile* mate_file = nullptr;
+        bam1_t* mate = nullptr;
+        int64_t last_block = -1;
+        unsigned long long int blocks_read = 0;
+        std::unordered_set<int64_t> blocks_seen = {};
+        // Metrics by the ordinals of this reader's own read group index
+        ReadGroupIndex read_groups = {};
+        std::vector<Metrics*> partial_metrics = {};
+    };
+
+    void open_chunk_reader(ChunkReader& reader);
+    void close_chunk_reader(ChunkReader& reader);
+    unsigned long long int measure_alignment_chunk(const AlignmentChunk& chunk,
+                                                   ChunkReader& reader,
+                                                   std::mutex& metrics_mutex,
+                                                   const std::string& default_metrics_id);
 
 public:
     std::map<std::string, Metrics*, numeric_string_comparator> metrics;
@@ -58,9 +259,14 @@ public:
 
     std::string peak_filename = "auto";
 
+    // the peaks from a single peak file, loaded by the first read
+    // group's Metrics and shared by the rest
+    std::shared_ptr<PeakIndex> peak_index = nullptr;
+
     std::string tss_filename = "";
-    const int tss_extension = 1000;
+    int tss_extension = 1000;
     FeatureTree tss_tree;
+    unsigned long long int tss_count = 0;  // all the TSS loaded, even in a shard that only measures some
 
     bool verbose = false;
     int thread_limit = 1;
@@ -68,8 +274,31 @@ public:
     bool log_problematic_reads = false;
     bool less_redundant = false;
 
+    // whether alignments are measured in coordinate order
+    bool coordinate_sorted = false;
+
+    // measure only shard_number (counting from 1) of shard_count
+    // slices of the alignment file, leaving partial metrics to be
+    // merged with the others'
+    int shard_number = 0;
+    int shard_count = 0;
+
     std::vector<std::string> excluded_region_filenames = {};
-    std::vector<Feature> excluded_regions = {};
+    ExcludedRegionIndex excluded_regions = {};
+
+    // whether reads overlapping excluded regions are dropped, instead
+    // of being measured
+    bool drop_excluded_reads = false;
+
+    // the names of the MetricModules each Metrics measures
+    std::vector<std::string> metric_modules = MetricModules::names();
+
+    // the alignment file's references, by tid; only read once
+    // alignments are being measured, so all threads can share it
+    std::vector<ReferenceClassification> reference_classifications = {};
+
+    // the longest fragment length counted in each Metrics' flat array
+    unsigned long long int fragment_length_ceiling = 1000;
 
     MetricsCollector(const std::string& name = "",
                      const std::string& organism = "human",
@@ -92,12 +321,21 @@ public:
     std::string autosomal_reference_string(std::string separator = ", ") const;
     std::string configuration_string() const;
     bool is_autosomal(const std::string &reference_name);
+    bool is_autosomal(const int tid) const;
     bool is_mitochondrial(const std::string& reference_name);
-    bool is_hqaa(const bam_hdr_t* header, const bam1_t* record);
+    bool is_mitochondrial(const int tid) const;
+    bool is_hqaa(const bam_hdr_t* header, const bam1_t* record) const;
+    uint8_t read_categories(const bam1_t* record) const;
+    void classify_references(const bam_hdr_t* header);
+    int reference_tid(const std::string& reference_name);
+    WorkerPool& get_worker_pool();
     void load_tss();
     void load_alignments();
-    std::map<std::string,std::map<int, unsigned long long int>> get_tss_coverage_for_reference(const std::string &reference, const int extension);
-    void calculate_tss_coverage();
+    void find_tss_windows(const int tid, const hts_pos_t start, const hts_pos_t end, std::vector<const TSSWindow*>& windows) const;
+    void finalize_metrics();
+    nlohmann::json partial_state();
+    void write_partial_state(std::ostream& os);
+    void merge_partial_states(const std::vector<std::string>& filenames);
     nlohmann::json to_json();
 };
 
@@ -121,6 +359,7 @@ public:
     std::string predicted_median_insert_size = "";  // PI
     std::string programs = "";  // PG
 
+    void from_json(const nlohmann::json& json);
     nlohmann::json to_json();
 };
 
@@ -133,6 +372,42 @@ private:
     std::string problematic_read_filename = "";
     boost::shared_ptr<boost::iostreams::filtering_ostream> problematic_read_stream = nullptr;
 
+    // An HQAA read near TSS, waiting for its mate, which will only
+    // cover the TSS windows this read didn't reach.
+    struct TSSMate {
+        int tid;
+        hts_pos_t start;
+        hts_pos_t end;
+        unsigned long long int fragment_length;
+        uint16_t read_flags;
+    };
+
+    // keyed by the reference and position of the mate
+    std::multimap<std::pair<int, hts_pos_t>, TSSMate> tss_mates = {};
+    std::vector<const TSSWindow*> tss_windows = {};
+
+    bool take_tss_mate(const bam1_t* record, TSSMate& mate);
+    void forget_tss_mate(const bam1_t* record);
+
+    // the change in TSS coverage at each base, from which tss_coverage
+    // is summed once the alignments have all been added
+    std::vector<long long int> tss_coverage_changes = {};
+
+    // reads counted by the FLAG bits and the few other fields that
+    // decide how they're classified, and separately by the FLAG bits
+    // that are only counted, from which count_flags derives the
+    // counters of reads with each property
+    std::vector<unsigned long long int> flag_counts = {};
+    std::vector<unsigned long long int> counted_flag_counts = {};
+
+    // add_alignment specialized for the Metrics' options
+    typedef void (Metrics::*AlignmentMeasurer)(const bam_hdr_t* header, const bam1_t* record, const size_t flag_key, const uint8_t categories);
+    AlignmentMeasurer alignment_measurer = nullptr;
+
+    template <bool LogProblematicReads, bool MeasurePeaks, bool MeasureTSS, bool DropExcludedReads>
+    void measure_alignment(const bam_hdr_t* header, const bam1_t* record, const size_t flag_key, const uint8_t categories);
+    void select_alignment_measurer();
+
     void log_problematic_read(const std::string& problem, const std::string& record = "");
     void open_problematic_read_stream();
 
@@ -144,6 +419,7 @@ public:
     PeakTree peaks;
 
     unsigned long long int total_reads = 0;
+    unsigned long long int excluded_region_reads = 0;  // dropped, and not counted in total_reads
     unsigned long long int forward_reads = 0;
     unsigned long long int reverse_reads = 0;
     unsigned long long int secondary_reads = 0;
@@ -175,7 +451,14 @@ public:
     unsigned long long int maximum_proper_pair_fragment_size = 0;
     unsigned long long int reads_with_mate_too_distant = 0;
 
-    std::map<std::string, std::vector<unsigned long long int>> unlikely_fragment_sizes = {};
+    // the fragment sizes of improperly paired reads, which can't be
+    // diagnosed until maximum_proper_pair_fragment_size is known,
+    // counted like HQAA fragment lengths below
+    std::vector<unsigned long long int> improper_fragment_size_counts = {};
+    std::map<unsigned long long int, unsigned long long int> long_improper_fragment_size_counts = {};
+
+    // the improperly paired reads themselves, only kept to be logged
+    ImproperPairLog improper_pairs;
 
     unsigned long long int total_autosomal_reads = 0;
     unsigned long long int total_mitochondrial_reads = 0;
@@ -184,14 +467,11 @@ public:
 
     unsigned long long int hqaa = 0;  // primary, properly paired and mapped to autosomal references
 
-    std::map<int, unsigned long long int> fragment_length_counts = {};
-
-    std::map<std::string, unsigned long long int> chromosome_counts = {};
-
     unsigned long long int hqaa_short_count = 0;
     unsigned long long int hqaa_mononucleosomal_count = 0;
 
-    std::map<int, unsigned long long int> mapq_counts = {};
+    // the optional measurements enabled in the collector's metric_modules
+    MetricModules modules;
 
     std::map<int, unsigned long long int> tss_coverage = {};
     std::map<int, double> tss_coverage_scaled = {};
@@ -201,28 +481,38 @@ public:
     bool peaks_requested = false;
     bool tss_requested = false;
     bool less_redundant = false;
+    bool drop_excluded_reads = false;
 
     Metrics(MetricsCollector* collector, const std::string& name = nullptr);
 
     void add_alignment(const bam_hdr_t* header, const bam1_t* record);
+    void add_alignment(const bam_hdr_t* header, const bam1_t* record, const size_t flag_key, const uint8_t categories);
+    void merge(const Metrics& other);
     std::string configuration_string() const;
-    void add_tss_coverage(const Feature& fragment);
+    void add_tss_coverage(const bam1_t* record);
+    void add_tss_mate(const bam_hdr_t* header, const bam1_t* mate);
+    void sum_tss_coverage();
     void calculate_tss_metrics();
     std::map<int, unsigned long long int> calculate_tss_metric_for_reference(const std::string &reference, const int extension, FeatureTree &fragment_tree);
 
     bool is_autosomal(const std::string &reference_name);
+    bool is_autosomal(const int tid) const;
     bool is_mitochondrial(const std::string& reference_name);
-    bool is_ff(const bam1_t* record);
-    bool is_fr(const bam1_t* record);
-    bool is_rf(const bam1_t* record);
-    bool is_rr(const bam1_t* record);
-    bool is_hqaa(const bam_hdr_t* header, const bam1_t* record);
+    bool is_mitochondrial(const int tid) const;
+    static bool is_ff(const bam1_t* record);
+    static bool is_fr(const bam1_t* record);
+    static bool is_rf(const bam1_t* record);
+    static bool is_rr(const bam1_t* record);
+    bool is_hqaa(const bam_hdr_t* header, const bam1_t* record) const;
     void load_peaks();
+    void count_flags();
     void make_aggregate_diagnoses();
     std::string make_metrics_filename(const std::string& suffix);
     bool mapq_at_least(const int& mapq, const bam1_t* record);
-    double mean_mapq() const;
-    double median_mapq() const;
+    void add_improper_fragment_size_count(const unsigned long long int fragment_size, const unsigned long long int count);
+    unsigned long long int improper_fragment_sizes_up_to(const unsigned long long int fragment_size) const;
+    nlohmann::json partial_state();
+    void load_partial_state(const nlohmann::json& state);
     nlohmann::json to_json();
 };
 
@@ -5,8 +5,10 @@
 //
 
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 
 #include <boost/chrono.hpp>
 
@@ -15,7 +17,7 @@
 
 bool operator== (const Peak& p1, const Peak& p2) {
     return (
-        p1.reference == p2.reference &&
+        p1.reference_id == p2.reference_id &&
         p1.start == p2.start &&
         p1.end == p2.end &&
         p1.name == p2.name &&
@@ -25,8 +27,8 @@ bool operator== (const Peak& p1, const Peak& p2) {
 
 
 bool operator< (const Peak& p1, const Peak& p2) {
-    return sort_strings_numerically(p1.reference, p2.reference) ||
-        (p1.reference == p2.reference &&
+    return ReferenceNames::precedes(p1.reference_id, p2.reference_id) ||
+        (p1.reference_id == p2.reference_id &&
          (p1.start < p2.start ||
           (p1.start == p2.start &&
            (p1.end < p2.end ||
@@ -48,6 +50,7 @@ std::istream& operator>>(std::istream& is, Peak& peak) {
     std::getline(is, peak_string);
     peak_stream.str(peak_string);
     peak_stream >> peak.reference >> peak.start >> peak.end >> peak.name >> peak.score >> peak.strand;
+    peak.reference_id = ReferenceNames::id(peak.reference);
     peak.overlapping_hqaa = 0;
     return is;
 }
@@ -63,8 +66,8 @@ bool peak_size_descending_comparator(const Peak& p1, const Peak& p2) {
 }
 
 
-void ReferencePeakCollection::add(const Peak& peak) {
-    peaks.push_back(peak);
+void ReferencePeakCollection::append(const Peak& peak) {
+    peaks.push_back(Interval(peak, names));
 
     if (reference != peak.reference) {
         if (reference.empty()) {
@@ -73,6 +76,7 @@ void ReferencePeakCollection::add(const Peak& peak) {
             throw std::out_of_range("Peak reference does not match collection.");
         }
     }
+    reference_id = peak.reference_id;
 
     if (start == 0 || start > peak.start) {
         start = peak.start;
@@ -81,68 +85,453 @@ void ReferencePeakCollection::add(const Peak& peak) {
     if (end == 0 || end < peak.end) {
         end = peak.end;
     }
-
-    sort();
 }
 
 
-bool ReferencePeakCollection::overlaps(const Feature& feature) const {
+bool ReferencePeakCollection::overlaps(const Interval& interval) const {
     return !peaks.empty() &&
-        reference == feature.reference && (
+        reference_id == interval.reference_id && (
             (
-                (start <= feature.start && feature.start <= end) ||
-                (start <= feature.end && feature.end <= end)
+                (start <= interval.start && interval.start <= end) ||
+                (start <= interval.end && interval.end <= end)
             ) ||
             (
-                (feature.start <= start && start <= feature.end) ||
-                (feature.start <= end && end <= feature.end)
+                (interval.start <= start && start <= interval.end) ||
+                (interval.start <= end && end <= interval.end)
             )
         );
 }
 
 
-void ReferencePeakCollection::sort() {
-    std::sort(peaks.begin(), peaks.end());
+bool ReferencePeakCollection::overlaps(const Feature& feature) const {
+    return overlaps(Interval(feature));
+}
+
+
+//
+// Sort the peaks by position, then name, as Peak's operator< would
+// apart from their counts, which aren't kept here, and note whether
+// their ends ascend too. Returns the order the peaks were taken in,
+// so their counts can follow them.
+//
+std::vector<size_t> ReferencePeakCollection::sort() {
+    std::vector<size_t> order(peaks.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [this](size_t i1, size_t i2) {
+        const Interval& p1 = peaks[i1];
+        const Interval& p2 = peaks[i2];
+        return p1.start < p2.start ||
+            (p1.start == p2.start &&
+             (p1.end < p2.end ||
+              (p1.end == p2.end && sort_strings_numerically(names.get(p1.name), names.get(p2.name)))));
+    });
+
+    std::vector<Interval> sorted_peaks;
+    sorted_peaks.reserve(peaks.size());
+    for (size_t i : order) {
+        sorted_peaks.push_back(peaks[i]);
+    }
+    peaks.swap(sorted_peaks);
+
+    ends_ascending = true;
+    for (size_t i = 1; i < peaks.size(); i++) {
+        if (peaks[i].end < peaks[i - 1].end) {
+            ends_ascending = false;
+            break;
+        }
+    }
+
+    return order;
+}
+
+
+Peak ReferencePeakCollection::get_peak(size_t i, unsigned long long int overlapping_hqaa) const {
+    const Interval& interval = peaks.at(i);
+    Peak peak(reference, interval.start, interval.end, names.get(interval.name));
+    peak.overlapping_hqaa = overlapping_hqaa;
+    return peak;
+}
+
+
+ReferencePeakCollection* PeakIndex::get_reference_peaks(const std::string& reference_name) {
+    size_t reference_id = ReferenceNames::id(reference_name);
+    if (reference_id >= collections.size()) {
+        collections.resize(reference_id + 1);
+    }
+    return &collections[reference_id];
+}
+
+
+std::vector<unsigned long long int> PeakIndex::sort_sizes_descending() const {
+    std::vector<unsigned long long int> sizes;
+    sizes.reserve(peak_count);
+    for (const auto& rpc : collections) {
+        for (const auto& peak : rpc.peaks) {
+            sizes.push_back(peak.size());
+        }
+    }
+    std::sort(sizes.begin(), sizes.end(), std::greater<unsigned long long int>());
+    return sizes;
+}
+
+
+//
+// The IDs of the references with peaks, in natural order.
+//
+std::vector<int> PeakIndex::reference_ids() const {
+    std::vector<int> reference_ids;
+    for (size_t reference_id = 0; reference_id < collections.size(); reference_id++) {
+        if (!collections[reference_id].peaks.empty()) {
+            reference_ids.push_back(reference_id);
+        }
+    }
+    std::sort(reference_ids.begin(), reference_ids.end(), reference_order());
+    return reference_ids;
 }
 
 
+PeakTree::PeakTree() : index(std::make_shared<PeakIndex>()) {}
+
+
+//
+// A tree counting alignments over the peaks of an index that's
+// already been built, e.g. by another read group's tree.
+//
+PeakTree::PeakTree(const std::shared_ptr<PeakIndex>& index) :
+    index(index),
+    overlapping_hqaa(index->peak_count, 0),
+    cursors(index->collections.size()),
+    total_peak_territory(index->total_peak_territory) {}
+
+
+//
+// Add a peak, and lay out the index again so the tree can be searched
+// right away. That makes loading a whole file quadratic, so append and
+// build should be used for that.
+//
 void PeakTree::add(Peak& peak) {
-    tree[peak.reference].add(peak);
+    append(peak);
+    lay_out();
+}
+
+
+//
+// Add a peak without laying out the index, for loading a peak file.
+// The tree can't be searched until build is called.
+//
+void PeakTree::append(Peak& peak) {
+    ReferencePeakCollection* rpc = append_peak(peak);
+
+    if ((size_t) rpc->reference_id >= appended_hqaa.size()) {
+        appended_hqaa.resize(rpc->reference_id + 1);
+    }
+    appended_hqaa[rpc->reference_id].push_back(peak.overlapping_hqaa);
+
     total_peak_territory += peak.size();
+    index->total_peak_territory += peak.size();
+}
+
+
+ReferencePeakCollection* PeakTree::append_peak(const Peak& peak) {
+    if (index->built) {
+        throw std::logic_error("Cannot add peaks to a tree that has been built.");
+    }
+
+    // until it's built, a copy of the tree gets its own index
+    if (index.use_count() > 1) {
+        index = std::make_shared<PeakIndex>(*index);
+    }
+
+    ReferencePeakCollection* rpc = index->get_reference_peaks(peak.reference);
+    rpc->append(peak);
+    index->peak_count++;
+    return rpc;
+}
+
+
+//
+// Sort each reference's newly appended peaks into place, and lay their
+// counts out in the same order, each reference's after the last's.
+//
+void PeakTree::lay_out() {
+    if (index.use_count() > 1) {
+        index = std::make_shared<PeakIndex>(*index);
+    }
+
+    std::vector<unsigned long long int> counts;
+    counts.reserve(index->peak_count);
+
+    for (size_t reference_id = 0; reference_id < index->collections.size(); reference_id++) {
+        ReferencePeakCollection& rpc = index->collections[reference_id];
+
+        // the counts of the peaks already laid out, then those appended
+        std::vector<unsigned long long int> reference_counts;
+        reference_counts.reserve(rpc.peaks.size());
+        std::vector<unsigned long long int> appended;
+        if (reference_id < appended_hqaa.size()) {
+            appended.swap(appended_hqaa[reference_id]);
+        }
+        size_t laid_out = rpc.peaks.size() - appended.size();
+        reference_counts.insert(reference_counts.end(), overlapping_hqaa.begin() + rpc.first, overlapping_hqaa.begin() + rpc.first + laid_out);
+        reference_counts.insert(reference_counts.end(), appended.begin(), appended.end());
+
+        rpc.first = counts.size();
+        if (appended.empty()) {
+            counts.insert(counts.end(), reference_counts.begin(), reference_counts.end());
+        } else {
+            for (size_t i : rpc.sort()) {
+                counts.push_back(reference_counts[i]);
+            }
+        }
+    }
+
+    overlapping_hqaa.swap(counts);
+    appended_hqaa.clear();
+    cursors.assign(index->collections.size(), SweepCursor());
+}
+
+
+//
+// Lay out the appended peaks, once, and freeze the index, so that it
+// can be shared by every read group's tree, and by their copies for
+// each chunk of alignments measured in parallel.
+//
+void PeakTree::build() {
+    if (index->built) {
+        return;
+    }
+
+    lay_out();
+    for (auto& rpc : index->collections) {
+        rpc.peaks.shrink_to_fit();
+        rpc.names.shrink_to_fit();
+    }
+    index->sizes_descending = index->sort_sizes_descending();
+    index->built = true;
+}
+
+
+const std::shared_ptr<PeakIndex>& PeakTree::get_index() const {
+    return index;
 }
 
 
 bool PeakTree::empty() {
-    return tree.empty();
+    return index->collections.empty();
 }
 
 
-ReferencePeakCollection* PeakTree::get_reference_peaks(const std::string& reference_name){
-    return &tree[reference_name];
+//
+// Add the alignment counts from another tree with the same peaks,
+// e.g. one that measured a different part of the genome.
+//
+void PeakTree::merge(const PeakTree& other) {
+    if (other.index == index) {
+        for (size_t i = 0; i < overlapping_hqaa.size(); i++) {
+            overlapping_hqaa[i] += other.overlapping_hqaa[i];
+        }
+    } else {
+        for (int reference_id : other.index->reference_ids()) {
+            const ReferencePeakCollection& other_rpc = other.index->collections[reference_id];
+            const ReferencePeakCollection* rpc = get_reference_peaks(other_rpc.reference);
+            if (rpc == nullptr || rpc->peaks.size() != other_rpc.peaks.size()) {
+                throw std::out_of_range("Cannot merge peaks on " + other_rpc.reference + ": the trees hold different peaks.");
+            }
+
+            for (size_t i = 0; i < rpc->peaks.size(); i++) {
+                overlapping_hqaa[rpc->first + i] += other.overlapping_hqaa[other_rpc.first + i];
+            }
+        }
+    }
+
+    duplicates_in_peaks += other.duplicates_in_peaks;
+    duplicates_not_in_peaks += other.duplicates_not_in_peaks;
+    ppm_in_peaks += other.ppm_in_peaks;
+    ppm_not_in_peaks += other.ppm_not_in_peaks;
+    hqaa_in_peaks += other.hqaa_in_peaks;
+}
+
+
+const ReferencePeakCollection* PeakTree::get_reference_peaks(const std::string& reference_name) const {
+    size_t reference_id = ReferenceNames::id(reference_name);
+    if (reference_id >= index->collections.size() || index->collections[reference_id].peaks.empty()) {
+        return nullptr;
+    }
+    return &index->collections[reference_id];
 }
 
 
 void PeakTree::record_alignment(const Feature& alignment, bool is_hqaa, bool is_duplicate) {
+    record_alignment(Interval(alignment), is_hqaa, is_duplicate);
+}
+
+
+void PeakTree::record_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate) {
+    bool alignment_overlaps_peak = false;
+
+    // the alignment's reference was interned before it was measured,
+    // so there's no need to look it up, or lock the registry
+    size_t reference_id = alignment.reference_id;
+    if (reference_id < index->collections.size() && index->collections[reference_id].overlaps(alignment)) {
+        const ReferencePeakCollection& rpc = index->collections[reference_id];
+        size_t peak = std::lower_bound(rpc.peaks.begin(), rpc.peaks.end(), alignment, interval_overlap_comparator) - rpc.peaks.begin();
+        alignment_overlaps_peak = count_overlaps(rpc, peak, alignment, is_hqaa);
+    }
+
+    count_alignment(alignment_overlaps_peak, is_duplicate);
+}
+
+
+//
+// Record an alignment read from a coordinate-sorted file. The tree
+// keeps a cursor for each reference, at the first peak that could
+// overlap the last alignment, which only has to move forward as the
+// alignments do, so most alignments cost a comparison or two instead
+// of a binary search. An alignment that goes backwards, like the first
+// of a chunk measured in parallel, just repositions the cursor with a
+// search.
+//
+void PeakTree::record_sorted_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate) {
+    bool alignment_overlaps_peak = false;
+
+    size_t reference_id = alignment.reference_id;
+    if (reference_id < index->collections.size() && index->collections[reference_id].overlaps(alignment)) {
+        const ReferencePeakCollection& rpc = index->collections[reference_id];
+        if (!rpc.ends_ascending) {
+            record_alignment(alignment, is_hqaa, is_duplicate);
+            return;
+        }
+
+        SweepCursor& cursor = cursors[reference_id];
+        auto peaks = rpc.peaks.begin();
+        size_t peak_count = rpc.peaks.size();
+        if (alignment.start < cursor.start) {
+            cursor.peak = std::lower_bound(peaks, rpc.peaks.end(), alignment, interval_overlap_comparator) - peaks;
+        } else {
+            // gallop ahead, doubling the stride, in case the alignments
+            // are sparse compared to the peaks, then search back within
+            // the last stride
+            size_t low = cursor.peak;
+            size_t high = low;
+            for (size_t stride = 1; high < peak_count && peaks[high].end < alignment.start; stride *= 2) {
+                low = high + 1;
+                high += stride;
+            }
+            cursor.peak = std::lower_bound(peaks + low, peaks + std::min(high, peak_count), alignment, interval_overlap_comparator) - peaks;
+        }
+        cursor.start = alignment.start;
+
+        alignment_overlaps_peak = count_overlaps(rpc, cursor.peak, alignment, is_hqaa);
+    }
+
+    count_alignment(alignment_overlaps_peak, is_duplicate);
+}
+
+
+//
+// Record an alignment from a file that isn't coordinate-sorted. Each
+// search for its peaks would likely miss the cache, so instead the
+// alignment is queued, and every batch of them is sorted and swept
+// through the peaks at once. The counts aren't complete until
+// record_queued_alignments has been called for the last batch.
+//
+void PeakTree::queue_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate) {
+    if (queued_alignments.empty()) {
+        queued_alignments.reserve(alignment_batch_size);
+    }
+
+    queued_alignments.push_back({alignment, is_hqaa, is_duplicate});
+
+    if (queued_alignments.size() >= alignment_batch_size) {
+        record_queued_alignments();
+    }
+}
+
+
+//
+// Sort queued alignments by reference and start, a byte at a time,
+// from the least significant. Positions in a batch are effectively
+// random, so a comparison sort would mispredict a branch on most of
+// its comparisons; this costs a few passes over the batch instead, and
+// skips the bytes every alignment shares.
+//
+static void sort_queued_alignments(std::vector<QueuedAlignment>& alignments, std::vector<QueuedAlignment>& scratch) {
+    scratch.resize(alignments.size());
+
+    for (int byte = 0; byte < 8; byte++) {
+        int shift = 8 * (byte % 4);
+        auto digit = [byte, shift](const QueuedAlignment& queued) {
+            uint32_t key = byte < 4 ? queued.alignment.start : (uint32_t) queued.alignment.reference_id;
+            return (key >> shift) & 0xff;
+        };
+
+        size_t counts[256] = {};
+        for (const QueuedAlignment& queued : alignments) {
+            counts[digit(queued)]++;
+        }
+
+        if (counts[digit(alignments.front())] == alignments.size()) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (size_t& count : counts) {
+            size_t bucket_size = count;
+            count = offset;
+            offset += bucket_size;
+        }
+
+        for (const QueuedAlignment& queued : alignments) {
+            scratch[counts[digit(queued)]++] = queued;
+        }
+        alignments.swap(scratch);
+    }
+}
+
+
+void PeakTree::record_queued_alignments() {
+    if (queued_alignments.empty()) {
+        return;
+    }
+
+    sort_queued_alignments(queued_alignments, sorted_alignments);
+
+    for (const QueuedAlignment& queued : queued_alignments) {
+        record_sorted_alignment(queued.alignment, queued.is_hqaa, queued.is_duplicate);
+    }
+
+    queued_alignments.clear();
+}
+
+
+//
+// Credit the peaks overlapping an alignment, starting from the first
+// that can, and stopping at the first that doesn't.
+//
+bool PeakTree::count_overlaps(const ReferencePeakCollection& rpc, size_t peak, const Interval& alignment, bool is_hqaa) {
     bool alignment_overlaps_peak = false;
-    ReferencePeakCollection* rpc = get_reference_peaks(alignment.reference);
-    if (rpc->overlaps(alignment)) {
-        auto peak = std::lower_bound(rpc->peaks.begin(), rpc->peaks.end(), alignment, feature_overlap_comparator);
-        auto end = std::upper_bound(peak, rpc->peaks.end(), alignment, feature_overlap_comparator);
-
-        for (; peak != end; peak++) {
-            if (peak->overlaps(alignment)) {
-                alignment_overlaps_peak = true;
-
-                if (is_hqaa) {
-                    peak->overlapping_hqaa++;
-                    hqaa_in_peaks++;
-                }
-            } else {
-                break;
+
+    for (; peak < rpc.peaks.size() && !(alignment.end < rpc.peaks[peak].start); peak++) {
+        if (rpc.peaks[peak].overlaps(alignment)) {
+            alignment_overlaps_peak = true;
+
+            if (is_hqaa) {
+                overlapping_hqaa[rpc.first + peak]++;
+                hqaa_in_peaks++;
             }
+        } else {
+            break;
         }
     }
 
+    return alignment_overlaps_peak;
+}
+
+
+void PeakTree::count_alignment(bool alignment_overlaps_peak, bool is_duplicate) {
     if (alignment_overlaps_peak) {
         ppm_in_peaks++;
         if (is_duplicate) {
@@ -157,12 +546,15 @@ void PeakTree::record_alignment(const Feature& alignment, bool is_hqaa, bool is_
 }
 
 
+const size_t PeakTree::alignment_batch_size;
+
+
 void PeakTree::determine_top_peaks() {
     unsigned long long int count = 0;
     unsigned long long int cumulative_hqaa_in_peaks = 0;
-    for (auto peak: list_peaks_by_overlapping_hqaa_descending()) {
+    for (auto overlapping_hqaa : overlapping_hqaa_descending(10000)) {
         count++;
-        cumulative_hqaa_in_peaks += peak.overlapping_hqaa;
+        cumulative_hqaa_in_peaks += overlapping_hqaa;
         if (count == 1) {
             top_peak_hqaa_read_count = cumulative_hqaa_in_peaks;
         }
@@ -182,62 +574,188 @@ void PeakTree::determine_top_peaks() {
         if (count <= 10000) {
             top_10000_peak_hqaa_read_count = cumulative_hqaa_in_peaks;
         }
-
-        if (count > 10000) {
-            break;
-        }
     }
 }
 
 
-std::vector<Peak> PeakTree::list_peaks() {
+//
+// Every peak, with its count.
+//
+std::vector<Peak> PeakTree::unpack_peaks() const {
     std::vector<Peak> peaks;
-    for (auto ref_peaks : tree) {
-        for (auto peak: ref_peaks.second.peaks) {
-            peaks.push_back(peak);
+    peaks.reserve(index->peak_count);
+    for (int reference_id : index->reference_ids()) {
+        const ReferencePeakCollection& rpc = index->collections[reference_id];
+        for (size_t i = 0; i < rpc.peaks.size(); i++) {
+            peaks.push_back(rpc.get_peak(i, overlapping_hqaa[rpc.first + i]));
         }
     }
+    return peaks;
+}
+
+
+std::vector<Peak> PeakTree::list_peaks() {
+    std::vector<Peak> peaks = unpack_peaks();
     std::sort(peaks.begin(), peaks.end());
     return peaks;
 }
 
 
 std::vector<Peak> PeakTree::list_peaks_by_overlapping_hqaa_descending() {
-    std::vector<Peak> peaks;
-    for (auto ref_peaks : tree) {
-        for (auto peak: ref_peaks.second.peaks) {
-            peaks.push_back(peak);
-        }
-    }
+    std::vector<Peak> peaks = unpack_peaks();
     std::sort(peaks.begin(), peaks.end(), peak_overlapping_hqaa_descending_comparator);
     return peaks;
 }
 
 
 std::vector<Peak> PeakTree::list_peaks_by_size_descending() {
-    std::vector<Peak> peaks;
-    for (auto ref_peaks : tree) {
-        for (auto peak: ref_peaks.second.peaks) {
-            peaks.push_back(peak);
-        }
-    }
+    std::vector<Peak> peaks = unpack_peaks();
     std::sort(peaks.begin(), peaks.end(), peak_size_descending_comparator);
     return peaks;
 }
 
 
+//
+// Visit each peak's name, count and size, in the order list_peaks
+// would return them, without unpacking any of them. The index is
+// already in that order, except where peaks at the same position need
+// ordering by count.
+//
+void PeakTree::visit_peaks(const std::function<void(const char* name, unsigned long long int overlapping_hqaa, unsigned long long int size)>& visitor) const {
+    std::vector<size_t> tied;
+    for (int reference_id : index->reference_ids()) {
+        const ReferencePeakCollection& rpc = index->collections[reference_id];
+        for (size_t i = 0; i < rpc.peaks.size();) {
+            size_t tie_end = i + 1;
+            while (tie_end < rpc.peaks.size() && rpc.peaks[tie_end].start == rpc.peaks[i].start && rpc.peaks[tie_end].end == rpc.peaks[i].end) {
+                tie_end++;
+            }
+
+            tied.clear();
+            for (size_t tie = i; tie < tie_end; tie++) {
+                tied.push_back(tie);
+            }
+            if (tied.size() > 1) {
+                std::stable_sort(tied.begin(), tied.end(), [this, &rpc](size_t p1, size_t p2) {
+                    return overlapping_hqaa[rpc.first + p1] < overlapping_hqaa[rpc.first + p2];
+                });
+            }
+
+            for (size_t peak : tied) {
+                visitor(rpc.names.get(rpc.peaks[peak].name), overlapping_hqaa[rpc.first + peak], rpc.peaks[peak].size());
+            }
+
+            i = tie_end;
+        }
+    }
+}
+
+
+//
+// The largest limit peak counts, largest first, selected from a copy
+// of the counts rather than sorting all of them.
+//
+std::vector<unsigned long long int> PeakTree::overlapping_hqaa_descending(size_t limit) const {
+    std::vector<unsigned long long int> counts(overlapping_hqaa);
+    limit = std::min(limit, counts.size());
+    std::partial_sort(counts.begin(), counts.begin() + limit, counts.end(), std::greater<unsigned long long int>());
+    counts.resize(limit);
+    return counts;
+}
+
+
+//
+// Every peak's size, largest first. The sizes don't depend on the
+// alignments, so a built index sorts them once for all its trees.
+//
+std::vector<unsigned long long int> PeakTree::sizes_descending() const {
+    return index->built ? index->sizes_descending : index->sort_sizes_descending();
+}
+
+
 void PeakTree::print_reference_peak_counts(std::ostream* os) {
     std::ostream out(os ? os->rdbuf() : std::cout.rdbuf());
-    for (auto refpeaks : tree) {
-        out << refpeaks.first << " peak count: " << refpeaks.second.peaks.size() << std::endl;
+    for (int reference_id : index->reference_ids()) {
+        out << index->collections[reference_id].reference << " peak count: " << index->collections[reference_id].peaks.size() << std::endl;
     }
 }
 
 
 size_t PeakTree::size() const {
-    size_t size = 0;
-    for (auto refpeaks : tree) {
-        size += refpeaks.second.peaks.size();
+    return index->peak_count;
+}
+
+
+//
+// Everything needed to merge this tree with others measuring the same
+// peaks in other parts of an alignment file: the peaks themselves, in
+// index order, with their alignment counts.
+//
+nlohmann::json PeakTree::partial_state() const {
+    nlohmann::json references = nlohmann::json::array();
+
+    for (int reference_id : index->reference_ids()) {
+        const ReferencePeakCollection& rpc = index->collections[reference_id];
+
+        std::vector<unsigned long long int> starts;
+        std::vector<unsigned long long int> ends;
+        std::vector<std::string> names;
+        std::vector<unsigned long long int> counts;
+
+        for (size_t i = 0; i < rpc.peaks.size(); i++) {
+            starts.push_back(rpc.peaks[i].start);
+            ends.push_back(rpc.peaks[i].end);
+            names.push_back(rpc.names.get(rpc.peaks[i].name));
+            counts.push_back(overlapping_hqaa[rpc.first + i]);
+        }
+
+        references.push_back({
+            {"reference", rpc.reference},
+            {"starts", starts},
+            {"ends", ends},
+            {"names", names},
+            {"overlapping_hqaa", counts}
+        });
+    }
+
+    return {
+        {"references", references},
+        {"total_peak_territory", total_peak_territory},
+        {"duplicates_in_peaks", duplicates_in_peaks},
+        {"duplicates_not_in_peaks", duplicates_not_in_peaks},
+        {"ppm_in_peaks", ppm_in_peaks},
+        {"ppm_not_in_peaks", ppm_not_in_peaks},
+        {"hqaa_in_peaks", hqaa_in_peaks}
+    };
+}
+
+
+//
+// Replace the tree with one saved by partial_state. The peaks were
+// saved in index order, so building the new index leaves them there.
+//
+void PeakTree::load_partial_state(const nlohmann::json& state) {
+    *this = PeakTree();
+
+    for (const auto& refpeaks : state.at("references")) {
+        std::string reference = refpeaks.at("reference").get<std::string>();
+        const nlohmann::json& starts = refpeaks.at("starts");
+        const nlohmann::json& ends = refpeaks.at("ends");
+        const nlohmann::json& names = refpeaks.at("names");
+        const nlohmann::json& counts = refpeaks.at("overlapping_hqaa");
+
+        for (size_t i = 0; i < starts.size(); i++) {
+            Peak peak(reference, starts.at(i).get<unsigned long long int>(), ends.at(i).get<unsigned long long int>(), names.at(i).get<std::string>());
+            peak.overlapping_hqaa = counts.at(i).get<unsigned long long int>();
+            append(peak);
+        }
     }
-    return size;
+    build();
+
+    total_peak_territory = state.at("total_peak_territory").get<unsigned long long int>();
+    duplicates_in_peaks = state.at("duplicates_in_peaks").get<unsigned long long int>();
+    duplicates_not_in_peaks = state.at("duplicates_not_in_peaks").get<unsigned long long int>();
+    ppm_in_peaks = state.at("ppm_in_peaks").get<unsigned long long int>();
+    ppm_not_in_peaks = state.at("ppm_not_in_peaks").get<unsigned long long int>();
+    hqaa_in_peaks = state.at("hqaa_in_peaks").get<unsigned long long int>();
 }
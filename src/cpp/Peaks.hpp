@@ -7,8 +7,13 @@
 #ifndef PEAKS_HPP
 #define PEAKS_HPP
 
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "json.hpp"
 
 #include "Features.hpp"
 #include "Utils.hpp"
@@ -26,25 +31,106 @@ std::ostream& operator<<(std::ostream& os, const Peak& peak);
 std::istream& operator>>(std::istream& is, Peak& peak);
 bool peak_overlapping_hqaa_descending_comparator(const Peak& p1, const Peak& p2);
 
+
+//
+// One reference's peaks, packed and sorted by position, then name.
+// Their alignment counts are kept apart, by each PeakTree using the
+// index, in arrays where this reference's counts begin at first.
+//
 class ReferencePeakCollection {
 public:
     std::string reference = "";
-    std::vector<Peak> peaks = {};
+    int reference_id = -1;
+    NamePool names = {};
+    std::vector<Interval> peaks = {};
+    size_t first = 0;
 
     unsigned long long int start = 0;
     unsigned long long int end = 0;
 
-    void add(const Peak& peak);
+    // whether the peaks' ends ascend with their starts, so that a
+    // cursor can sweep through them
+    bool ends_ascending = true;
+
+    void append(const Peak& peak);
+    bool overlaps(const Interval& interval) const;
     bool overlaps(const Feature& feature) const;
-    void sort();
+    std::vector<size_t> sort();
+    Peak get_peak(size_t i, unsigned long long int overlapping_hqaa) const;
+};
+
+
+//
+// The geometry of a set of peaks: each reference's collection, by
+// reference ID. Once built, it's never changed, so the PeakTree of
+// every read group measured against the same peak file can share it.
+//
+class PeakIndex {
+public:
+    std::vector<ReferencePeakCollection> collections = {};
+    size_t peak_count = 0;
+    unsigned long long int total_peak_territory = 0;
+    bool built = false;
+
+    // every peak's size, largest first, sorted once when built
+    std::vector<unsigned long long int> sizes_descending = {};
+
+    std::vector<unsigned long long int> sort_sizes_descending() const;
+
+    ReferencePeakCollection* get_reference_peaks(const std::string& reference_name);
+    std::vector<int> reference_ids() const;
 };
 
 
+//
+// An alignment waiting, with a batch of others, to be checked for
+// peak overlap.
+//
+struct QueuedAlignment {
+    Interval alignment;
+    bool is_hqaa;
+    bool is_duplicate;
+};
+
+
+//
+// A set of peaks, with the counts of the alignments overlapping them.
+// The peaks' geometry is in a PeakIndex, which copies of the tree
+// share; each tree has its own counts.
+//
 class PeakTree {
 private:
-    std::map<std::string, ReferencePeakCollection, numeric_string_comparator> tree = {};
+    std::shared_ptr<PeakIndex> index;
+
+    // alignment counts, in index order
+    std::vector<unsigned long long int> overlapping_hqaa = {};
+
+    // counts for the peaks appended to each reference since the index
+    // was last laid out, by reference ID
+    std::vector<std::vector<unsigned long long int>> appended_hqaa = {};
+
+    // For alignments arriving in coordinate order, by reference ID:
+    // the first peak that could overlap the last alignment, and where
+    // that alignment started.
+    struct SweepCursor {
+        size_t peak = 0;
+        uint32_t start = 0;
+    };
+    std::vector<SweepCursor> cursors = {};
+
+    // alignments from unsorted input, to be sorted and swept in batches
+    std::vector<QueuedAlignment> queued_alignments = {};
+    std::vector<QueuedAlignment> sorted_alignments = {};
+
+    ReferencePeakCollection* append_peak(const Peak& peak);
+    void lay_out();
+    bool count_overlaps(const ReferencePeakCollection& rpc, size_t peak, const Interval& alignment, bool is_hqaa);
+    void count_alignment(bool alignment_overlaps_peak, bool is_duplicate);
+    std::vector<Peak> unpack_peaks() const;
 
 public:
+    static const size_t alignment_batch_size = 16384;
+
     unsigned long long int total_peak_territory = 0;
 
     unsigned long long int duplicates_in_peaks = 0;
@@ -60,16 +146,32 @@ public:
     unsigned long long int top_1000_peak_hqaa_read_count = 0;
     unsigned long long int top_10000_peak_hqaa_read_count = 0;
 
+    PeakTree();
+    explicit PeakTree(const std::shared_ptr<PeakIndex>& index);
+
     void add(Peak& peak);
+    void append(Peak& peak);
+    void build();
+    const std::shared_ptr<PeakIndex>& get_index() const;
     void determine_top_peaks();
     bool empty();
-    ReferencePeakCollection* get_reference_peaks(const std::string& reference_name);
-    void record_alignment(const Feature& aligment, bool is_hqaa, bool is_duplicate);
+    void merge(const PeakTree& other);
+    const ReferencePeakCollection* get_reference_peaks(const std::string& reference_name) const;
+    void record_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate);
+    void record_alignment(const Feature& alignment, bool is_hqaa, bool is_duplicate);
+    void record_sorted_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate);
+    void queue_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate);
+    void record_queued_alignments();
     std::vector<Peak> list_peaks();
     std::vector<Peak> list_peaks_by_overlapping_hqaa_descending();
     std::vector<Peak> list_peaks_by_size_descending();
+    void visit_peaks(const std::function<void(const char* name, unsigned long long int overlapping_hqaa, unsigned long long int size)>& visitor) const;
+    std::vector<unsigned long long int> overlapping_hqaa_descending(size_t limit) const;
+    std::vector<unsigned long long int> sizes_descending() const;
     void print_reference_peak_counts(std::ostream* os = nullptr);
     size_t size() const;
+    nlohmann::json partial_state() const;
+    void load_partial_state(const nlohmann::json& state);
 };
 
 #endif  // PEAKS_HPP
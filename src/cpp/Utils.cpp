@@ -5,6 +5,7 @@
 //
 
 #include <algorithm>
+#include <cctype>
 #include <cmath>
 #include <ctime>
 #include <iostream>
@@ -98,6 +99,18 @@ std::vector<std::string> split(const std::string& str, const std::string& delimi
 }
 
 
+std::string join(const std::vector<std::string>& strings, const std::string& separator) {
+    std::string result;
+    for (auto it = strings.begin(); it != strings.end(); it++) {
+        if (it != strings.begin()) {
+            result += separator;
+        }
+        result += *it;
+    }
+    return result;
+}
+
+
 bool is_only_digits(const std::string& s)
 {
     return !s.empty() && s.find_first_not_of("0123456789") == std::string::npos;
@@ -110,43 +123,59 @@ bool is_only_whitespace(const std::string& s)
 }
 
 
+//
+// The end of the run of digits or non-digits starting at the given
+// position.
+//
+static size_t numeric_token_end(const std::string& s, size_t position) {
+    bool digits = std::isdigit((unsigned char) s[position]);
+    while (position < s.size() && (bool) std::isdigit((unsigned char) s[position]) == digits) {
+        position++;
+    }
+    return position;
+}
+
+
+//
+// Compare strings a run of digits or non-digits at a time, with runs
+// of digits compared as numbers. The runs are compared in place, as
+// this is the comparator for most of ataqv's containers.
+//
 bool sort_strings_numerically(const std::string& s1, const std::string& s2) {
     if (s1 == s2) {
         return false;
     }
 
-    if (s1.empty()) {
-        if (s2.empty()) {
+    size_t p1 = 0;
+    size_t p2 = 0;
+    while (p1 < s1.size()) {
+        if (p2 >= s2.size()) {
             return false;
-        } else {
-            return true;
         }
-    }
 
-    std::string digits = "0123456789";
+        size_t end1 = numeric_token_end(s1, p1);
+        size_t end2 = numeric_token_end(s2, p2);
 
-    std::vector<std::string> tokens1 = split(s1, digits, true);
-    std::vector<std::string> tokens2 = split(s2, digits, true);
-
-    for (int i = 0, l1 = tokens1.size(), l2 = tokens2.size(); i < l1; i++) {
-        if (i >= l2) {
-            return false;
-        }
-
-        std::string t1 = tokens1[i];
-        std::string t2 = tokens2[i];
-
-        if (is_only_digits(t1) && is_only_digits(t2)) {
-            unsigned long long int d1 = std::stol(t1);
-            unsigned long long int d2 = std::stol(t2);
-            if (d1 != d2) {
-                return d1 < d2;
+        if (std::isdigit((unsigned char) s1[p1]) && std::isdigit((unsigned char) s2[p2])) {
+            // numbers without leading zeros compare by length, then digits
+            while (p1 < end1 && s1[p1] == '0') {
+                p1++;
             }
-        } else {
-            if (t1 != t2) {
-                return t1 < t2;
+            while (p2 < end2 && s2[p2] == '0') {
+                p2++;
+            }
+            if (end1 - p1 != end2 - p2) {
+                return end1 - p1 < end2 - p2;
             }
         }
+
+        int comparison = s1.compare(p1, end1 - p1, s2, p2, end2 - p2);
+        if (comparison != 0) {
+            return comparison < 0;
+        }
+
+        p1 = end1;
+        p2 = end2;
     }
 
     return s1 < s2;
@@ -20,6 +20,7 @@ long double percentage(const long double& numerator, const long double& denomina
 std::string percentage_string(const long double& numerator, const long double& denominator, const int &precision = 3, const std::string& prefix = " (", const std::string& suffix = "%)");
 
 std::vector<std::string> split(const std::string& str, const std::string& delimiters = " ", bool keep_delimiters = false);
+std::string join(const std::vector<std::string>& strings, const std::string& separator = " ");
 
 bool is_only_digits(const std::string& s);
 bool is_only_whitespace(const std::string& s);
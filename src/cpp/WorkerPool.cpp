@@ -0,0 +1,247 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#include <limits>
+#include <stdexcept>
+
+#include "WorkerPool.hpp"
+
+
+WorkerPool::WorkerPool(const int size) {
+    if (size < 1) {
+        throw std::invalid_argument("A worker pool needs at least one thread.");
+    }
+
+    for (int worker = 0; worker < size; worker++) {
+        threads.push_back(std::thread(&WorkerPool::work, this, worker));
+    }
+}
+
+
+//
+// Finish the queued tasks, then stop the threads. Completions that
+// were never collected are discarded.
+//
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    task_available.notify_all();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+
+int WorkerPool::size() const {
+    return threads.size();
+}
+
+
+//
+// The number of submitted tasks whose completions haven't been
+// collected.
+//
+size_t WorkerPool::outstanding() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return submitted - collected;
+}
+
+
+size_t WorkerPool::submit(const Task& task) {
+    size_t id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = submitted++;
+        tasks.push_back(std::make_pair(id, task));
+    }
+    task_available.notify_one();
+    return id;
+}
+
+
+//
+// Wait for the next task to finish.
+//
+WorkerPool::Completion WorkerPool::next_completion() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (submitted == collected) {
+        throw std::logic_error("No tasks are outstanding in the worker pool.");
+    }
+
+    completion_available.wait(lock, [this]() { return !completions.empty(); });
+
+    Completion completion = completions.front();
+    completions.pop_front();
+    collected++;
+
+    return completion;
+}
+
+
+void WorkerPool::work(const int worker) {
+    for (;;) {
+        std::pair<size_t, Task> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task_available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        Completion completion = {task.first, worker, boost::chrono::duration<double>(0), nullptr};
+
+        boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
+        try {
+            task.second(worker);
+        } catch (...) {
+            completion.error = std::current_exception();
+        }
+        completion.duration = boost::chrono::high_resolution_clock::now() - start;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            completions.push_back(completion);
+        }
+        completion_available.notify_one();
+    }
+}
+
+
+// the position of a consumer that has abandoned the ring, far enough
+// ahead that the producer never waits for it
+static const unsigned long long int ABANDONED = std::numeric_limits<unsigned long long int>::max() / 2;
+
+// how many times a thread waiting on the ring yields before sleeping
+static const int YIELDS_BEFORE_SLEEPING = 64;
+
+
+BroadcastRing::BroadcastRing(const size_t size, const int consumers) : slots(size), cursors(consumers), published(0), closed(false), consumer_abandoned(false), sleeping_producers(0), sleeping_consumers(0) {
+    if (size < 1 || consumers < 1) {
+        throw std::invalid_argument("A broadcast ring needs at least one slot and one consumer.");
+    }
+
+    for (auto& cursor : cursors) {
+        cursor.released.store(0);
+    }
+}
+
+
+size_t BroadcastRing::size() const {
+    return slots;
+}
+
+
+//
+// Wait until ready returns true, yielding at first, then sleeping on
+// wakeup. The side that changes what ready checks calls wake after
+// the change. Sleepers are counted before ready is checked under the
+// lock, and wake checks the count after the change, so one side or
+// the other always sees the change in time.
+//
+template <typename Predicate>
+void BroadcastRing::wait(std::condition_variable& wakeup, std::atomic<int>& sleepers, Predicate ready) {
+    for (int yields = 0; yields < YIELDS_BEFORE_SLEEPING; yields++) {
+        if (ready()) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    sleepers++;
+    wakeup.wait(lock, ready);
+    sleepers--;
+}
+
+
+void BroadcastRing::wake(std::condition_variable& wakeup, const std::atomic<int>& sleepers) {
+    if (sleepers.load() > 0) {
+        // a sleeper that has checked ready but isn't waiting yet holds
+        // the lock, so taking it ensures the notification isn't lost
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        wakeup.notify_all();
+    }
+}
+
+
+//
+// Wait until every consumer has released the next slot, and return
+// it to be filled.
+//
+size_t BroadcastRing::claim() {
+    for (const auto& cursor : cursors) {
+        wait(producer_wakeup, sleeping_producers, [this, &cursor]() {
+            return cursor.released.load() + slots > claimed;
+        });
+    }
+    return claimed++ % slots;
+}
+
+
+//
+// Hand the claimed slot to the consumers.
+//
+void BroadcastRing::publish() {
+    published.store(claimed);
+    wake(consumer_wakeup, sleeping_consumers);
+}
+
+
+//
+// Tell the consumers that nothing more will be published.
+//
+void BroadcastRing::close() {
+    closed.store(true);
+    wake(consumer_wakeup, sleeping_consumers);
+}
+
+
+bool BroadcastRing::abandoned() const {
+    return consumer_abandoned.load(std::memory_order_acquire);
+}
+
+
+//
+// Wait for the consumer's next slot. Returns false once the ring has
+// been closed and the consumer has seen every published slot.
+//
+bool BroadcastRing::next(const int consumer, size_t& slot) {
+    const unsigned long long int position = cursors[consumer].released.load(std::memory_order_relaxed);
+    wait(consumer_wakeup, sleeping_consumers, [this, position]() {
+        return published.load() > position || closed.load();
+    });
+
+    // the last slot may have been published just before closing
+    if (published.load() > position) {
+        slot = position % slots;
+        return true;
+    }
+    return false;
+}
+
+
+//
+// Release the slot returned by the consumer's last call to next.
+//
+void BroadcastRing::release(const int consumer) {
+    cursors[consumer].released.store(cursors[consumer].released.load(std::memory_order_relaxed) + 1);
+    wake(producer_wakeup, sleeping_producers);
+}
+
+
+void BroadcastRing::abandon(const int consumer) {
+    cursors[consumer].released.store(ABANDONED);
+    consumer_abandoned.store(true, std::memory_order_release);
+    wake(producer_wakeup, sleeping_producers);
+}
@@ -0,0 +1,131 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/chrono.hpp>
+
+
+//
+// A fixed set of threads working through a queue of tasks.
+//
+// Each task is told which of the pool's threads is running it, so it
+// can use resources belonging to that thread. When a task finishes,
+// its completion -- with how long it took and any exception it threw
+// -- is queued for the submitter to collect, so results can be
+// gathered as soon as they're ready, in whatever order they finish.
+//
+class WorkerPool {
+public:
+    typedef std::function<void(int worker)> Task;
+
+    struct Completion {
+        size_t task;  // as returned by submit
+        int worker;
+        boost::chrono::duration<double> duration;
+        std::exception_ptr error;
+    };
+
+    WorkerPool(const int size);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    int size() const;
+    size_t outstanding();
+    size_t submit(const Task& task);
+    Completion next_completion();
+
+private:
+    std::vector<std::thread> threads = {};
+    std::mutex mutex;
+    std::condition_variable task_available;
+    std::condition_variable completion_available;
+    std::deque<std::pair<size_t, Task>> tasks = {};
+    std::deque<Completion> completions = {};
+    size_t submitted = 0;
+    size_t collected = 0;
+    bool stopping = false;
+
+    void work(const int worker);
+};
+
+
+//
+// The positions in a ring of slots filled by one producer and read
+// by several consumers, each of which sees every slot in turn. The
+// slots themselves belong to the caller; the ring only says which to
+// fill or read next, and a slot isn't handed back to the producer
+// until every consumer has released it. Positions are exchanged
+// through atomics, so neither side takes a lock while the other keeps
+// up. Whichever side has to wait yields its thread a few times, then
+// sleeps until the other side wakes it.
+//
+// A consumer that fails can abandon the ring, so the producer never
+// waits for it again.
+//
+class BroadcastRing {
+public:
+    BroadcastRing(const size_t size, const int consumers);
+
+    BroadcastRing(const BroadcastRing&) = delete;
+    BroadcastRing& operator=(const BroadcastRing&) = delete;
+
+    size_t size() const;
+
+    // for the producer
+    size_t claim();
+    void publish();
+    void close();
+    bool abandoned() const;
+
+    // for each consumer
+    bool next(const int consumer, size_t& slot);
+    void release(const int consumer);
+    void abandon(const int consumer);
+
+private:
+    // the slots a consumer has released, on its own cache line
+    struct Cursor {
+        std::atomic<unsigned long long int> released;
+        char padding[64 - sizeof(std::atomic<unsigned long long int>)];
+    };
+
+    const size_t slots;
+    std::vector<Cursor> cursors;
+    std::atomic<unsigned long long int> published;
+    std::atomic<bool> closed;
+    std::atomic<bool> consumer_abandoned;
+
+    // the producer's count of slots claimed
+    unsigned long long int claimed = 0;
+
+    // for threads that have stopped yielding, and how many of them
+    // are asleep on each side, so the other side only takes the lock
+    // to wake them when there are any
+    std::mutex mutex;
+    std::condition_variable producer_wakeup;
+    std::condition_variable consumer_wakeup;
+    std::atomic<int> sleeping_producers;
+    std::atomic<int> sleeping_consumers;
+
+    template <typename Predicate>
+    void wait(std::condition_variable& wakeup, std::atomic<int>& sleepers, Predicate ready);
+    void wake(std::condition_variable& wakeup, const std::atomic<int>& sleepers);
+};
+
+#endif  // WORKERPOOL_HPP
@@ -30,15 +30,18 @@ enum {
     OPT_VERSION,
 
     OPT_THREADS,
+    OPT_SHARD,
 
     OPT_PEAK_FILE,
     OPT_TSS_FILE,
     OPT_TSS_EXTENSION,
     OPT_EXCLUDED_REGION_FILE,
+    OPT_DROP_EXCLUDED_READS,
 
     OPT_METRICS_FILE,
     OPT_LOG_PROBLEMATIC_READS,
     OPT_LESS_REDUNDANT,
+    OPT_METRIC_MODULES,
 
     OPT_NAME,
     OPT_IGNORE_READ_GROUPS,
@@ -61,11 +64,13 @@ void print_usage() {
     MetricsCollector collector = MetricsCollector();
     std::cout << "ataqv " << version_string() << ": QC metrics for ATAC-seq data" << std::endl << std::endl
 
-              << "Usage:" << std::endl << std::endl << "ataqv [options] organism alignment-file" << std::endl << std::endl
+              << "Usage:" << std::endl << std::endl << "ataqv [options] organism alignment-file" << std::endl
+              << "ataqv merge [merge options] partial-metrics-file [partial-metrics-file ...]" << std::endl << std::endl
               << "where:" << std::endl
               << "    organism is the subject of the experiment, which determines the list of autosomes"  << std::endl
               << "    (see \"Reference Genome Configuration\" below)."  << std::endl  << std::endl
-              << "    alignment-file is a BAM file with duplicate reads marked." << std::endl
+              << "    alignment-file is a BAM file with duplicate reads marked." << std::endl << std::endl
+              << "    partial-metrics-file is the output of a run with --shard (see \"Sharding\" below)." << std::endl
 
               << std::endl
 
@@ -75,7 +80,7 @@ void print_usage() {
               << "--help: show this usage message." << std::endl
               << "--verbose: show more details and progress updates." << std::endl
               << "--version: print the version of the program." << std::endl
-              << "--threads <n>: the maximum number of threads to use (right now, only for calculating TSS enrichment)." << std::endl << std::endl
+              << "--threads <n>: the maximum number of threads to use (for measuring indexed alignment files in parallel, or for other alignment files, half for decompressing them and the rest for measuring their read groups while reading them)." << std::endl << std::endl
 
               << "Optional Input" << std::endl
               << "--------------" << std::endl << std::endl
@@ -89,8 +94,7 @@ void print_usage() {
 
               << "--tss-file \"file name\"" << std::endl
               << "    A BED file of transcription start sites for the experiment organism. If supplied," << std::endl
-              << "    a TSS enrichment score will be calculated according to the ENCODE data standards." << std::endl
-              << "    This calculation requires that the BAM file of alignments be indexed." << std::endl << std::endl
+              << "    a TSS enrichment score will be calculated according to the ENCODE data standards." << std::endl << std::endl
 
               << "--tss-extension \"size\"" << std::endl
               << "    If a TSS enrichment score is requested, it will be calculated for a region of " << std::endl
@@ -98,7 +102,11 @@ void print_usage() {
 
               << "--excluded-region-file \"file name\"" << std::endl
               << "    A BED file containing excluded regions. Peaks or TSS overlapping these will be ignored." << std::endl
-              << "    May be given multiple times." << std::endl
+              << "    May be given multiple times." << std::endl << std::endl
+
+              << "--drop-excluded-reads" << std::endl
+              << "    If given, reads overlapping the excluded regions will also be dropped before they're" << std::endl
+              << "    measured, and only counted as excluded." << std::endl
 
               << std::endl
 
@@ -115,8 +123,20 @@ void print_usage() {
               << "    are found, the reads will be written to one file named after the BAM file." << std::endl << std::endl
 
 	      << "--less-redundant" << std::endl
-              << "    If given, output a subset of metrics that should be less redundant. If this flag is used, the same flag should be passed to mkarv when making the viewer." << std::endl
+              << "    If given, output a subset of metrics that should be less redundant. If this flag is used, the same flag should be passed to mkarv when making the viewer." << std::endl << std::endl
+
+              << "--metric-modules \"names\"" << std::endl
+              << "    A comma-separated list of the optional measurements to make. All are made by" << std::endl
+              << "    default; leaving one out omits its metrics from the output, and saves its cost" << std::endl
+              << "    per read. Give an empty list to make none of them. The modules are:" << std::endl;
+
+    std::vector<std::string> module_names = MetricModules::names();
+    std::vector<std::string> module_descriptions = MetricModules::descriptions();
+    for (size_t module = 0; module < module_names.size(); module++) {
+        std::cout << std::setfill(' ') << std::setw(24) << std::left << ("      " + module_names[module] + ": ") << module_descriptions[module] << std::endl;
+    }
 
+    std::cout
               << std::endl
 
               << "Metadata" << std::endl
@@ -186,7 +206,34 @@ void print_usage() {
               << "--mitochondrial-reference-name \"name\"" << std::endl
               << "    If the reference name for mitochondrial DNA in your alignment file is not \"chrM\",." << std::endl
               << "    use this option to supply the correct name. Again, if this name is wrong, all the"<< std::endl
-              << "    measurements involving mitochondrial alignments will be wrong." << std::endl << std::endl;
+              << "    measurements involving mitochondrial alignments will be wrong." << std::endl << std::endl
+
+              << std::endl
+
+              << "Sharding" << std::endl
+              << "--------" << std::endl << std::endl
+
+              << "A large alignment file can be measured in pieces, e.g. on different machines, and the" << std::endl
+              << "pieces merged into the usual metrics. The same goes for several alignment files from" << std::endl
+              << "the same libraries, e.g. one per sequencing lane." << std::endl << std::endl
+
+              << "--shard i/N" << std::endl
+              << "    Measure only the i-th of N slices of an indexed alignment file, writing partial" << std::endl
+              << "    metrics to the metrics file instead of JSON. The default filename will be based on" << std::endl
+              << "    the BAM file, with the suffix \".shard-i-of-N.ataqv.partial\". Use --shard 1/1 to" << std::endl
+              << "    write partial metrics for a whole alignment file. Can't be combined with" << std::endl
+              << "    --log-problematic-reads, as some problems can only be diagnosed once all the" << std::endl
+              << "    shards have been merged." << std::endl << std::endl
+
+              << "ataqv merge combines the partial metrics files, which must have been produced by the same" << std::endl
+              << "version of ataqv with the same organism, peak and TSS options, and writes the JSON metrics." << std::endl
+              << "It accepts these options:" << std::endl << std::endl
+
+              << "--help: show this usage message." << std::endl
+              << "--verbose: show more details and progress updates." << std::endl
+              << "--metrics-file \"file name\"" << std::endl
+              << "    The JSON file to which metrics will be written. The default filename will be based on" << std::endl
+              << "    the first partial metrics file's BAM file, with the suffix \".ataqv.json\"." << std::endl << std::endl;
 }
 
 
@@ -210,13 +257,95 @@ void print_error(T t, Args... args)
 }
 
 
+///
+/// Combine partial metrics files from sharded runs into the usual JSON
+///
+int merge_partial_metrics(int argc, char **argv) {
+    int c, option_index = 0;
+    bool verbose = false;
+    std::string metrics_filename;
+    boost::shared_ptr<boost::iostreams::filtering_ostream> metrics_file;
+    std::vector<std::string> partial_metrics_filenames;
+
+    static struct option long_options[] = {
+        {"help", no_argument, nullptr, OPT_HELP},
+        {"verbose", no_argument, nullptr, OPT_VERBOSE},
+        {"metrics-file", required_argument, nullptr, OPT_METRICS_FILE},
+        {0, 0, 0, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+        switch (c) {
+        case OPT_HELP:
+            print_usage();
+            exit(1);
+        case OPT_VERBOSE:
+            verbose = true;
+            break;
+        case OPT_METRICS_FILE:
+            metrics_filename = optarg;
+            break;
+        default:
+            print_usage();
+            exit(1);
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        partial_metrics_filenames.push_back(argv[i]);
+    }
+
+    if (partial_metrics_filenames.empty()) {
+        print_error("ERROR: Please specify the partial metrics files to merge.");
+        print_usage();
+        exit(1);
+    }
+
+    try {
+        MetricsCollector collector;
+        collector.verbose = verbose;
+        collector.merge_partial_states(partial_metrics_filenames);
+
+        if (metrics_filename.empty()) {
+            metrics_filename = basename(collector.alignment_filename);
+            metrics_filename += ".ataqv.json";
+        }
+
+        try {
+            metrics_file = mostream(metrics_filename);
+        } catch (FileException& e) {
+            print_error("ERROR: Could not open metrics file \"" + metrics_filename + "\" for writing: " + e.what());
+            exit(1);
+        }
+
+        std::cout << collector << std::endl;  // Print the metrics
+
+        std::cout << "Writing JSON metrics to " << metrics_filename << std::endl << std::flush;
+        *metrics_file << std::setw(2) << collector.to_json();
+        std::cout << "Metrics written to \"" << metrics_filename << "\"" << std::endl;
+    } catch (FileException& e) {
+        print_error("ERROR: " + std::string(e.what()));
+        exit(1);
+    }
+    std::cout << "Finished." << std::endl << std::flush;
+    return 0;
+}
+
+
 int main(int argc, char **argv) {
 
+    if (argc > 1 && std::string(argv[1]) == "merge") {
+        return merge_partial_metrics(argc - 1, argv + 1);
+    }
+
     int c, option_index = 0;
     bool verbose = false;
     int thread_limit = 1;
+    int shard_number = 0;
+    int shard_count = 0;
     bool log_problematic_reads = false;
     bool less_redundant = false;
+    std::vector<std::string> metric_modules = MetricModules::names();
 
     std::string name;
     bool ignore_read_groups = false;
@@ -233,6 +362,7 @@ int main(int argc, char **argv) {
     std::string tss_filename;
     int tss_extension = 1000;
     std::vector<std::string> excluded_region_filenames;
+    bool drop_excluded_reads = false;
 
     std::string metrics_filename;
     boost::shared_ptr<boost::iostreams::filtering_ostream> metrics_file;
@@ -242,8 +372,10 @@ int main(int argc, char **argv) {
         {"verbose", no_argument, nullptr, OPT_VERBOSE},
         {"version", no_argument, nullptr, OPT_VERSION},
         {"threads", required_argument, nullptr, OPT_THREADS},
+        {"shard", required_argument, nullptr, OPT_SHARD},
         {"log-problematic-reads", no_argument, nullptr, OPT_LOG_PROBLEMATIC_READS},
         {"less-redundant", no_argument, nullptr, OPT_LESS_REDUNDANT},
+        {"metric-modules", required_argument, nullptr, OPT_METRIC_MODULES},
         {"name", required_argument, nullptr, OPT_NAME},
         {"ignore-read-groups", no_argument, nullptr, OPT_IGNORE_READ_GROUPS},
         {"description", required_argument, nullptr, OPT_DESCRIPTION},
@@ -251,6 +383,7 @@ int main(int argc, char **argv) {
         {"url", required_argument, nullptr, OPT_URL},
         {"metrics-file", required_argument, nullptr, OPT_METRICS_FILE},
         {"excluded-region-file", required_argument, nullptr, OPT_EXCLUDED_REGION_FILE},
+        {"drop-excluded-reads", no_argument, nullptr, OPT_DROP_EXCLUDED_READS},
         {"peak-file", required_argument, nullptr, OPT_PEAK_FILE},
         {"tss-file", required_argument, nullptr, OPT_TSS_FILE},
         {"tss-extension", required_argument, nullptr, OPT_TSS_EXTENSION},
@@ -274,12 +407,32 @@ int main(int argc, char **argv) {
         case OPT_THREADS:
             thread_limit = std::stoi(optarg);
             break;
+        case OPT_SHARD:
+            {
+                char separator = 0;
+                std::istringstream shard(optarg);
+                if (!(shard >> shard_number >> separator >> shard_count) || separator != '/' || shard_number < 1 || shard_number > shard_count) {
+                    print_error("ERROR: Please specify the shard as i/N, where i is between 1 and N.");
+                    exit(1);
+                }
+            }
+            break;
         case OPT_LOG_PROBLEMATIC_READS:
             log_problematic_reads = true;
             break;
 	case OPT_LESS_REDUNDANT:
             less_redundant = true;
             break;
+        case OPT_METRIC_MODULES:
+            // an empty list turns them all off
+            metric_modules = split(optarg, ", ");
+            try {
+                MetricModules::mask(metric_modules);
+            } catch (std::invalid_argument& e) {
+                print_error(std::string("ERROR: ") + e.what() + " Please choose the metric modules from: " + join(MetricModules::names(), ", ") + ".");
+                exit(1);
+            }
+            break;
         case OPT_NAME:
             name = optarg;
             break;
@@ -301,6 +454,9 @@ int main(int argc, char **argv) {
         case OPT_EXCLUDED_REGION_FILE:
             excluded_region_filenames.push_back(optarg);
             break;
+        case OPT_DROP_EXCLUDED_READS:
+            drop_excluded_reads = true;
+            break;
         case OPT_PEAK_FILE:
             peak_filename = optarg;
             break;
@@ -347,6 +503,16 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    if (drop_excluded_reads && excluded_region_filenames.empty()) {
+        print_error("ERROR: Please specify the regions whose reads should be dropped with --excluded-region-file.");
+        exit(1);
+    }
+
+    if (shard_count > 0 && log_problematic_reads) {
+        print_error("ERROR: Problematic reads can't be logged when measuring a shard, as improperly paired reads can only be diagnosed once all the shards have been merged.");
+        exit(1);
+    }
+
     try {
         MetricsCollector collector(
             name,
@@ -367,11 +533,20 @@ int main(int argc, char **argv) {
             less_redundant,
             excluded_region_filenames);
 
+        collector.shard_number = shard_number;
+        collector.shard_count = shard_count;
+        collector.drop_excluded_reads = drop_excluded_reads;
+        collector.metric_modules = metric_modules;
+
         // if the filename for the metrics output wasn't specified,
         // construct it from the source BAM filename
         if (metrics_filename.empty()) {
             metrics_filename = basename(alignment_filename);
-            metrics_filename += ".ataqv.json";
+            if (shard_count > 0) {
+                metrics_filename += ".shard-" + std::to_string(shard_number) + "-of-" + std::to_string(shard_count) + ".ataqv.partial";
+            } else {
+                metrics_filename += ".ataqv.json";
+            }
         }
 
         try {
@@ -392,6 +567,14 @@ int main(int argc, char **argv) {
 
         collector.load_alignments();
 
+        if (shard_count > 0) {
+            std::cout << "Writing partial metrics to " << metrics_filename << std::endl << std::flush;
+            collector.write_partial_state(*metrics_file);
+            std::cout << "Partial metrics written to \"" << metrics_filename << "\"" << std::endl;
+            std::cout << "Finished." << std::endl << std::flush;
+            return 0;
+        }
+
         std::cout << collector << std::endl;  // Print the metrics
 
         std::cout << "Writing JSON metrics to " << metrics_filename << std::endl << std::flush;
@@ -0,0 +1,272 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Benchmark.hpp"
+#include "Exceptions.hpp"
+#include "Features.hpp"
+#include "HTS.hpp"
+#include "IO.hpp"
+#include "Metrics.hpp"
+
+
+//
+// The per-read cost of Metrics::add_alignment, with the test BAM's
+// reads held in memory so decompression doesn't drown it out.
+//
+static void benchmark_add_alignment() {
+    const int passes = 2000;
+
+    samFile* alignment_file = sam_open("test.bam", "r");
+    if (alignment_file == nullptr) {
+        throw FileException("Could not open test.bam.");
+    }
+    bam_hdr_t* header = sam_hdr_read(alignment_file);
+
+    std::vector<bam1_t*> records;
+    bam1_t* record = bam_init1();
+    while (sam_read1(alignment_file, header, record) >= 0) {
+        records.push_back(record);
+        record = bam_init1();
+    }
+    bam_destroy1(record);
+
+    MetricsCollector collector("benchmark", "human", "", "", "", "test.bam");
+    collector.classify_references(header);
+    Metrics metrics(&collector, "benchmark");
+
+    measure("Metrics::add_alignment", (unsigned long long int) passes * records.size(), [&]() {
+        for (int pass = 0; pass < passes; pass++) {
+            for (const bam1_t* record : records) {
+                metrics.add_alignment(header, record);
+            }
+        }
+    });
+
+    for (bam1_t* record : records) {
+        bam_destroy1(record);
+    }
+    bam_hdr_destroy(header);
+    hts_close(alignment_file);
+}
+
+
+//
+// Finding the Metrics for each record's read group in a 96-plex run,
+// through the collector's map of them, or their interned ordinals.
+//
+static void benchmark_read_group_lookup() {
+    const int read_group_count = 96;
+    const int lookups = 200000;
+
+    std::vector<std::string> read_group_ids;
+    std::map<std::string, int, numeric_string_comparator> read_group_map;
+    ReadGroupIndex read_groups;
+    for (int i = 0; i < read_group_count; i++) {
+        std::string read_group_id = "HWI-ST1234:8:C3F1MACXX:" + std::to_string(i + 1);
+        read_group_ids.push_back(read_group_id);
+        read_group_map[read_group_id] = read_groups.intern(read_group_id);
+    }
+
+    unsigned long long int map_checksum = 0;
+    unsigned long long int index_checksum = 0;
+
+    measure("numeric_string_comparator map", lookups, [&]() {
+        for (int i = 0; i < lookups; i++) {
+            map_checksum += read_group_map.at(read_group_ids[i % read_group_count].c_str());
+        }
+    });
+
+    measure("ReadGroupIndex::find", lookups, [&]() {
+        for (int i = 0; i < lookups; i++) {
+            index_checksum += read_groups.find(read_group_ids[i % read_group_count].c_str());
+        }
+    });
+
+    if (map_checksum != index_checksum) {
+        throw std::logic_error("Read group lookups disagree.");
+    }
+}
+
+
+//
+// Filtering the TSS against the test data's excluded regions, by
+// comparing each to every region or looking it up in the index, and
+// then looking up each of the test BAM's mapped reads, as dropping
+// excluded reads does.
+//
+static void benchmark_excluded_regions() {
+    const int passes = 2000;
+
+    std::vector<Feature> regions;
+    for (const std::string filename : {"exclude.dac.bed.gz", "exclude.duke.bed.gz"}) {
+        boost::shared_ptr<boost::iostreams::filtering_istream> region_file = mistream(filename);
+        Feature region;
+        while (*region_file >> region) {
+            regions.push_back(region);
+        }
+    }
+
+    std::vector<Interval> tss;
+    boost::shared_ptr<boost::iostreams::filtering_istream> tss_file = mistream("hg19.tss.refseq.bed.gz");
+    Feature feature;
+    while (*tss_file >> feature) {
+        tss.push_back(Interval(feature));
+    }
+
+    std::vector<Interval> region_list;
+    for (const Feature& region : regions) {
+        region_list.push_back(Interval(region));
+    }
+
+    ExcludedRegionIndex index;
+    for (const Feature& region : regions) {
+        index.add(region);
+    }
+    index.build();
+
+    unsigned long long int scanned = 0;
+    unsigned long long int indexed = 0;
+
+    measure("comparing TSS to every region", tss.size(), [&]() {
+        for (const Interval& t : tss) {
+            for (const Interval& region : region_list) {
+                if (t.overlaps(region)) {
+                    scanned++;
+                    break;
+                }
+            }
+        }
+    });
+
+    measure("ExcludedRegionIndex::find_overlap", tss.size(), [&]() {
+        for (const Interval& t : tss) {
+            if (index.find_overlap(t)) {
+                indexed++;
+            }
+        }
+    });
+
+    if (scanned != indexed) {
+        throw std::logic_error("Excluded region lookups disagree.");
+    }
+
+    samFile* alignment_file = sam_open("test.bam", "r");
+    if (alignment_file == nullptr) {
+        throw FileException("Could not open test.bam.");
+    }
+    bam_hdr_t* header = sam_hdr_read(alignment_file);
+
+    std::vector<Interval> reads;
+    bam1_t* record = bam_init1();
+    while (sam_read1(alignment_file, header, record) >= 0) {
+        if (record->core.tid >= 0 && !IS_UNMAPPED(record)) {
+            reads.push_back(Interval(record, ReferenceNames::id(header->target_name[record->core.tid])));
+        }
+    }
+    bam_destroy1(record);
+    bam_hdr_destroy(header);
+    hts_close(alignment_file);
+
+    unsigned long long int dropped = 0;
+    measure("ExcludedRegionIndex::overlaps", (unsigned long long int) passes * reads.size(), [&]() {
+        for (int pass = 0; pass < passes; pass++) {
+            for (const Interval& read : reads) {
+                dropped += index.overlaps(read);
+            }
+        }
+    });
+
+    if (dropped == 0) {
+        throw std::logic_error("No reads overlapped excluded regions.");
+    }
+}
+
+
+
+//
+// Classifying a synthetic stream of reads in batches, with each of
+// the ReadBatchClassifier kernels this CPU supports, against working
+// out each read's categories alone.
+//
+static void benchmark_read_classification() {
+    const size_t batch_size = 8192;
+    const int passes = 2000;
+
+    MetricsCollector collector("benchmark", "human", "", "", "", "test.bam");
+    for (int chromosome = 1; chromosome <= 22; chromosome++) {
+        std::string name = "chr" + std::to_string(chromosome);
+        collector.reference_classifications.push_back({name, ReferenceNames::id(name), true, false});
+    }
+    collector.reference_classifications.push_back({"chrM", ReferenceNames::id("chrM"), false, true});
+
+    // mostly properly paired reads, with a sprinkling of everything
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> oddity(0, 9);
+    std::uniform_int_distribution<int> tid(-1, collector.reference_classifications.size() - 1);
+    std::uniform_int_distribution<int> flag(0, 4095);
+    std::uniform_int_distribution<int> quality(0, 60);
+    std::uniform_int_distribution<int> isize(-500, 500);
+
+    std::vector<bam1_t> records(batch_size);
+    std::vector<const bam1_t*> record_pointers;
+    for (bam1_t& record : records) {
+        record = {};
+        bool odd = oddity(random) == 0;
+        record.core.flag = odd ? flag(random) : (BAM_FPAIRED | BAM_FPROPER_PAIR | (isize(random) < 0 ? BAM_FREVERSE : BAM_FMREVERSE));
+        record.core.qual = odd ? quality(random) : 60;
+        record.core.tid = odd ? tid(random) : 1 + tid(random) % 22;
+        record.core.mtid = odd ? tid(random) : record.core.tid;
+        record.core.pos = record.core.mpos = 1000;
+        record.core.isize = isize(random);
+        record_pointers.push_back(&record);
+    }
+
+    std::vector<uint32_t> flag_keys(batch_size);
+    std::vector<uint8_t> categories(batch_size);
+
+    unsigned long long int single_hqaa = 0;
+    measure("MetricsCollector::read_categories", (unsigned long long int) passes * batch_size, [&]() {
+        for (int pass = 0; pass < passes; pass++) {
+            for (const bam1_t* record : record_pointers) {
+                single_hqaa += (collector.read_categories(record) & ReadBatchClassifier::HQAA) != 0;
+            }
+        }
+    });
+
+    for (auto kernel : {ReadBatchClassifier::Kernel::SCALAR, ReadBatchClassifier::Kernel::SSE4, ReadBatchClassifier::Kernel::AVX2}) {
+        if (!ReadBatchClassifier::supports(kernel)) {
+            std::cout << "  " << ReadBatchClassifier::kernel_name(kernel) << " is not supported on this CPU." << std::endl;
+            continue;
+        }
+
+        ReadBatchClassifier classifier(collector.reference_classifications, kernel);
+        unsigned long long int batch_hqaa = 0;
+        measure("ReadBatchClassifier::classify (" + ReadBatchClassifier::kernel_name(kernel) + ")", (unsigned long long int) passes * batch_size, [&]() {
+            for (int pass = 0; pass < passes; pass++) {
+                classifier.classify(record_pointers.data(), batch_size, flag_keys.data(), categories.data());
+                for (uint8_t read_categories : categories) {
+                    batch_hqaa += (read_categories & ReadBatchClassifier::HQAA) != 0;
+                }
+            }
+        });
+
+        if (batch_hqaa != single_hqaa) {
+            throw std::logic_error("The " + ReadBatchClassifier::kernel_name(kernel) + " kernel found " + std::to_string(batch_hqaa) + " HQAA reads, not " + std::to_string(single_hqaa) + ".");
+        }
+    }
+}
+
+static Benchmark add_alignment("Metrics", benchmark_add_alignment);
+static Benchmark read_group_lookup("ReadGroups", benchmark_read_group_lookup);
+static Benchmark excluded_regions("ExcludedRegions", benchmark_excluded_regions);
+static Benchmark read_classification("ReadClassification", benchmark_read_classification);
@@ -0,0 +1,255 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Benchmark.hpp"
+#include "Exceptions.hpp"
+#include "Features.hpp"
+#include "HTS.hpp"
+#include "IO.hpp"
+#include "Peaks.hpp"
+
+
+static std::vector<Peak> read_peaks(const std::string& filename) {
+    std::vector<Peak> peaks;
+    boost::shared_ptr<boost::iostreams::filtering_istream> peak_istream = mistream(filename);
+    Peak peak;
+    while (*peak_istream >> peak) {
+        peaks.push_back(peak);
+    }
+    return peaks;
+}
+
+
+//
+// Building a tree from SRR891275's peaks, held in memory, by adding
+// them one at a time, or appending them all and sorting once, and then
+// a tree for each of 48 read groups, sharing the first's index.
+//
+static void benchmark_peak_loading() {
+    const int passes = 1;
+
+    std::vector<Peak> peaks = read_peaks("SRR891275.peaks.gz");
+
+    measure("PeakTree::add", (unsigned long long int) passes * peaks.size(), [&]() {
+        for (int pass = 0; pass < passes; pass++) {
+            PeakTree tree;
+            for (Peak& peak : peaks) {
+                tree.add(peak);
+            }
+        }
+    });
+
+    measure("PeakTree::append and build", (unsigned long long int) passes * peaks.size(), [&]() {
+        for (int pass = 0; pass < passes; pass++) {
+            PeakTree tree;
+            for (Peak& peak : peaks) {
+                tree.append(peak);
+            }
+            tree.build();
+        }
+    });
+
+    const int read_group_count = 48;
+    PeakTree loaded;
+    for (Peak& peak : peaks) {
+        loaded.append(peak);
+    }
+    loaded.build();
+
+    std::vector<PeakTree> read_group_trees;
+    measure("PeakTree sharing an index", read_group_count, [&]() {
+        for (int i = 0; i < read_group_count; i++) {
+            read_group_trees.push_back(PeakTree(loaded.get_index()));
+        }
+    });
+}
+
+
+//
+// Finding the peaks overlapping each of SRR891275's mapped reads, by
+// searching for each, or sweeping through them in coordinate order.
+//
+static void benchmark_peak_lookup() {
+    const int passes = 2000;
+
+    PeakTree tree;
+    for (Peak& peak : read_peaks("SRR891275.peaks.gz")) {
+        tree.add(peak);
+    }
+
+    samFile* alignment_file = sam_open("SRR891275.bam", "r");
+    if (alignment_file == nullptr) {
+        throw FileException("Could not open SRR891275.bam.");
+    }
+    bam_hdr_t* header = sam_hdr_read(alignment_file);
+
+    std::vector<Interval> alignments;
+    bam1_t* record = bam_init1();
+    while (sam_read1(alignment_file, header, record) >= 0) {
+        if (record->core.tid >= 0 && !IS_UNMAPPED(record)) {
+            alignments.push_back(Interval(record, ReferenceNames::id(header->target_name[record->core.tid])));
+        }
+    }
+    bam_destroy1(record);
+
+    measure("PeakTree::record_alignment", (unsigned long long int) passes * alignments.size(), [&]() {
+        for (int pass = 0; pass < passes; pass++) {
+            for (const Interval& alignment : alignments) {
+                tree.record_alignment(alignment, true, false);
+            }
+        }
+    });
+
+    measure("PeakTree::record_sorted_alignment", (unsigned long long int) passes * alignments.size(), [&]() {
+        for (int pass = 0; pass < passes; pass++) {
+            for (const Interval& alignment : alignments) {
+                tree.record_sorted_alignment(alignment, true, false);
+            }
+        }
+    });
+
+    bam_hdr_destroy(header);
+    hts_close(alignment_file);
+}
+
+
+//
+// Peak lookups at the scale of a real genome, where the peaks don't fit
+// in cache: a peak every 10kb of 22 references, and reads placed at
+// random, as in a name-sorted file, or in coordinate order.
+//
+static void benchmark_genome_peak_lookup() {
+    const int reference_count = 22;
+    const int peaks_per_reference = 12000;
+    const int peak_spacing = 10000;
+    const int alignment_count = 2000000;
+
+    PeakTree searched;
+    for (int reference = 1; reference <= reference_count; reference++) {
+        std::string reference_name = "chr" + std::to_string(reference);
+        for (int i = 0; i < peaks_per_reference; i++) {
+            Peak peak(reference_name, (unsigned long long int) i * peak_spacing + 1000, (unsigned long long int) i * peak_spacing + 1500, reference_name + "_peak_" + std::to_string(i));
+            searched.append(peak);
+        }
+    }
+    searched.build();
+
+    PeakTree queued(searched.get_index());
+    PeakTree swept(searched.get_index());
+
+    std::mt19937 generator(1);
+    std::vector<Interval> alignments;
+    for (int i = 0; i < alignment_count; i++) {
+        std::string reference_name = "chr" + std::to_string(1 + generator() % reference_count);
+        unsigned long long int start = generator() % (peaks_per_reference * peak_spacing);
+        alignments.push_back(Interval(Feature(reference_name, start, start + 100, "")));
+    }
+
+    measure("PeakTree::record_alignment (unsorted)", alignment_count, [&]() {
+        for (const Interval& alignment : alignments) {
+            searched.record_alignment(alignment, true, false);
+        }
+    });
+
+    measure("PeakTree::queue_alignment (unsorted)", alignment_count, [&]() {
+        for (const Interval& alignment : alignments) {
+            queued.queue_alignment(alignment, true, false);
+        }
+        queued.record_queued_alignments();
+    });
+
+    std::sort(alignments.begin(), alignments.end(), [](const Interval& i1, const Interval& i2) {
+        return i1.reference_id < i2.reference_id || (i1.reference_id == i2.reference_id && i1.start < i2.start);
+    });
+
+    measure("PeakTree::record_sorted_alignment", alignment_count, [&]() {
+        for (const Interval& alignment : alignments) {
+            swept.record_sorted_alignment(alignment, true, false);
+        }
+    });
+
+    if (queued.hqaa_in_peaks != searched.hqaa_in_peaks || swept.hqaa_in_peaks != searched.hqaa_in_peaks) {
+        throw std::logic_error("Peak lookups disagree.");
+    }
+}
+
+
+//
+// Summarizing the counts over 500,000 peaks for a read group's
+// metrics, by listing unpacked copies of the peaks in each order
+// needed, or through the tree's views of its index.
+//
+static void benchmark_peak_summaries() {
+    const int reference_count = 20;
+    const int peaks_per_reference = 25000;
+    const int peak_spacing = 5000;
+    const int alignment_count = 2000000;
+
+    PeakTree tree;
+    std::mt19937 generator(1);
+    for (int reference = 1; reference <= reference_count; reference++) {
+        std::string reference_name = "chr" + std::to_string(reference);
+        for (int i = 0; i < peaks_per_reference; i++) {
+            unsigned long long int start = (unsigned long long int) i * peak_spacing;
+            Peak peak(reference_name, start, start + 200 + generator() % 2000, reference_name + "_peak_" + std::to_string(i));
+            tree.append(peak);
+        }
+    }
+    tree.build();
+
+    for (int i = 0; i < alignment_count; i++) {
+        std::string reference_name = "chr" + std::to_string(1 + generator() % reference_count);
+        unsigned long long int start = generator() % (peaks_per_reference * peak_spacing);
+        tree.record_alignment(Feature(reference_name, start, start + 100, ""), true, false);
+    }
+
+    unsigned long long int list_checksum = 0;
+    unsigned long long int view_checksum = 0;
+
+    measure("PeakTree::list_peaks*", 1, [&]() {
+        for (const Peak& peak : tree.list_peaks()) {
+            list_checksum += peak.overlapping_hqaa + peak.size();
+        }
+        unsigned long long int count = 0;
+        for (const Peak& peak : tree.list_peaks_by_overlapping_hqaa_descending()) {
+            list_checksum += ++count * peak.overlapping_hqaa;
+        }
+        count = 0;
+        for (const Peak& peak : tree.list_peaks_by_size_descending()) {
+            list_checksum += ++count * peak.size();
+        }
+    });
+
+    measure("PeakTree views", 1, [&]() {
+        tree.visit_peaks([&](const char*, unsigned long long int overlapping_hqaa, unsigned long long int size) {
+            view_checksum += overlapping_hqaa + size;
+        });
+        unsigned long long int count = 0;
+        for (auto overlapping_hqaa : tree.overlapping_hqaa_descending(tree.size())) {
+            view_checksum += ++count * overlapping_hqaa;
+        }
+        count = 0;
+        for (auto size : tree.sizes_descending()) {
+            view_checksum += ++count * size;
+        }
+    });
+
+    if (list_checksum != view_checksum) {
+        throw std::logic_error("Peak summaries disagree.");
+    }
+}
+
+
+static Benchmark peak_loading("PeakLoading", benchmark_peak_loading);
+static Benchmark peak_lookup("PeakLookup", benchmark_peak_lookup);
+static Benchmark genome_peak_lookup("GenomePeakLookup", benchmark_genome_peak_lookup);
+static Benchmark peak_summaries("PeakSummaries", benchmark_peak_summaries);
@@ -0,0 +1,58 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#include <iomanip>
+#include <iostream>
+
+#include <boost/chrono.hpp>
+
+#include "Benchmark.hpp"
+
+
+Benchmark::Benchmark(const std::string& name, const Function& function): name(name), function(function) {
+    registry().push_back(this);
+}
+
+
+std::vector<Benchmark*>& Benchmark::registry() {
+    static std::vector<Benchmark*> benchmarks;
+    return benchmarks;
+}
+
+
+void measure(const std::string& label, const unsigned long long int operations, const std::function<void()>& loop) {
+    boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
+    loop();
+    boost::chrono::duration<double> duration = boost::chrono::high_resolution_clock::now() - start;
+
+    std::cout << "  " << std::left << std::setw(40) << label
+              << std::right << std::setw(12) << operations << " in " << std::fixed << std::setprecision(3) << duration.count() << " seconds: "
+              << std::setprecision(1) << (1e9 * duration.count() / operations) << " ns each" << std::endl;
+}
+
+
+//
+// Run every benchmark, or just those whose names contain one of the
+// arguments.
+//
+int main(int argc, char** argv) {
+    for (const Benchmark* benchmark : Benchmark::registry()) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            if (benchmark->name.find(argv[i]) != std::string::npos) {
+                selected = true;
+            }
+        }
+
+        if (selected) {
+            std::cout << benchmark->name << std::endl;
+            benchmark->function();
+            std::cout << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -170,3 +170,138 @@ TEST_CASE("ReferenceFeatureCollection rejects additions on different reference",
     Feature f("chr2", 1, 100, "peak_1");
     REQUIRE_THROWS_AS(collection.add(f), std::out_of_range);
 }
+
+
+TEST_CASE("FeatureTree building sorts each reference once", "features/FeatureTree/build") {
+    FeatureTree tree;
+    std::vector<Feature> features = {
+        Feature("chr1", 500, 600, "tss_1", 0.0, "+"),
+        Feature("chr1", 100, 101, "tss_2", 0.0, "-"),
+        Feature("chr2", 300, 301, "tss_3", 0.0, "+"),
+        Feature("chr1", 100, 101, "tss_4", 0.0, "+")
+    };
+    for (auto& feature : features) {
+        tree.add(feature);
+    }
+    tree.build();
+
+    ReferenceFeatureCollection* chr1 = tree.get_reference_feature_collection("chr1");
+    REQUIRE(chr1->features.size() == 3);
+    REQUIRE(std::string(chr1->names.get(chr1->features[0].name)) == "tss_2");
+    REQUIRE(std::string(chr1->names.get(chr1->features[1].name)) == "tss_4");
+    REQUIRE(std::string(chr1->names.get(chr1->features[2].name)) == "tss_1");
+    REQUIRE(chr1->start == 100);
+    REQUIRE(chr1->end == 600);
+    REQUIRE(tree.size() == 4);
+
+    Feature late("chr1", 700, 701, "late");
+    REQUIRE_THROWS_AS(tree.add(late), std::logic_error);
+}
+
+
+TEST_CASE("ReferenceNames ranks references in natural order", "features/ReferenceNames") {
+    int chr10 = ReferenceNames::id("chr10");
+    int chr2 = ReferenceNames::id("chr2");
+    int chrX = ReferenceNames::id("chrX");
+
+    REQUIRE(ReferenceNames::id("chr10") == chr10);
+    REQUIRE(ReferenceNames::name(chr10) == "chr10");
+    REQUIRE(Feature("chr2", 1, 100, "peak_1").reference_id == chr2);
+
+    REQUIRE(ReferenceNames::precedes(chr2, chr10));
+    REQUIRE(ReferenceNames::precedes(chr10, chrX));
+    REQUIRE_FALSE(ReferenceNames::precedes(chr10, chr2));
+    REQUIRE_FALSE(ReferenceNames::precedes(chr10, chr10));
+
+    // ranks are recomputed as names are added, keeping the order of
+    // those already interned
+    int chr3 = ReferenceNames::id("chr3");
+    REQUIRE(ReferenceNames::precedes(chr2, chr3));
+    REQUIRE(ReferenceNames::precedes(chr3, chr10));
+    REQUIRE(ReferenceNames::rank(chr3) < ReferenceNames::rank(chr10));
+}
+
+
+TEST_CASE("Interval packs features", "features/Interval") {
+    NamePool names;
+    Feature tss("chr1", 1000, 1001, "NM_000014", 12.5, "-");
+    Interval interval(tss, names);
+
+    REQUIRE(sizeof(Interval) == 16);
+    REQUIRE(interval.reference_id == tss.reference_id);
+    REQUIRE(interval.start == 1000);
+    REQUIRE(interval.end == 1001);
+    REQUIRE(interval.is_reverse());
+    REQUIRE(interval.size() == 1);
+
+    // everything but the score survives the round trip
+    Feature unpacked = interval.to_feature(names);
+    REQUIRE(unpacked == tss);
+    REQUIRE(unpacked.strand == "-");
+    REQUIRE(unpacked.score == 0.0);
+
+    Interval other(Feature("chr1", 1, 100, "peak_1"), names);
+    REQUIRE(std::string(names.get(other.name)) == "peak_1");
+    REQUIRE(std::string(names.get(interval.name)) == "NM_000014");
+    REQUIRE(std::string(names.get(0)) == "");
+
+    // views made without a pool have no name
+    REQUIRE(Interval(Feature("chr1", 50, 150, "view")).name == 0);
+    REQUIRE(Interval(Feature("chr1", 50, 150, "view")).overlaps(other));
+    REQUIRE_FALSE(Interval(Feature("chr2", 50, 150, "view")).overlaps(other));
+    REQUIRE_FALSE(Interval(Feature("chr1", 100, 150, "view")).overlaps(other));
+
+    REQUIRE_THROWS_AS(Interval(Feature("chr1", 1, 5000000000ULL, "huge")), std::out_of_range);
+}
+
+
+TEST_CASE("ExcludedRegionIndex finds overlaps as Interval::overlaps does", "features/ExcludedRegionIndex") {
+    std::vector<Feature> regions = {
+        Feature("chr1", 100, 200, "nested_outer"),
+        Feature("chr1", 120, 130, "nested_inner"),
+        Feature("chr1", 500, 600, "touching_left"),
+        Feature("chr1", 600, 700, "touching_right"),
+        Feature("chr1", 1000, 1000, "empty"),
+        Feature("chr2", 50, 60, "other_reference")
+    };
+
+    ExcludedRegionIndex index;
+    for (const auto& region : regions) {
+        index.add(region);
+    }
+    index.build();
+
+    REQUIRE(index.size() == regions.size());
+    REQUIRE_THROWS_AS(index.add(Feature("chr1", 1, 2, "late")), std::logic_error);
+
+    // every interval agrees with a scan of the regions
+    for (const std::string reference : {"chr1", "chr2", "chr3"}) {
+        for (unsigned long long int start = 0; start < 1100; start += 7) {
+            for (unsigned long long int length : {0, 1, 20, 150}) {
+                Interval interval(Feature(reference, start, start + length, ""));
+                bool scanned = false;
+                for (const auto& region : regions) {
+                    scanned = scanned || interval.overlaps(Interval(region));
+                }
+                REQUIRE(index.overlaps(interval) == scanned);
+
+                const Interval* found = index.find_overlap(interval);
+                REQUIRE((found != nullptr) == scanned);
+                if (found) {
+                    REQUIRE(found->overlaps(interval));
+                }
+            }
+        }
+    }
+
+    // the region reported is the last to start of those overlapping
+    const Interval* found = index.find_overlap(Interval(Feature("chr1", 125, 126, "")));
+    REQUIRE(index.to_feature(*found).name == "nested_inner");
+    REQUIRE(index.to_feature(*index.find_overlap(Interval(Feature("chr1", 590, 610, "")))).name == "touching_right");
+    REQUIRE(index.to_feature(*index.find_overlap(Interval(Feature("chr1", 999, 1001, "")))).name == "empty");
+
+    // an empty interval only overlaps regions containing its start
+    REQUIRE_FALSE(index.overlaps(Interval(Feature("chr1", 1000, 1000, ""))));
+    REQUIRE(index.overlaps(Interval(Feature("chr1", 100, 100, ""))));
+    REQUIRE_FALSE(index.overlaps(Interval(Feature("chr1", 200, 200, ""))));
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <stdexcept>
 
 #include "catch.hpp"
 
@@ -166,6 +167,35 @@ TEST_CASE("Test SAM header parsing", "[hts/parse_sam_header]") {
     REQUIRE(references.size() == 84);
 }
 
+TEST_CASE("Test read group interning", "[hts/read_group_index]") {
+    ReadGroupIndex read_groups;
+
+    REQUIRE(read_groups.size() == 0);
+    REQUIRE(read_groups.find("SRR891275") == ReadGroupIndex::NOT_FOUND);
+
+    REQUIRE(read_groups.intern("SRR891275") == 0);
+    REQUIRE(read_groups.intern("SRR891278") == 1);
+    REQUIRE(read_groups.intern("SRR891275") == 0);
+    REQUIRE(read_groups.size() == 2);
+
+    REQUIRE(read_groups.find("SRR891278") == 1);
+    REQUIRE(read_groups.find("SRR89127") == ReadGroupIndex::NOT_FOUND);
+    REQUIRE(read_groups.find("") == ReadGroupIndex::NOT_FOUND);
+    REQUIRE(read_groups.id(1) == "SRR891278");
+
+    // plenty of IDs, to make the table grow
+    for (int i = 0; i < 200; i++) {
+        REQUIRE(read_groups.intern("RG" + std::to_string(i)) == i + 2);
+    }
+    REQUIRE(read_groups.size() == 202);
+    for (int i = 0; i < 200; i++) {
+        REQUIRE(read_groups.find(("RG" + std::to_string(i)).c_str()) == i + 2);
+    }
+    REQUIRE(read_groups.find("SRR891275") == 0);
+    REQUIRE(read_groups.find("RG200") == ReadGroupIndex::NOT_FOUND);
+    REQUIRE_THROWS_AS(read_groups.id(202), std::out_of_range);
+}
+
 TEST_CASE("Test bad HTS record") {
     samFile *in;
     bam_hdr_t *header;
@@ -1,8 +1,45 @@
 #include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "catch.hpp"
 
 #include "Metrics.hpp"
+#include "Utils.hpp"
+
+
+//
+// A collector of test.bam's metrics, or those of a copy of it, with the
+// test peaks, TSS and excluded regions, measured on the given number
+// of threads.
+//
+static std::unique_ptr<MetricsCollector> make_test_collector(const std::string& alignment_file_name = "test.bam", const int thread_limit = 1) {
+    return std::unique_ptr<MetricsCollector>(new MetricsCollector("Test collector", "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", "test.peaks.gz", "hg19.tss.refseq.bed.gz", 1000, false, thread_limit, false, false, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"}));
+}
+
+
+// copy test.bam without its index
+static void copy_test_alignments(const std::string& alignment_file_name) {
+    std::ifstream original("test.bam", std::ios::binary);
+    std::ofstream copy(alignment_file_name, std::ios::binary);
+    copy << original.rdbuf();
+}
+
+
+// compare two collectors' JSON, which only differ in their timestamps
+static void require_same_json(nlohmann::json expected, nlohmann::json actual) {
+    REQUIRE(expected.size() == actual.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        expected[i].erase("timestamp");
+        actual[i].erase("timestamp");
+    }
+
+    REQUIRE(expected == actual);
+}
 
 
 TEST_CASE("MetricsCollector basics", "[metrics/collector]") {
@@ -21,6 +58,31 @@ TEST_CASE("MetricsCollector basics", "[metrics/collector]") {
         REQUIRE_FALSE(collector.is_mitochondrial("foo"));
     }
 
+    SECTION("MetricsCollector::classify_references") {
+        samFile* alignment_file = sam_open("test.bam", "r");
+        bam_hdr_t* header = sam_hdr_read(alignment_file);
+        collector.classify_references(header);
+
+        REQUIRE(collector.reference_classifications.size() == (size_t) header->n_targets);
+
+        int chr1 = bam_name2id(header, "chr1");
+        REQUIRE(collector.reference_classifications[chr1].name == "chr1");
+        REQUIRE(collector.reference_classifications[chr1].reference_id == ReferenceNames::id("chr1"));
+        REQUIRE(collector.is_autosomal(chr1));
+        REQUIRE_FALSE(collector.is_mitochondrial(chr1));
+
+        int chrM = bam_name2id(header, "chrM");
+        REQUIRE_FALSE(collector.is_autosomal(chrM));
+        REQUIRE(collector.is_mitochondrial(chrM));
+
+        int chrX = bam_name2id(header, "chrX");
+        REQUIRE_FALSE(collector.is_autosomal(chrX));
+        REQUIRE_FALSE(collector.is_mitochondrial(chrX));
+
+        bam_hdr_destroy(header);
+        hts_close(alignment_file);
+    }
+
     SECTION("MetricsCollector::configuration_string") {
         std::string expected = "ataqv " + version_string() + "\n\n" +
             "Operating parameters\n" +
@@ -166,6 +228,236 @@ TEST_CASE("Metrics::load_alignments", "[metrics/load_alignments]") {
     REQUIRE(1.28125 == j[0]["metrics"]["short_mononucleosomal_ratio"].get<long double>());
 }
 
+TEST_CASE("Metrics TSS enrichment without an alignment index", "[metrics/tss_unindexed]") {
+    std::string alignment_file_name("test.unindexed.bam");
+    copy_test_alignments(alignment_file_name);
+
+    MetricsCollector collector("Test collector", "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", "", "hg19.tss.refseq.bed.gz", 1000, false, 1, false, false, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
+    collector.load_alignments();
+    std::remove(alignment_file_name.c_str());
+
+    REQUIRE(collector.metrics.cbegin()->second->tss_enrichment == Approx(6.0));
+}
+
+TEST_CASE("Metrics::load_alignments in parallel", "[metrics/load_alignments_in_parallel]") {
+    auto sequential_collector = make_test_collector("test.bam", 1);
+    auto parallel_collector = make_test_collector("test.bam", 4);
+
+    sequential_collector->load_alignments();
+    parallel_collector->load_alignments();
+
+    REQUIRE(parallel_collector->metrics.size() == 2);
+    require_same_json(sequential_collector->to_json(), parallel_collector->to_json());
+}
+
+
+TEST_CASE("Metrics::load_alignments in batches", "[metrics/load_alignments_in_batches]") {
+    // without an index, the file can't be split into chunks, so more
+    // than one thread means reading in batches
+    std::string alignment_file_name("test.batches.bam");
+    copy_test_alignments(alignment_file_name);
+
+    auto sequential_collector = make_test_collector(alignment_file_name, 1);
+    auto batched_collector = make_test_collector(alignment_file_name, 4);
+
+    sequential_collector->load_alignments();
+    batched_collector->load_alignments();
+    std::remove(alignment_file_name.c_str());
+
+    REQUIRE(batched_collector->metrics.size() == 2);
+    require_same_json(sequential_collector->to_json(), batched_collector->to_json());
+}
+
+
+TEST_CASE("Metrics counts fragment lengths past the ceiling", "[metrics/fragment_length_ceiling]") {
+    MetricsCollector default_collector("Test collector", "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam");
+    MetricsCollector low_ceiling_collector("Test collector", "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam");
+    low_ceiling_collector.fragment_length_ceiling = 100;
+
+    default_collector.load_alignments();
+    low_ceiling_collector.load_alignments();
+
+    Metrics* metrics = low_ceiling_collector.metrics.cbegin()->second;
+    REQUIRE(metrics->modules.get<FragmentLengthModule>().counts.size() == 101);
+    REQUIRE_FALSE(metrics->modules.get<FragmentLengthModule>().long_counts.empty());
+
+    nlohmann::json default_json = default_collector.to_json();
+    nlohmann::json low_ceiling_json = low_ceiling_collector.to_json();
+    for (size_t i = 0; i < default_json.size(); i++) {
+        REQUIRE(default_json[i]["metrics"]["fragment_length_counts"] == low_ceiling_json[i]["metrics"]["fragment_length_counts"]);
+    }
+}
+
+
+TEST_CASE("MetricsCollector::merge_partial_states", "[metrics/merge_partial_states]") {
+    std::vector<std::string> partial_file_names = {"test.shard-1-of-2.ataqv.partial", "test.shard-2-of-2.ataqv.partial"};
+
+    auto collector = make_test_collector("test.bam", 1);
+    collector->load_alignments();
+
+    for (int shard = 1; shard <= 2; shard++) {
+        auto shard_collector = make_test_collector("test.bam", 2);
+        shard_collector->shard_number = shard;
+        shard_collector->shard_count = 2;
+        shard_collector->load_alignments();
+        REQUIRE(shard_collector->metrics.cbegin()->second->total_reads < 520);
+
+        auto out = mostream(partial_file_names[shard - 1]);
+        shard_collector->write_partial_state(*out);
+    }
+
+    MetricsCollector merged_collector;
+    merged_collector.merge_partial_states(partial_file_names);
+
+    REQUIRE(merged_collector.metrics.size() == 2);
+    REQUIRE(merged_collector.metrics.cbegin()->second->tss_enrichment == Approx(6.0));
+
+    require_same_json(collector->to_json(), merged_collector.to_json());
+
+    // every shard must be merged, exactly once
+    MetricsCollector incomplete_collector;
+    REQUIRE_THROWS_AS(incomplete_collector.merge_partial_states({partial_file_names[0]}), FileException);
+
+    MetricsCollector repetitive_collector;
+    REQUIRE_THROWS_AS(repetitive_collector.merge_partial_states({partial_file_names[0], partial_file_names[0]}), FileException);
+
+    MetricsCollector bad_collector;
+    REQUIRE_THROWS_AS(bad_collector.merge_partial_states({"test.peaks.gz"}), FileException);
+
+    for (const auto& partial_file_name : partial_file_names) {
+        std::remove(partial_file_name.c_str());
+    }
+}
+
+
+TEST_CASE("Metrics drops reads in excluded regions", "[metrics/drop_excluded_reads]") {
+    std::string name("Test collector");
+    std::string alignment_file_name("test.bam");
+    std::vector<std::string> excluded_region_file_names = {"exclude.dac.bed.gz", "exclude.duke.bed.gz"};
+
+    MetricsCollector collector(name, "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", "", "", 1000, false, 1, false, false, false, excluded_region_file_names);
+    collector.load_alignments();
+
+    MetricsCollector dropping_collector(name, "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", "", "", 1000, false, 1, false, false, false, excluded_region_file_names);
+    dropping_collector.drop_excluded_reads = true;
+    dropping_collector.load_alignments();
+
+    REQUIRE(collector.excluded_regions.size() == dropping_collector.excluded_regions.size());
+
+    for (const auto& it : collector.metrics) {
+        Metrics* measured = it.second;
+        Metrics* dropping = dropping_collector.metrics.at(it.first);
+
+        REQUIRE(measured->excluded_region_reads == 0);
+        REQUIRE(dropping->excluded_region_reads > 0);
+        REQUIRE(dropping->total_reads + dropping->excluded_region_reads == measured->total_reads);
+        REQUIRE(dropping->to_json()["metrics"]["excluded_region_reads"] == dropping->excluded_region_reads);
+        REQUIRE(measured->to_json()["metrics"].count("excluded_region_reads") == 0);
+    }
+}
+
+
+TEST_CASE("Metrics only measures the enabled metric modules", "[metrics/metric_modules]") {
+    std::string name("Test collector");
+    std::string alignment_file_name("test.bam");
+
+    REQUIRE(MetricModules::names() == std::vector<std::string>({"mapq", "fragment-lengths", "chromosomes"}));
+    REQUIRE(MetricModules::mask(MetricModules::names()) == 7);
+    REQUIRE(MetricModules::mask({"chromosomes", "mapq"}) == 5);
+    REQUIRE(MetricModules::mask({}) == 0);
+    REQUIRE(MetricModules::mask(split("", ", ")) == 0);
+    REQUIRE(MetricModules::descriptions().size() == MetricModules::names().size());
+    REQUIRE_THROWS_AS(MetricModules::mask({"bogus"}), std::invalid_argument);
+
+    MetricsCollector collector(name, "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name);
+    collector.load_alignments();
+
+    MetricsCollector fragment_collector(name, "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name);
+    fragment_collector.metric_modules = {"fragment-lengths"};
+    fragment_collector.load_alignments();
+
+    for (const auto& it : collector.metrics) {
+        Metrics* all = it.second;
+        Metrics* fragments = fragment_collector.metrics.at(it.first);
+
+        REQUIRE(fragments->modules.is_enabled<FragmentLengthModule>());
+        REQUIRE_FALSE(fragments->modules.is_enabled<MapqModule>());
+        REQUIRE(fragments->modules.get<MapqModule>().total() == 0);
+        REQUIRE(fragments->modules.get<ChromosomeModule>().counts.empty());
+
+        // the core counters don't depend on the modules
+        REQUIRE(fragments->total_reads == all->total_reads);
+        REQUIRE(fragments->hqaa == all->hqaa);
+        REQUIRE(all->modules.get<MapqModule>().total() == all->total_reads);
+
+        nlohmann::json all_json = all->to_json()["metrics"];
+        nlohmann::json fragment_json = fragments->to_json()["metrics"];
+        REQUIRE(fragment_json["fragment_length_counts"] == all_json["fragment_length_counts"]);
+        REQUIRE(fragment_json["hqaa"] == all_json["hqaa"]);
+        REQUIRE(all_json.count("mapq_counts") == 1);
+        REQUIRE(fragment_json.count("mapq_counts") == 0);
+        REQUIRE(fragment_json.count("median_mapq") == 0);
+        REQUIRE(fragment_json.count("chromosome_counts") == 0);
+    }
+}
+
+
+TEST_CASE("Metrics drops reads in excluded regions the same way in parallel", "[metrics/drop_excluded_reads_in_parallel]") {
+    // dropped mates in other chunks mustn't count toward TSS coverage
+    auto sequential_collector = make_test_collector("test.bam", 1);
+    auto parallel_collector = make_test_collector("test.bam", 4);
+    sequential_collector->drop_excluded_reads = true;
+    parallel_collector->drop_excluded_reads = true;
+
+    sequential_collector->load_alignments();
+    parallel_collector->load_alignments();
+
+    REQUIRE(sequential_collector->metrics.cbegin()->second->excluded_region_reads > 0);
+    require_same_json(sequential_collector->to_json(), parallel_collector->to_json());
+}
+
+
+TEST_CASE("ImproperPairLog drains reads in name order, spilled or not", "[metrics/improper_pair_log]") {
+    std::vector<std::pair<std::string, unsigned long long int>> reads;
+    for (int i = 0; i < 500; i++) {
+        reads.push_back(std::make_pair("read." + std::to_string((i * 7919) % 211), i));
+    }
+
+    // the order of a map of names to the sizes in the order added
+    std::map<std::string, std::vector<unsigned long long int>> expected_map;
+    for (const auto& read : reads) {
+        expected_map[read.first].push_back(read.second);
+    }
+    std::vector<std::pair<std::string, unsigned long long int>> expected;
+    for (const auto& it : expected_map) {
+        for (unsigned long long int size : it.second) {
+            expected.push_back(std::make_pair(it.first, size));
+        }
+    }
+
+    for (size_t buffer_limit : {1 << 20, 1000}) {
+        // half the reads go in one log, half in another merged into it
+        ImproperPairLog log(buffer_limit);
+        ImproperPairLog other(buffer_limit);
+        for (size_t i = 0; i < reads.size(); i++) {
+            (i < reads.size() / 2 ? log : other).add(reads[i].first.c_str(), reads[i].second);
+        }
+        log.merge(other);
+        REQUIRE(log.size() == reads.size());
+        REQUIRE((log.spilled_runs() == 0) == (buffer_limit == 1 << 20));
+
+        std::vector<std::pair<std::string, unsigned long long int>> drained;
+        log.drain([&drained](const std::string& name, const unsigned long long int size) {
+            drained.push_back(std::make_pair(name, size));
+        });
+
+        REQUIRE(drained == expected);
+        REQUIRE(log.size() == 0);
+        REQUIRE(log.spilled_runs() == 0);
+    }
+}
+
+
 TEST_CASE("Metrics::load_alignments errors", "[metrics/load_alignments_errors]") {
     SECTION("MetricsCollector::load_alignments fails without alignment file name") {
         MetricsCollector collector("Broken collector", "human", "a collector without an alignment file", "a library of brutal tests?", "https://theparkerlab.org", "", "", "", "");
@@ -257,3 +549,89 @@ TEST_CASE("Metrics::missing_tss_file", "[metrics/missing_ss_file]") {
     MetricsCollector collector(name, "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", peak_file_name, tss_file_name, 1000, true, 1, true, true, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
     REQUIRE_THROWS_AS(collector.load_alignments(), FileException);
 }
+
+
+TEST_CASE("ReadBatchClassifier kernels agree with classifying reads one at a time", "[metrics/read_batch_classifier]") {
+    MetricsCollector collector("Test collector", "human", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam");
+    collector.reference_classifications = {
+        {"chr1", ReferenceNames::id("chr1"), true, false},
+        {"chr2", ReferenceNames::id("chr2"), true, false},
+        {"chrM", ReferenceNames::id("chrM"), false, true},
+        {"chrX", ReferenceNames::id("chrX"), false, false}
+    };
+
+    // every flag, with a spread of qualities, references, placements
+    // and template lengths, in a count that leaves lanes over
+    std::vector<bam1_t> records;
+    const std::vector<int> qualities = {0, 29, 30, 60};
+    const std::vector<int> tids = {-1, 0, 1, 2, 3};
+    for (int flag = 0; flag < 4096; flag++) {
+        bam1_t record = {};
+        record.core.flag = flag;
+        record.core.qual = qualities[flag % qualities.size()];
+        record.core.tid = tids[flag % tids.size()];
+        record.core.mtid = flag % 3 ? record.core.tid : 1;
+        record.core.pos = flag % 7;
+        record.core.mpos = flag % 11;
+        record.core.isize = (flag % 5) - 2;
+        records.push_back(record);
+    }
+    records.resize(records.size() - 3);
+
+    std::vector<const bam1_t*> record_pointers;
+    for (const auto& record : records) {
+        record_pointers.push_back(&record);
+    }
+
+    std::vector<uint32_t> scalar_flag_keys(records.size());
+    std::vector<uint8_t> scalar_categories(records.size());
+    ReadBatchClassifier scalar(collector.reference_classifications, ReadBatchClassifier::Kernel::SCALAR);
+    scalar.classify(record_pointers.data(), records.size(), scalar_flag_keys.data(), scalar_categories.data());
+
+    for (size_t i = 0; i < records.size(); i++) {
+        REQUIRE(scalar_categories[i] == collector.read_categories(&records[i]));
+        REQUIRE(((scalar_categories[i] & ReadBatchClassifier::HQAA) != 0) == collector.is_hqaa(nullptr, &records[i]));
+    }
+
+    for (auto kernel : {ReadBatchClassifier::Kernel::SSE4, ReadBatchClassifier::Kernel::AVX2}) {
+        if (!ReadBatchClassifier::supports(kernel)) {
+            REQUIRE_THROWS_AS(ReadBatchClassifier(collector.reference_classifications, kernel), std::invalid_argument);
+            continue;
+        }
+
+        std::vector<uint32_t> flag_keys(records.size());
+        std::vector<uint8_t> categories(records.size());
+        ReadBatchClassifier classifier(collector.reference_classifications, kernel);
+        classifier.classify(record_pointers.data(), records.size(), flag_keys.data(), categories.data());
+
+        REQUIRE(flag_keys == scalar_flag_keys);
+        REQUIRE(categories == scalar_categories);
+    }
+
+    // and the reads are counted the same either way
+    Metrics one_at_a_time(&collector, "classified");
+    Metrics batched(&collector, "classified");
+    for (size_t i = 0; i < records.size(); i++) {
+        one_at_a_time.add_alignment(nullptr, &records[i]);
+        batched.add_alignment(nullptr, &records[i], scalar_flag_keys[i], scalar_categories[i]);
+    }
+    REQUIRE(one_at_a_time.partial_state() == batched.partial_state());
+
+    // and the counters derived from the flag counts agree with the
+    // records, whether their FLAG bits are in the key or not
+    unsigned long long int reverse_reads = 0, qcfailed_reads = 0, duplicate_reads = 0, first_reads = 0, secondary_reads = 0;
+    for (const bam1_t* record : record_pointers) {
+        reverse_reads += IS_REVERSE(record) != 0;
+        qcfailed_reads += IS_QCFAIL(record) != 0;
+        duplicate_reads += IS_DUP(record) != 0;
+        first_reads += IS_READ1(record) != 0;
+        secondary_reads += IS_SECONDARY(record) != 0;
+    }
+
+    one_at_a_time.count_flags();
+    REQUIRE(one_at_a_time.reverse_reads == reverse_reads);
+    REQUIRE(one_at_a_time.qcfailed_reads == qcfailed_reads);
+    REQUIRE(one_at_a_time.duplicate_reads == duplicate_reads);
+    REQUIRE(one_at_a_time.first_reads == first_reads);
+    REQUIRE(one_at_a_time.secondary_reads == secondary_reads);
+}
@@ -122,14 +122,317 @@ TEST_CASE("Peak HQAA counting", "peaks/hqaa") {
     Feature hqaa1("chr1", 125, 175, "hqaa1");
     tree.record_alignment(hqaa1, true, false);
 
-    ReferencePeakCollection chr1 = *tree.get_reference_peaks("chr1");
-    chr1.sort();
-    REQUIRE(chr1.peaks[0].overlapping_hqaa == 101);
-    REQUIRE(chr1.peaks[1].overlapping_hqaa == 201);
-    REQUIRE(chr1.peaks[2].overlapping_hqaa == 300);
+    std::vector<Peak> peaks = tree.list_peaks();
+    REQUIRE(peaks[0].name == "peak1");
+    REQUIRE(peaks[0].overlapping_hqaa == 101);
+    REQUIRE(peaks[1].overlapping_hqaa == 201);
+    REQUIRE(peaks[2].overlapping_hqaa == 300);
+
+    REQUIRE(peaks[3].name == "peak4");
+    REQUIRE(peaks[3].overlapping_hqaa == 400);
+}
+
+
+TEST_CASE("PeakTree sweeping sorted alignments", "[peaks/sweep]") {
+    PeakTree searched;
+    PeakTree swept;
+
+    std::vector<Peak> peaks = {
+        Peak("chr1", 100, 200, "peak1"),
+        Peak("chr1", 150, 250, "peak2"),
+        Peak("chr1", 200, 300, "peak3"),
+        Peak("chr1", 500, 600, "peak4"),
+        Peak("chr2", 100, 500, "peak5"),
+        Peak("chr2", 200, 300, "peak6"),
+        Peak("chr2", 400, 450, "peak7")
+    };
+
+    for (Peak& peak : peaks) {
+        searched.add(peak);
+        swept.add(peak);
+    }
+
+    REQUIRE(swept.get_reference_peaks("chr1")->ends_ascending);
+    REQUIRE_FALSE(swept.get_reference_peaks("chr2")->ends_ascending);
+
+    // in coordinate order, except for a jump back to the start of
+    // chr1, as where a parallel chunk begins
+    std::vector<Feature> alignments = {
+        Feature("chr1", 50, 90, "before"),
+        Feature("chr1", 125, 175, "hqaa1"),
+        Feature("chr1", 210, 240, "hqaa2"),
+        Feature("chr1", 290, 510, "hqaa3"),
+        Feature("chr1", 700, 800, "after"),
+        Feature("chr1", 100, 100, "back"),
+        Feature("chr1", 180, 220, "hqaa4"),
+        Feature("chr2", 150, 250, "hqaa5"),
+        Feature("chr2", 210, 240, "hqaa6"),
+        Feature("chr2", 420, 430, "hqaa7"),
+        Feature("chr3", 150, 160, "nopeak")
+    };
+
+    for (size_t i = 0; i < alignments.size(); i++) {
+        searched.record_alignment(Interval(alignments[i]), i % 3 != 0, i % 2 == 0);
+        swept.record_sorted_alignment(Interval(alignments[i]), i % 3 != 0, i % 2 == 0);
+    }
+
+    REQUIRE(swept.list_peaks() == searched.list_peaks());
+    REQUIRE(swept.hqaa_in_peaks == searched.hqaa_in_peaks);
+    REQUIRE(swept.ppm_in_peaks == searched.ppm_in_peaks);
+    REQUIRE(swept.ppm_not_in_peaks == searched.ppm_not_in_peaks);
+    REQUIRE(swept.duplicates_in_peaks == searched.duplicates_in_peaks);
+    REQUIRE(swept.duplicates_not_in_peaks == searched.duplicates_not_in_peaks);
+    REQUIRE(swept.ppm_in_peaks == 8);
+}
+
+
+TEST_CASE("PeakTree queueing unsorted alignments", "[peaks/queue]") {
+    PeakTree searched;
+    PeakTree queued;
+
+    std::vector<Peak> peaks = {
+        Peak("chr1", 100, 200, "peak1"),
+        Peak("chr1", 150, 250, "peak2"),
+        Peak("chr1", 5000, 6000, "peak3"),
+        Peak("chr2", 100, 5000, "peak4"),
+        Peak("chr2", 200, 300, "peak5"),
+        Peak("chr10", 1000, 2000, "peak6")
+    };
+
+    for (Peak& peak : peaks) {
+        searched.add(peak);
+        queued.add(peak);
+    }
+
+    // enough alignments, scattered over the references, to fill more
+    // than one batch
+    const char* references[] = {"chr1", "chr2", "chr10", "chrX"};
+    unsigned long long int position = 1;
+    for (size_t i = 0; i < PeakTree::alignment_batch_size + 1000; i++) {
+        position = (position * 7919 + 13) % 8000;
+        Interval alignment(Feature(references[i % 4], position, position + 50, ""));
+        searched.record_alignment(alignment, i % 3 != 0, i % 2 == 0);
+        queued.queue_alignment(alignment, i % 3 != 0, i % 2 == 0);
+    }
+
+    REQUIRE(queued.ppm_in_peaks + queued.ppm_not_in_peaks == PeakTree::alignment_batch_size);
+
+    queued.record_queued_alignments();
+
+    REQUIRE(queued.list_peaks() == searched.list_peaks());
+    REQUIRE(queued.hqaa_in_peaks == searched.hqaa_in_peaks);
+    REQUIRE(queued.ppm_in_peaks == searched.ppm_in_peaks);
+    REQUIRE(queued.ppm_not_in_peaks == searched.ppm_not_in_peaks);
+    REQUIRE(queued.duplicates_in_peaks == searched.duplicates_in_peaks);
+    REQUIRE(queued.duplicates_not_in_peaks == searched.duplicates_not_in_peaks);
+}
+
+
+TEST_CASE("PeakTree building", "[peaks/build]") {
+    PeakTree added;
+    PeakTree built;
+
+    std::vector<Peak> peaks = {
+        Peak("chr2", 100, 200, "peak1"),
+        Peak("chr1", 500, 600, "peak2"),
+        Peak("chr1", 100, 300, "peak3"),
+        Peak("chr1", 100, 200, "peak4"),
+        Peak("chr1", 150, 250, "peak5")
+    };
+
+    for (Peak& peak : peaks) {
+        added.add(peak);
+        built.append(peak);
+    }
+    built.build();
+
+    REQUIRE(built.list_peaks() == added.list_peaks());
+    REQUIRE(built.size() == 5);
+    REQUIRE(built.total_peak_territory == added.total_peak_territory);
+    REQUIRE(built.get_reference_peaks("chr1")->start == 100);
+    REQUIRE(built.get_reference_peaks("chr1")->end == 600);
+    REQUIRE_FALSE(built.get_reference_peaks("chr1")->ends_ascending);
+
+    built.record_alignment(Feature("chr1", 120, 130, "hqaa1"), true, false);
+    REQUIRE(built.hqaa_in_peaks == 2);
+
+    Peak late("chr1", 700, 800, "late");
+    REQUIRE_THROWS_AS(built.add(late), std::logic_error);
+    REQUIRE_THROWS_AS(built.append(late), std::logic_error);
+}
+
+
+TEST_CASE("PeakTrees sharing an index", "[peaks/sharing]") {
+    PeakTree loaded;
+
+    Peak peak1("chr1", 100, 200, "peak1");
+    Peak peak2("chr1", 150, 250, "peak2");
+    Peak peak3("chr2", 100, 200, "peak3");
+
+    loaded.append(peak1);
+    loaded.append(peak2);
+    loaded.append(peak3);
+    loaded.build();
+
+    PeakTree shared(loaded.get_index());
+    REQUIRE(shared.get_index() == loaded.get_index());
+    REQUIRE(shared.size() == 3);
+    REQUIRE(shared.total_peak_territory == loaded.total_peak_territory);
+
+    loaded.record_alignment(Feature("chr1", 125, 175, "hqaa1"), true, false);
+    shared.record_alignment(Feature("chr2", 150, 160, "hqaa2"), true, false);
+
+    std::vector<Peak> loaded_peaks = loaded.list_peaks();
+    REQUIRE(loaded_peaks[0].overlapping_hqaa == 1);
+    REQUIRE(loaded_peaks[1].overlapping_hqaa == 1);
+    REQUIRE(loaded_peaks[2].overlapping_hqaa == 0);
+
+    std::vector<Peak> shared_peaks = shared.list_peaks();
+    REQUIRE(shared_peaks[0].overlapping_hqaa == 0);
+    REQUIRE(shared_peaks[1].overlapping_hqaa == 0);
+    REQUIRE(shared_peaks[2].overlapping_hqaa == 1);
+
+    shared.merge(loaded);
+    REQUIRE(shared.hqaa_in_peaks == 3);
+    REQUIRE(shared.list_peaks()[0].overlapping_hqaa == 1);
+
+    REQUIRE_THROWS_AS(shared.add(peak1), std::logic_error);
+}
+
+
+TEST_CASE("Copies of a PeakTree being built get their own index", "[peaks/copyonwrite]") {
+    PeakTree tree;
+
+    Peak peak1("chr1", 100, 200, "peak1");
+    Peak peak2("chr1", 150, 250, "peak2");
+    tree.add(peak1);
+
+    PeakTree copy(tree);
+    copy.add(peak2);
+
+    REQUIRE(tree.size() == 1);
+    REQUIRE(copy.size() == 2);
+    REQUIRE(tree.get_index() != copy.get_index());
+}
+
+
+TEST_CASE("PeakTree views match its peak lists", "[peaks/views]") {
+    PeakTree tree;
+
+    std::vector<Peak> peaks = {
+        Peak("chr10", 100, 200, "peak1"),
+        Peak("chr2", 100, 400, "peak2"),
+        Peak("chr2", 100, 400, "peak3"),
+        Peak("chr2", 100, 400, "peak4"),
+        Peak("chr2", 50, 60, "peak5"),
+        Peak("chr1", 300, 350, "peak6")
+    };
+    for (Peak& peak : peaks) {
+        tree.append(peak);
+    }
+    tree.build();
+
+    tree.record_alignment(Feature("chr2", 150, 160, "hqaa1"), true, false);
+    tree.record_alignment(Feature("chr1", 310, 320, "hqaa2"), true, false);
+    tree.record_alignment(Feature("chr1", 320, 330, "hqaa3"), true, false);
+
+    std::vector<std::string> names;
+    std::vector<unsigned long long int> counts;
+    std::vector<unsigned long long int> sizes;
+    tree.visit_peaks([&](const char* name, unsigned long long int overlapping_hqaa, unsigned long long int size) {
+        names.push_back(name);
+        counts.push_back(overlapping_hqaa);
+        sizes.push_back(size);
+    });
+
+    std::vector<Peak> listed = tree.list_peaks();
+    REQUIRE(names.size() == listed.size());
+    for (size_t i = 0; i < listed.size(); i++) {
+        REQUIRE(names[i] == listed[i].name);
+        REQUIRE(counts[i] == listed[i].overlapping_hqaa);
+        REQUIRE(sizes[i] == listed[i].size());
+    }
+
+    std::vector<unsigned long long int> expected_counts;
+    for (const Peak& peak : tree.list_peaks_by_overlapping_hqaa_descending()) {
+        expected_counts.push_back(peak.overlapping_hqaa);
+    }
+    REQUIRE(tree.overlapping_hqaa_descending(tree.size()) == expected_counts);
+    expected_counts.resize(2);
+    REQUIRE(tree.overlapping_hqaa_descending(2) == expected_counts);
+
+    std::vector<unsigned long long int> expected_sizes;
+    for (const Peak& peak : tree.list_peaks_by_size_descending()) {
+        expected_sizes.push_back(peak.size());
+    }
+    REQUIRE(tree.sizes_descending() == expected_sizes);
+
+    tree.determine_top_peaks();
+    REQUIRE(tree.top_peak_hqaa_read_count == 2);
+    REQUIRE(tree.top_10_peak_hqaa_read_count == 5);
+}
+
+
+TEST_CASE("PeakTree merging", "[peaks/merge]") {
+    PeakTree tree;
+
+    Peak peak1("chr1", 100, 200, "peak1");
+    Peak peak2("chr1", 150, 250, "peak2");
+    Peak peak3("chr2", 100, 200, "peak3");
+
+    tree.add(peak1);
+    tree.add(peak2);
+    tree.add(peak3);
+
+    PeakTree other(tree);
+
+    tree.record_alignment(Feature("chr1", 125, 175, "hqaa1"), true, false);
+    other.record_alignment(Feature("chr1", 210, 240, "hqaa2"), true, true);
+    other.record_alignment(Feature("chr2", 150, 160, "hqaa3"), true, false);
+    other.record_alignment(Feature("chr3", 150, 160, "nopeak"), false, true);
+
+    tree.merge(other);
+
+    std::vector<Peak> peaks = tree.list_peaks();
+    REQUIRE(peaks[0].overlapping_hqaa == 1);
+    REQUIRE(peaks[1].overlapping_hqaa == 2);
+    REQUIRE(peaks[2].reference == "chr2");
+    REQUIRE(peaks[2].overlapping_hqaa == 1);
+
+    REQUIRE(tree.hqaa_in_peaks == 4);
+    REQUIRE(tree.ppm_in_peaks == 3);
+    REQUIRE(tree.ppm_not_in_peaks == 1);
+    REQUIRE(tree.duplicates_in_peaks == 1);
+    REQUIRE(tree.duplicates_not_in_peaks == 1);
+
+    PeakTree different;
+    different.add(peak1);
+    REQUIRE_THROWS_AS(tree.merge(different), std::out_of_range);
+}
+
+
+TEST_CASE("PeakTree partial state", "[peaks/partialstate]") {
+    PeakTree tree;
+
+    Peak peak1("chr1", 100, 200, "peak1");
+    Peak peak2("chr1", 150, 250, "peak2");
+    Peak peak3("chr2", 100, 200, "peak3");
+
+    tree.add(peak2);
+    tree.add(peak1);
+    tree.add(peak3);
+
+    tree.record_alignment(Feature("chr1", 125, 175, "hqaa1"), true, false);
+    tree.record_alignment(Feature("chr3", 150, 160, "nopeak"), false, true);
+
+    PeakTree restored;
+    restored.load_partial_state(tree.partial_state());
 
-    ReferencePeakCollection chr10 = *tree.get_reference_peaks("chr10");
-    REQUIRE(chr10.peaks[0].overlapping_hqaa == 400);
+    REQUIRE(restored.size() == 3);
+    REQUIRE(restored.total_peak_territory == tree.total_peak_territory);
+    REQUIRE(restored.hqaa_in_peaks == 2);
+    REQUIRE(restored.duplicates_not_in_peaks == 1);
+    REQUIRE(restored.list_peaks() == tree.list_peaks());
 }
 
 
@@ -176,7 +479,7 @@ TEST_CASE("ReferencePeakCollection only accepts peaks on the same reference", "[
     Peak peak2("chr1", 150, 250, "peak2");
     Peak peak3("chr2", 150, 250, "peak3");
 
-    REQUIRE_NOTHROW(rpc.add(peak1));
-    REQUIRE_NOTHROW(rpc.add(peak2));
-    REQUIRE_THROWS_AS(rpc.add(peak3), std::out_of_range);
+    REQUIRE_NOTHROW(rpc.append(peak1));
+    REQUIRE_NOTHROW(rpc.append(peak2));
+    REQUIRE_THROWS_AS(rpc.append(peak3), std::out_of_range);
 }
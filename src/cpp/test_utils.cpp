@@ -142,6 +142,18 @@ TEST_CASE("Test Utils::split", "[utils/split]" ) {
         std::vector<std::string> actual = split("SRR891275.1234567890", "0123456789", true);
         REQUIRE(expected == actual);
     }
+
+    SECTION("Test split of an empty string") {
+        REQUIRE(split("", ",").empty());
+    }
+}
+
+
+TEST_CASE("Test Utils::join", "[utils/join]" ) {
+    REQUIRE(join({"just", "some", "words"}) == "just some words");
+    REQUIRE(join({"just", "some", "words"}, ", ") == "just, some, words");
+    REQUIRE(join({"word"}, ", ") == "word");
+    REQUIRE(join({}, ", ") == "");
 }
 
 TEST_CASE("Test Utils::is_only_digits", "[utils/is_only_digits]" ) {
@@ -0,0 +1,171 @@
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "WorkerPool.hpp"
+
+
+TEST_CASE("WorkerPool runs tasks and reports their completion", "[workerpool/completion]") {
+    WorkerPool pool(4);
+    REQUIRE(pool.size() == 4);
+
+    std::atomic<int> sum(0);
+    std::atomic<int> strange_workers(0);
+    std::set<size_t> submitted;
+    for (int i = 1; i <= 100; i++) {
+        submitted.insert(pool.submit([&sum, &strange_workers, i](int worker) {
+            if (worker < 0 || worker >= 4) {
+                strange_workers++;
+            }
+            sum += i;
+        }));
+    }
+
+    REQUIRE(submitted.size() == 100);
+
+    std::set<size_t> completed;
+    while (pool.outstanding() > 0) {
+        WorkerPool::Completion completion = pool.next_completion();
+        REQUIRE(completion.error == nullptr);
+        completed.insert(completion.task);
+    }
+
+    REQUIRE(completed == submitted);
+    REQUIRE(sum == 5050);
+    REQUIRE(strange_workers == 0);
+
+    REQUIRE_THROWS_AS(pool.next_completion(), std::logic_error);
+}
+
+
+TEST_CASE("WorkerPool returns task exceptions with their completion", "[workerpool/errors]") {
+    WorkerPool pool(2);
+
+    size_t failing_task = pool.submit([](int) {
+        throw std::runtime_error("task failed");
+    });
+    pool.submit([](int) {});
+
+    int errors = 0;
+    while (pool.outstanding() > 0) {
+        WorkerPool::Completion completion = pool.next_completion();
+        if (completion.error) {
+            errors++;
+            REQUIRE(completion.task == failing_task);
+            REQUIRE_THROWS_AS(std::rethrow_exception(completion.error), std::runtime_error);
+        }
+    }
+
+    REQUIRE(errors == 1);
+
+    REQUIRE_THROWS_AS(WorkerPool(0), std::invalid_argument);
+}
+
+
+TEST_CASE("BroadcastRing shows every consumer every slot in order", "[workerpool/broadcast_ring]") {
+    const int consumers = 3;
+    const int values = 1000;
+
+    BroadcastRing ring(4, consumers);
+    REQUIRE(ring.size() == 4);
+
+    std::vector<int> slots(ring.size(), 0);
+    std::vector<long long int> sums(consumers, 0);
+    std::atomic<int> out_of_order(0);
+
+    std::vector<std::thread> threads;
+    for (int consumer = 0; consumer < consumers; consumer++) {
+        threads.emplace_back([&, consumer]() {
+            int last = 0;
+            size_t slot;
+            while (ring.next(consumer, slot)) {
+                if (slots[slot] != last + 1) {
+                    out_of_order++;
+                }
+                last = slots[slot];
+                sums[consumer] += slots[slot];
+                ring.release(consumer);
+            }
+        });
+    }
+
+    for (int value = 1; value <= values; value++) {
+        slots[ring.claim()] = value;
+        ring.publish();
+    }
+    ring.close();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(out_of_order == 0);
+    for (int consumer = 0; consumer < consumers; consumer++) {
+        REQUIRE(sums[consumer] == values * (values + 1) / 2);
+    }
+
+    REQUIRE_THROWS_AS(BroadcastRing(0, 1), std::invalid_argument);
+}
+
+
+TEST_CASE("BroadcastRing stops waiting for abandoned consumers", "[workerpool/broadcast_ring_abandon]") {
+    BroadcastRing ring(2, 2);
+    ring.abandon(1);
+    REQUIRE(ring.abandoned());
+
+    // only the remaining consumer holds slots back
+    size_t slot;
+    for (int i = 0; i < 10; i++) {
+        ring.claim();
+        ring.publish();
+        REQUIRE(ring.next(0, slot));
+        ring.release(0);
+    }
+
+    ring.close();
+    REQUIRE_FALSE(ring.next(0, slot));
+}
+
+
+TEST_CASE("BroadcastRing wakes sleeping consumers and producers", "[workerpool/broadcast_ring_sleep]") {
+    BroadcastRing ring(1, 2);
+
+    std::vector<int> slots(ring.size(), 0);
+    std::vector<int> sums(2, 0);
+
+    // the consumers outwait their yields for each slot, and the
+    // second holds the only slot long enough for the producer to sleep
+    std::vector<std::thread> threads;
+    for (int consumer = 0; consumer < 2; consumer++) {
+        threads.emplace_back([&, consumer]() {
+            size_t slot;
+            while (ring.next(consumer, slot)) {
+                sums[consumer] += slots[slot];
+                if (consumer == 1) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+                ring.release(consumer);
+            }
+        });
+    }
+
+    for (int value = 1; value <= 5; value++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        slots[ring.claim()] = value;
+        ring.publish();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ring.close();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(sums[0] == 15);
+    REQUIRE(sums[1] == 15);
+}